@@ -1,8 +1,22 @@
+#include <string.h>
 #include "EEPROM.h"
+#include "global.h"
 #include "uart.h"
+#include "adc.h"
+#include "ecan.h"
+#include "timer1.h"
 
 
 extern st_CAL g_Config;
+
+// Default calibration gains in Q1.15 millivolts per count (from the measured slopes 819.83, 820.47, 819.19, 819.40, 818.34, 
+// 819.18, 818.76 and 820.04 counts per volt)
+const unsigned int DefaultCalGain[8] = {39969, 39938, 40000, 39990, 40042, 40001, 40021, 39959};
+const unsigned int DefaultCanMessageID[CAN_MESSAGE_COUNT] = {0x600, 0x602, 0x601};
+const uint8_t DefaultCanMessageData[CAN_MESSAGE_COUNT][8] = {
+    {CAN_DATA_CH0_LSB, CAN_DATA_CH0_MSB, CAN_DATA_CH1_LSB, CAN_DATA_CH1_MSB, CAN_DATA_CH2_LSB, CAN_DATA_CH2_MSB, CAN_DATA_CH3_LSB, CAN_DATA_CH3_MSB},
+    {CAN_DATA_CH4_LSB, CAN_DATA_CH4_MSB, CAN_DATA_CH5_LSB, CAN_DATA_CH5_MSB, CAN_DATA_CH6_LSB, CAN_DATA_CH6_MSB, CAN_DATA_SEQUENCE_LSB, CAN_DATA_SEQUENCE_MSB},
+    {CAN_DATA_CH7_LSB, CAN_DATA_CH7_MSB, CAN_DATA_VCC_LSB, CAN_DATA_VCC_MSB, CAN_DATA_SEQUENCE_LSB, CAN_DATA_SEQUENCE_MSB, CAN_DATA_ZERO, CAN_DATA_ZERO}};
 /*
  *      ConfigurationSystemInit() - This function will check the 'configuration memory' for a valid config, and if there populate all of
  *                                  the configuration stuff into the g_Config structure  If the 'configuration memory' is either invalid
@@ -107,30 +121,95 @@ void ConfigurationSystemInit()
 
 bool FillConfigWithDefault(st_CAL* Config)
 {
+   int i;
    if (Config != 0)
    {      
-       // The default config sends out the ADC data over two messages, with 4 channels per message.  The data is the raw ADC values
-       // without any scaling, calibration, offset, or error correction.
+       // The default config sends out the ADC data over two messages: channels 0-3, then channels 4-6 and the sequence number,
+       // 16 bits each, LSB first.  The data is the raw ADC values without any scaling, calibration, offset, or error correction.
+       // A third message with channel 7 and +5VCC is set up but off.
         Config->version=0x01;
-        Config->CanMessage1_ID=0x600;
-        Config->CanMessage1_DATA0=0x01;
-        Config->CanMessage1_DATA1=0x02;
-        Config->CanMessage1_DATA2=0x03;
-        Config->CanMessage1_DATA3=0x04;
-        Config->CanMessage1_DATA4=0x05;
-        Config->CanMessage1_DATA5=0x06;
-        Config->CanMessage1_DATA6=0x07;
-        Config->CanMessage2_ID=0x602;
-        Config->CanMessage2_DATA0=0x08;
-        Config->CanMessage2_DATA1=0x09;
-        Config->CanMessage2_DATA2=0x0a;
-        Config->CanMessage2_DATA3=0x0b;
-        Config->CanMessage2_DATA4=0x0c;
-        Config->CanMessage2_DATA5=0x0d;
-        Config->CanMessage2_DATA6=0x0e;
+        for (i=0; i<CAN_MESSAGE_COUNT; i++)
+        {
+            Config->CanMessages[i].ID = DefaultCanMessageID[i];
+            Config->CanMessages[i].Format = CAN_FORMAT_RAW;
+            Config->CanMessages[i].Length = (i < 2) ? 8 : 0;
+            memcpy(Config->CanMessages[i].Data, DefaultCanMessageData[i], 8);
+        }
         Config->BootCount = 1;
         Config->CanStartup_ID = 0x603;
         Config->CanStartup_SerialNumber = 0x0001;
+        // All channels start at the 100hz output rate, with no oversampling.
+        for (i=0; i<8; i++)
+        {
+            Config->ChannelRate[i] = ADC_RATE_100HZ;
+            Config->ChannelOversample[i] = 0;
+        }
+        // Both channel pairs are held simultaneously when ADC_MODE_SIMULTANEOUS is used.
+        Config->SimultaneousPairs = ADC_PAIR_CH0_CH1 | ADC_PAIR_CH2_CH3;
+        // No ratiometric correction until the sensors are known, corrected to a 5.000V rail.
+        Config->RatiometricChannels = 0;
+        Config->VCCNominalRaw = ADC_VCC_NOMINAL_RAW;
+        // Bench calibration of the prototype board: 5 counts offset, and ~819 counts per volt (1000/slope in Q1.15)
+        for (i=0; i<8; i++)
+        {
+            Config->CalOffset[i] = 5;
+            Config->CalGain[i] = DefaultCalGain[i];
+        }
+        // No linearization by default, the tables are loaded per installation.
+        for (i=0; i<8; i++)
+        {
+            Config->LinearTable[i] = 0;
+        }
+        for (i=0; i<LINEAR_TABLE_COUNT; i++)
+        {
+            Config->LinearTables[i].Points = 0;
+        }
+        // Burst capture is off until a trigger is configured.  The rest is a usable starting point: channel 0, 10ms before and
+        // 40ms after a rising edge through mid scale, drained over CAN.
+        Config->CaptureChannels = 0x01;
+        Config->CaptureTriggerChannel = 0;
+        Config->CaptureTriggerMode = ADC_TRIGGER_NONE;
+        Config->CaptureDrain = ADC_CAPTURE_DRAIN_CAN;
+        Config->CaptureTriggerLevel = 2048;
+        Config->CapturePreTrigger = 100;
+        Config->CaptureLength = 500;
+        Config->CanCapture_ID = 0x604;
+        // Every new value is sent (the original 100hz stream).  The report by exception settings are ready for when 
+        // CAN_REPORT_CHANGE is selected: 4 count deadband, at most 100 frames/s per message, refreshed and heartbeat every second.
+        Config->CanReportMode = CAN_REPORT_PERIODIC;
+        for (i=0; i<8; i++)
+        {
+            Config->Deadband[i] = 4;
+        }
+        Config->ReportMinInterval = 10;
+        Config->ReportMaxInterval = 1000;
+        Config->HeartbeatInterval = 1000;
+        // No stats frames unless asked for.
+        Config->StatsChannels = 0;
+        Config->CanStats_ID = 0x610;
+        // Spike rejection off.  When enabled, a 5 point Hampel that replaces samples more than ~60mV off the median.
+        Config->PrefilterChannels = 0;
+        Config->PrefilterLength = 5;
+        Config->PrefilterThreshold = 50;
+        // No timestamp frames by default.
+        Config->CanTimestampMode = CAN_TIMESTAMP_NONE;
+        Config->CanTimestamp_ID = 0x605;
+        // No sync.  A master sends a SYNC frame every 100ms.
+        Config->SyncMode = SYNC_OFF;
+        Config->SyncInterval = 10;
+        Config->CanSync_ID = 0x606;
+        // Commands are addressed by serial number (0x700 + the low 7 bits), so every board needs its own serial number.
+        Config->CanCommand_ID = 0x700 + (Config->CanStartup_SerialNumber & 0x7F);
+        // 1Mbit/s sampled at 70% solves to the original fixed timing: 20 TQ of 50ns, PropSeg 5, Phase1 8, Phase2 6, SJW 4.
+        Config->CanBitrate = CAN_BITRATE;
+        Config->CanSamplePoint = 70;
+        ECANBitTiming(Config->CanBitrate, Config->CanSamplePoint, &Config->CanTiming);
+        // 11 bit IDs.  In J1939 mode the node claims address 0x80 (the first self-configurable address) and sends 
+        // Proprietary B PGNs 0xFF00 up, priority 6.
+        Config->CanIDMode = CAN_ID_STANDARD;
+        Config->J1939Address = 0x80;
+        Config->J1939Priority = 6;
+        Config->J1939PGN = 0xFF00;
         return true;
        
    }
@@ -27,32 +27,89 @@ extern "C" {
 #define EE_TOTALSIZE 255    // Maximum size of the EE array (255 elements)
 #define EE_DATASPACESIZE 251    // Size of the data area.  It is the total size minus 4 (since we have 4 elements before the data)
 
-#define EE_CURRENT_VERSION 0x01    
+#define EE_CURRENT_VERSION 0x11    
 #define EE_CURRENT_SIGNATURE 0xAA
     
    
     
+// Piecewise-linear linearization tables (see ADCLinearize() in adc.c).  The EE data space only has room for a couple of
+// short tables, so channels select one of the shared tables (LinearTable[ch], 0 = none).
+#define LINEAR_TABLE_COUNT  2
+#define LINEAR_TABLE_POINTS 10
+
+    typedef struct {
+        uint8_t Points;                         // Number of breakpoints in use (0 or 1 = table unused)
+        unsigned int X[LINEAR_TABLE_POINTS];    // Input breakpoints in calibrated millivolts, strictly ascending
+        int Y[LINEAR_TABLE_POINTS];             // Output in engineering units (scaled integer, e.g. 0.1C or 0.1kPa)
+    } st_LinearTable;
+
+// CAN data messages.  Each has a standard ID, a value format (CAN_FORMAT_xxx), a length (0 = message off) and the source
+// of each data byte (CAN_DATA_xxx in ecan.h).  See CompileCANMessages() in ecan.c.
+#define CAN_MESSAGE_COUNT   3
+
+    typedef struct {
+        unsigned int ID;
+        uint8_t Format;
+        uint8_t Length;
+        uint8_t Data[8];
+    } st_CANMessageMap;
+
+// CAN bit timing, in time quanta (TQ) except BRP: TQ = 2 * (BRP + 1) / FCAN, and a bit is 1 (sync) + PropSeg + Phase1 + 
+// Phase2 TQ with the sample point between Phase1 and Phase2.  See ECANBitTiming() in ecan.c.
+    typedef struct {
+        uint8_t BRP;
+        uint8_t PropSeg;
+        uint8_t Phase1;
+        uint8_t Phase2;
+        uint8_t SJW;
+    } st_CANBitTiming;
+
     typedef struct {
         int8_t version;
-        unsigned int CanMessage1_ID;
-        unsigned int CanMessage1_DATA0;
-        unsigned int CanMessage1_DATA1;
-        unsigned int CanMessage1_DATA2;
-        unsigned int CanMessage1_DATA3;
-        unsigned int CanMessage1_DATA4;
-        unsigned int CanMessage1_DATA5;
-        unsigned int CanMessage1_DATA6;
-        unsigned int CanMessage2_ID;
-        unsigned int CanMessage2_DATA0;
-        unsigned int CanMessage2_DATA1;
-        unsigned int CanMessage2_DATA2;
-        unsigned int CanMessage2_DATA3;
-        unsigned int CanMessage2_DATA4;
-        unsigned int CanMessage2_DATA5;
-        unsigned int CanMessage2_DATA6;
+        st_CANMessageMap CanMessages[CAN_MESSAGE_COUNT];
         unsigned int BootCount;
         unsigned int CanStartup_ID;
         unsigned int CanStartup_SerialNumber;
+        uint8_t ChannelRate[8];                 // Output rate of each channel in ADC_FILTER_CIC mode (ADC_RATE_xxx in adc.h)
+        uint8_t ChannelOversample[8];           // Extra bits per channel from oversampling (0 = native 12 bit, 1-4 = 4^n samples per output)
+        uint8_t SimultaneousPairs;              // ADC_PAIR_xxx bits sampled together (10 bit) in ADC_MODE_SIMULTANEOUS
+        uint8_t RatiometricChannels;            // Bit per channel corrected for +5VCC supply changes
+        unsigned int VCCNominalRaw;             // +5VCC reference reading the ratiometric channels are corrected to
+        unsigned int CalOffset[8];              // Per channel calibration offset (12 bit ADC counts at 0V)
+        unsigned int CalGain[8];                // Per channel calibration gain (unsigned Q1.15 millivolts per ADC count)
+        uint8_t LinearTable[8];                 // Per channel linearization table (1..LINEAR_TABLE_COUNT, 0 = millivolts as is)
+        st_LinearTable LinearTables[LINEAR_TABLE_COUNT];
+        uint8_t CaptureChannels;                // Burst capture (see ADCCaptureArm()), bit per channel captured
+        uint8_t CaptureTriggerChannel;
+        uint8_t CaptureTriggerMode;             // ADC_TRIGGER_xxx, ADC_TRIGGER_NONE = no capture
+        uint8_t CaptureDrain;                   // ADC_CAPTURE_DRAIN_xxx
+        unsigned int CaptureTriggerLevel;       // Raw ADC counts (level triggers) or counts per 100us (slope trigger)
+        unsigned int CapturePreTrigger;         // Scans (100us each) kept from before the trigger
+        unsigned int CaptureLength;             // Total scans in the capture
+        unsigned int CanCapture_ID;             // CAN ID the capture is drained on
+        uint8_t CanReportMode;                  // CAN_REPORT_PERIODIC, CAN_REPORT_CHANGE or CAN_REPORT_POLL (see TransmitUpdatedCANPackets())
+        uint8_t Deadband[8];                    // Per channel change needed to report, in the units of the channel's message
+        unsigned int ReportMinInterval;         // CAN_REPORT_CHANGE: minimum ms between two frames of a message
+        unsigned int ReportMaxInterval;         // CAN_REPORT_CHANGE: a message is refreshed at least this often (ms, 0 = never)
+        unsigned int HeartbeatInterval;         // CAN_REPORT_CHANGE/POLL: ms between heartbeats on CanStartup_ID (0 = none)
+        uint8_t StatsChannels;                  // Bit per channel with a CAN stats frame (see TransmitADCStatsFrame())
+        unsigned int CanStats_ID;               // Stats frame of channel n goes out on CanStats_ID + n
+        uint8_t PrefilterChannels;              // Bit per channel with the spike rejection prefilter (see ADCPrefilterPut())
+        uint8_t PrefilterLength;                // Median of 3 or 5 samples
+        unsigned int PrefilterThreshold;        // Counts from the median before a sample is replaced (0 = plain median)
+        uint8_t CanTimestampMode;               // CAN_TIMESTAMP_NONE or CAN_TIMESTAMP_FRAME (see TransmitCANTimestampFrame())
+        unsigned int CanTimestamp_ID;
+        uint8_t SyncMode;                       // SYNC_OFF, SYNC_MASTER or SYNC_SLAVE (see SyncTick())
+        uint8_t SyncInterval;                   // SYNC_MASTER: 10ms units between SYNC frames
+        unsigned int CanSync_ID;
+        unsigned int CanCommand_ID;             // This node's remote commands (see ProcessECANCommands()), replies 0x80 higher
+        unsigned long CanBitrate;               // Bits per second
+        uint8_t CanSamplePoint;                 // Wanted sample point, % of the bit
+        st_CANBitTiming CanTiming;              // As solved for CanBitrate and CanSamplePoint (or set by hand)
+        uint8_t CanIDMode;                      // CAN_ID_STANDARD or CAN_ID_J1939 (see J1939Tick())
+        uint8_t J1939Address;                   // CAN_ID_J1939: preferred source address
+        uint8_t J1939Priority;                  // CAN_ID_J1939: priority (0-7) of the data, stats, timestamp and heartbeat PGNs
+        unsigned int J1939PGN;                  // CAN_ID_J1939: first of this node's PGNs (J1939_PGN_xxx are offsets from it)
         
     } st_CAL;
     
@@ -62,30 +119,6 @@ extern "C" {
     bool FillConfigWithDefault(st_CAL* Config);
     extern st_CAL g_Config;
     
-    
-/*
- Message_DATA types
- *      0x00 = Fill with zero
- *      0x01 = CH0 LSB
- *      0x02 = CH0 MSB
- *      0x04 = CH1 LSB
- *      0x05 = CH1 MSB
- *      0x06 = CH2 LSB
- *      0x07 = CH2 MSB
- *      0x08 = CH3 LSB
- *      0x09 = CH3 MSB
- *      0x0a = CH4 LSB
- *      0x0b = CH4 MSB 
- *      0x0c = CH5 LSB
- *      0x0d = CH5 MSB 
- *      0x0e = CH6 LSB
- *      0x0f = CH6 MSB  
- *      0x10 = CH7 LSB
- *      0x11 = CH7 MSB
- * 
- * 
- */
-    
 
 #ifdef	__cplusplus
 }
@@ -10,25 +10,98 @@
 #include "adc.h"
 #include "global.h"
 #include "system.h"
+#include "timer1.h"
 
-// filter taps for FIR filter - 10 taps, precomputed
-//  These coefficients are sized to be 16 bits on the right side of the decimal point (so all of these are less than 1, and add up to 1)
-//  To use the coefficients, multiple each of these numbers by the signal at that location in the buffer, add up all the results, than
-//  divide by 65526 (>>16).    For this to work the accumlator has to be big enough to handle the maximum sample value 
-//  (4096 in my case) * 65536.
-/*static int filter_taps[10] = {
-  315,
-  1631,
-  3447,
-  5535,
-  6883,
-  6883,
-  5535,
-  3447,
-  1631,
-  315
-};*/
+// Default Q15 low pass taps for the FIR decimator - 16 taps, Hamming windowed sinc with a 40Hz cutoff at the 1KHz sample rate.
+//  The taps add up to ~1.0 (32766/32768), so the filter has unity gain on the 12 bit ADC values.  They live in Y memory so
+//  the DSP MAC unit can fetch them alongside the sample history in X memory.
+int g_ADCFIRDefaultTaps[16] __attribute__((space(ymemory))) = {
+  178,
+  323,
+  729,
+  1405,
+  2275,
+  3181,
+  3933,
+  4359,
+  4359,
+  3933,
+  3181,
+  2275,
+  1405,
+  729,
+  323,
+  178
+};
 
+// Compensating FIR for the CIC decimator (ADC_FILTER_CIC).  11 taps at twice the output rate, decimating 2:1.  Least squares 
+// fit to the inverse of the 3rd order CIC droop up to 0.3 of the output rate, and a stop band from 0.7 of the output rate.
+int g_ADCCICCompensationTaps[11] __attribute__((space(ymemory))) = {
+  701,
+  103,
+  -2887,
+  -865,
+  10408,
+  17846,
+  10408,
+  -865,
+  -2887,
+  103,
+  701
+};
+
+// The 500hz rate has no CIC stage (decimation 1, so no droop to correct), so it only needs a plain 2:1 half band low pass.
+int g_ADCHalfBandTaps[11] __attribute__((space(ymemory))) = {
+  531,
+  0,
+  -2246,
+  0,
+  9931,
+  16334,
+  9931,
+  0,
+  -2246,
+  0,
+  531
+};
+
+// Total decimation from the 1KHz sample rate for each ADC_RATE_xxx output rate.
+const unsigned int g_ADCOutputRateDecimation[ADC_RATE_COUNT] = {100, 20, 10, 2};
+
+st_ADCCICFilter g_ADCCICFilters[8];
+
+// Filtered +5VCC reference (single pole IIR, see UpdateRatiometricCompensation()).  l_ADCVCCFilterSum holds 
+// 2^ADC_VCC_FILTER_SHIFT times the filtered value, and is 0 until the first VCC sample arrives.
+unsigned long l_ADCVCCFilterSum = 0;
+
+// The published snapshot, and its sequence counter.  The counter is odd while PublishADCSnapshot() is writing.
+volatile st_ADCSnapshot l_ADCSnapshot;
+volatile unsigned int l_ADCSnapshotSequence = 0;
+
+// Per channel statistics: the window being accumulated, and the last complete window of each channel (see ADCStatsPut()).
+// g_ADCStatsPending has a bit per channel with a latched window not yet sent in a CAN stats frame.
+st_ADCStats l_ADCStatsWindow[8];
+st_ADCStats g_ADCStats[8];
+unsigned int g_ADCStatsPending = 0;
+
+// Spike rejection prefilter (see ADCPrefilterPut()).  The last ADC_PREFILTER_MAX_LENGTH samples of each channel, oldest first,
+// a bit per channel whose history has been filled, and the number of samples replaced on each channel.
+unsigned int l_ADCPrefilterHistory[8][ADC_PREFILTER_MAX_LENGTH];
+unsigned int l_ADCPrefilterPrimed = 0;
+unsigned int g_ADCPrefilterOutliers[8];
+
+// Compare-exchange for the median sorting networks: afterwards a <= b.  Always the same work whatever the data.
+#define ADC_SORT2(a,b)  { unsigned int low = ((a) < (b)) ? (a) : (b); (b) = ((a) < (b)) ? (b) : (a); (a) = low; }
+
+// Per channel oversample and decimate state, and a bit per channel that has oversampling enabled.
+st_ADCOversample g_ADCOversample[8];
+unsigned int g_ADCOversampleChannels = 0;
+
+// Per channel FIR decimator state, and the delay lines for each channel.  Each delay line is twice ADC_FIR_MAX_TAPS long and
+// every sample is written twice (at index and index+NumTaps), so the newest NumTaps samples are always contiguous and the 
+// MAC loop never has to wrap.
+st_ADCFIRFilter g_ADCFIRFilters[8];
+int l_ADCFIRHistory[8][ADC_FIR_MAX_TAPS*2] __attribute__((space(xmemory)));
 
 /*
  * Routines for manipulating the Analog to Digital Converter on the PIC dsp33 microcontroller.
@@ -36,9 +109,48 @@
  *      AN1, AN2, AN3, AN4, AN5, AN9, AN10, AN11, AN12 (9 inputs total)
  */
 
+// DMA ping-pong buffers for the ADC scan mode.  DMA1 fills one while the Timer1 interrupt reads the other.  Each block holds
+// ADC_SCAN_REPEAT scans of AN0-AN5 and AN9-AN12 in conversion order.
+unsigned int adc1ScanBufA[ADC_SCAN_BLOCK_LENGTH] __attribute__((space(dma)));
+unsigned int adc1ScanBufB[ADC_SCAN_BLOCK_LENGTH] __attribute__((space(dma)));
+
+// Position of each of the 8 external channels inside a scan.  Entry 0 is the AN0 (VRef+) dummy and entry 5 is AN5 (1/3 +5VCC).
+const unsigned int l_ADCScanBlockIndex[8] = {1,2,3,4,6,7,8,9};
+#define ADC_SCAN_VCC_INDEX 5
+
+// Analog input (ANx) of each of the 8 external channels, plus AN5 (1/3 +5VCC) as entry 8.
+const unsigned int l_ADCChannelInput[9] = {1,2,3,4,9,10,11,12,5};
+
+// Average hold instant (TMR1 count) of scan entry n over the ADC_SCAN_REPEAT scans of a block.  Timer3 starts half a period in 
+// and converts every ADC_SCAN_PR3+1 cycles, and TMR1 counts every 64 cycles.
+#define ADC_SCAN_SAMPLE_TIME(n) ((((ADC_SCAN_PR3 + 1) / 2) + \
+                                 ((n) + (ADC_SCAN_LENGTH * (ADC_SCAN_REPEAT - 1)) / 2) * (ADC_SCAN_PR3 + 1)) / 64)
+
+// Cycles of Timer3 shift still to apply, see ADCScanTimerShift()
+int l_ADCScanShiftPending = 0;
+
+// Timebase (us) of the Timer1 tick being processed, see CollectAllADCSamples()
+unsigned long l_ADCTickTime = 0;
+
+// Burst capture state, and the ring the selected channels are captured into (see ADCCapturePut())
+st_ADCCapture g_ADCCapture;
+unsigned int l_ADCCaptureBuffer[ADC_CAPTURE_BUFFER_LENGTH];
+volatile unsigned int l_ADCCaptureForce = 0;
+
+// Current ADC resolution in ADC_MODE_SIMULTANEOUS (1 = 12 bit sequential, 0 = 10 bit simultaneous).  See SetADCResolution().
+unsigned int l_ADC12Bit = 1;
+
+// Number of samples since the last moving average output (see UpdateMovingAverages())
+unsigned int l_ADCAveragePhase = 0;
+
+// Number of scan blocks already consumed by CollectADCScanBlock().  Compared against g_ADCScanBlocks (from the DMA1 interrupt).
+unsigned int l_ADCScanBlocksConsumed = 0;
+
  /* 
   *      SetupADC() - Configure and enable the ADC Unit for 9 analog inputs.   No parameters, and no return variable.
   *                   Failure mode - ADC could fail to enable, but no way to detect that.
+  *                   In ADC_MODE_DMA_SCAN the ADC and DMA1 are armed here, but nothing is converted until Timer3 is 
+  *                   started (see SetupADCScanTimer() and SetupTimer1()).
   */
 
 
@@ -50,27 +162,151 @@ void SetupADC()
     AD1CON2bits.VCFG = 0b001;       // VRef+ is External VRef+ (AN0, 2.5Vs), VRef- is Vss(ground)
     AD1CON1bits.AD12B = 1;          // 12 bit single channel ADC
     AD1CON1bits.FORM = 0b00;        // Integer output
-    AD1CON1bits.SSRC = 0b000;       // Clearing SAMP bit ends sampling and starts conversion.  This is for a simple polled sampling.
-    AD1CON1bits.ASAM = 0b0;         // Sampling starts when SAMP bit set.  This is for simple polled sampling.
-    AD1CON3bits.SAMC = 8;           // Autosample time set to 8*Tad (Not used for simple polling). This would ba a sample time of 2us.
     AD1CON3bits.ADRC = 1;           // Use the internal RC ADC clock which is is 4MHz (250ns)
     AD1CHS0bits.CH0NA = 0;          // Channel 0/A Negative input is VRef - (which is ground)
     AD1CHS0bits.CH0SA = 0;          // Channel 0/A Positive input is AN0
+
+    if (g_ADCAcquisitionMode == ADC_MODE_DMA_SCAN)
+    {
+        AD1CON1bits.SSRC = 0b010;       // Timer3 compare ends sampling and starts conversion.
+        AD1CON1bits.ASAM = 0b1;         // Sampling restarts right after each conversion, so each input samples for ~6.5us.
+        AD1CON1bits.ADDMABM = 1;        // DMA buffers are written in the order of conversion.
+        AD1CON2bits.CSCNA = 1;          // Scan the inputs selected in AD1CSSL on CH0+.
+        AD1CON2bits.SMPI = 0;           // Generate a DMA request after every conversion.
+        AD1CSSL = 0b0001111000111111;   // Scan AN0-AN5 and AN9-AN12 (10 conversions, repeated for the whole block).
+
+        // Configure DMA Channel 1 to move each ADC1BUF0 result into the ping-pong buffers.
+        // DMA1CON - Word transfer, Peripheral to RAM, Interrupt on full block, Register Indirect with Post-Increment, 
+        //           Continuous Ping-Pong mode.
+        DMA1CONbits.CHEN = 0;
+        DMA1CON = 0x0002;
+        DMA1PAD = (volatile unsigned int)&ADC1BUF0;
+        DMA1CNT = ADC_SCAN_BLOCK_LENGTH - 1;
+        // DMA1REQ - DMA Request from ADC1 Convert Done (IRQ 13)
+        DMA1REQ = 13;
+        DMA1STA = __builtin_dmaoffset(adc1ScanBufA);
+        DMA1STB = __builtin_dmaoffset(adc1ScanBufB);
+
+        // The DMA1 interrupt fires once per completed block and records which half of the ping-pong buffer is ready.
+        IPC3bits.DMA1IP = 2;
+        IFS0bits.DMA1IF = 0;
+        IEC0bits.DMA1IE = 1;
+        DMA1CONbits.CHEN = 1;
+    }
+    else
+    {
+        AD1CON1bits.SSRC = 0b000;       // Clearing SAMP bit ends sampling and starts conversion.  This is for a simple polled sampling.
+        AD1CON1bits.ASAM = 0b0;         // Sampling starts when SAMP bit set.  This is for simple polled sampling.
+        AD1CON3bits.SAMC = 8;           // Autosample time set to 8*Tad (Not used for simple polling). This would ba a sample time of 2us.
+        if (g_ADCAcquisitionMode == ADC_MODE_SIMULTANEOUS)
+        {
+            // These only take effect while AD12B = 0 (see SetADCResolution()).  In 10 bit mode CH0-CH3 are all sampled and
+            // held on the same SAMP edge and then converted one after the other into ADC1BUF0-ADC1BUF3.
+            AD1CON2bits.CHPS = 0b10;    // Convert CH0, CH1, CH2 and CH3
+            AD1CON1bits.SIMSAM = 1;     // Sample CH0-CH3 simultaneously
+            AD1CON2bits.SMPI = 0;       // AD1IF is set after every sample/convert sequence (all 4 channels)
+            AD1CHS123bits.CH123NA = 0;  // CH1-CH3 Negative inputs are VRef-
+            l_ADC12Bit = 1;
+        }
+    }
     //enable the ADC unit
     AD1CON1bits.ADON = 1;
 }
 
+/*
+ *      SetupADCScanTimer() - Configure Timer3 as the conversion trigger for ADC_MODE_DMA_SCAN.  Timer3 runs at 100KHz so one 
+ *                            scan block (ADC_SCAN_REPEAT scans) takes exactly one 1ms Timer1 period.  The timer is only configured here, SetupTimer1()
+ *                            starts it together with Timer1 so the two stay in phase.
+ */
+void SetupADCScanTimer()
+{
+    T3CONbits.TON = 0;          // Disable Timer
+    T3CONbits.TCS = 0;          // Select internal instruction cycle clock
+    T3CONbits.TGATE = 0;        // Disable Gated Timer mode
+    T3CONbits.TCKPS = 0b00;     // 1:1 Prescaler
+    // Start half way through the first period.  The last conversion of each block then completes ~5us before the next 
+    // Timer1 interrupt, so that interrupt always finds a complete block waiting.
+    TMR3 = (ADC_SCAN_PR3 + 1) / 2;
+    PR3 = ADC_SCAN_PR3;
+    l_ADCScanShiftPending = 0;
+    IFS0bits.T3IF = 0;
+    // The ADC uses the compare event directly.  The interrupt is only on for a slot ADCScanTimerShift() changed, and is above
+    // everything but the timebase so PR3 is back before the next slot ends.
+    IPC2bits.T3IP = 5;
+    IEC0bits.T3IE = 0;
+}
+
+/*
+ *      ADCScanTimerShift() - Move the Timer3 conversion triggers by 'cycles' (+ later, - earlier) to follow a Timer1 period 
+ *                            that SyncTick() has lengthened or shortened, so the scan block still lines up with the tick.  
+ *                            TMR3 is never written, as a read-modify-write of the running timer loses the cycles between the
+ *                            two.  Instead the current conversion slot gets a longer or shorter PR3, and the Timer3 interrupt
+ *                            at its end puts ADC_SCAN_PR3 back (ADCScanTimerRestore()).  A slot is only changed while TMR3 is
+ *                            ADC_SCAN_SHIFT_MARGIN cycles or more short of both periods, so the match can't pass during the
+ *                            change.  This never waits: what can't be applied now (a slot already changed, or too late in the
+ *                            slot) is carried to the next call.  The Timer1 interrupt runs near the middle of a slot, so a 
+ *                            shift of SYNC_MAX_SLEW TMR1 counts normally goes at once.
+ */
+#define ADC_SCAN_SHIFT_MARGIN   16
+#define ADC_SCAN_SHIFT_MAX      ((ADC_SCAN_PR3 + 1) / 2)
+void ADCScanTimerShift(int cycles)
+{
+    unsigned int now, amount;
+
+    l_ADCScanShiftPending += cycles;
+    if ((l_ADCScanShiftPending == 0) || IEC0bits.T3IE)
+    {
+        return;
+    }
+    __builtin_disi(0x3FFF);
+    now = TMR3;
+    if (l_ADCScanShiftPending > 0)
+    {
+        // Later: this slot is lengthened.
+        amount = ((unsigned int)l_ADCScanShiftPending < ADC_SCAN_SHIFT_MAX) ? (unsigned int)l_ADCScanShiftPending : 
+                 ADC_SCAN_SHIFT_MAX;
+        amount = (now < (ADC_SCAN_PR3 - ADC_SCAN_SHIFT_MARGIN)) ? amount : 0;
+        PR3 = ADC_SCAN_PR3 + amount;
+        l_ADCScanShiftPending -= amount;
+    }
+    else
+    {
+        // Earlier: this slot is shortened, the new period still ahead of TMR3 by the margin.
+        amount = (now < (ADC_SCAN_PR3 - ADC_SCAN_SHIFT_MARGIN)) ? (ADC_SCAN_PR3 - ADC_SCAN_SHIFT_MARGIN - now) : 0;
+        amount = ((unsigned int)(-l_ADCScanShiftPending) < amount) ? (unsigned int)(-l_ADCScanShiftPending) : amount;
+        PR3 = ADC_SCAN_PR3 - amount;
+        l_ADCScanShiftPending += amount;
+    }
+    if (amount != 0)
+    {
+        IFS0bits.T3IF = 0;
+        IEC0bits.T3IE = 1;
+    }
+    __builtin_disi(0);
+}
+
+/*
+ *      ADCScanTimerRestore() - From the Timer3 interrupt, at the end of the slot ADCScanTimerShift() changed: the next slots 
+ *                              are ADC_SCAN_PR3 again.
+ */
+void ADCScanTimerRestore()
+{
+    PR3 = ADC_SCAN_PR3;
+    IEC0bits.T3IE = 0;
+}
+
 /* 
   *      GetADCSample - Get a single channel sample (passed in as a parameter)
   *                     Return value is the data value, or 0 if the channel number is bad
   *                     which is not particularly useful. ;)
+  *                     Only available in ADC_MODE_POLLED, since in the scan mode the ADC belongs to Timer3/DMA1.
   */
 unsigned int GetSingleADCSample(unsigned int channel)
 {
     unsigned int value=0;
    
     // AD1-AD12 are connected.  AD0 is VRef+.
-    if (channel <= 12)
+    if ((channel <= 12) && (g_ADCAcquisitionMode == ADC_MODE_POLLED))
     {      
         // Channel 0/A Positive input is ANx
         AD1CHS0bits.CH0SA = channel;          
@@ -93,75 +329,122 @@ unsigned int GetSingleADCSample(unsigned int channel)
 
 /* 
   *      CollectAllADCSamples() - Collect all 8 ADC data elements plus the 5v rail reference..  This procedure captures data 
-  *             from the 8 analog channels and stores them in the global g_ADCValuesBuffer array (Size 8*10).  That array hold 
-  *             the previous 10 samples of each channel, and those 10 samples are used to generate an average value that is then 
-  *             placed into the ADCBuffer array (Size 8).     (Thus the ADCBuffer array is a 10:1 decimation of the call rate)
-  *             NOTE:  The final version of this will replace the 'average' routine with an FIR filter.
+  *             from the 8 analog channels and stores them as one row of the global g_ADCValuesBuffer array (sample major, 
+  *             [sample][channel]).  That array holds the previous g_ADCAverageWindow samples of each channel, and a running 
+  *             sum of that window is used to generate an average value every g_ADCAverageDecimation samples that is then 
+  *             placed into the g_ADCValues array.  (By default a 10 sample window every 10th call, so a 10:1 decimation)
+  *             The samples come either from the last completed DMA scan block, the polled fallback, or the polled 
+  *             simultaneous sampling mode, based on g_ADCAcquisitionMode.  The hold instant of each channel is left in
+  *             g_ADCSampleTime[].
+  *             With g_ADCFilterMode set to ADC_FILTER_FIR the average is replaced by the per channel FIR decimators.
   */
 
 void CollectAllADCSamples()
 {
-    unsigned int channelnumber;
     unsigned int stoptime;
-    
-    // AD1,2,3,4 and AD9,10,11,12 are connected to analog inputs, and AD5 is connected to 1/3 +5VCC.
-    // Let's loop and sample all 8 external channels, plus the +5VCC one.
-    for (channelnumber=0;channelnumber<=8;channelnumber++)
+    unsigned int channelnumber;
+
+    // Timebase of the start of this Timer1 period (TMR1 has counted on since the tick).
+    l_ADCTickTime = ReadTimebase() - TIMER1_TICKS_TO_US(TMR1);
+
+    if (g_ADCAcquisitionMode == ADC_MODE_DMA_SCAN)
     {
-        switch(channelnumber)
-        {
-            case 0:
-            case 1:
-            case 2:
-            case 3:
-                AD1CHS0bits.CH0SA = channelnumber+1;
-                break;
-            case 4:
-            case 5:
-            case 6:
-            case 7:
-               AD1CHS0bits.CH0SA = channelnumber+5;
-                break;
-            case 8:
-                // the 9th channel will be channel 5 which has a 1/3 VCC +5V connected (for ratiometric reference)
-                AD1CHS0bits.CH0SA = 5;
+        // If the DMA has not completed a new block since the last tick there is nothing to add to the averaging array.
+        if (!CollectADCScanBlock())
+        {
+            return;
         }
+    }
+    else if (g_ADCAcquisitionMode == ADC_MODE_SIMULTANEOUS)
+    {
+        CollectSimultaneousADCSamples();
+    }
+    else
+    {
+        CollectPolledADCSamples();
+    }
 
-        // Setting SAMP to 1 starts the sample process.   We will wait 8us, then stop sampling.
-        AD1CON1bits.SAMP = 1;
-        DelayuS(8);                     // 8us Sample Settle time
-        AD1CON1bits.SAMP = 0;
+    // Track the +5VCC rail and correct the ratiometric channels in place, so everything downstream (all filter modes and CAN)
+    // sees supply compensated samples.
+    UpdateRatiometricCompensation();
 
-        // Once sampleing is stopped, converstion automaticly starts.   The AD1CON1bits.DONE indicates when the conversion 
-        // is complete.
-        while (!AD1CON1bits.DONE);      // Wait for conversion to complete (~1us)
-        
-        //  Conversion is complete, lets get the analog value from the ADC buffer and put in the averaging array.
-        //  g_ADCValuesBufferIndex is incremented and loops at g_ADCBufferSize
+    // Stamp the sample set with the hold instant of channel 0.  A scan block was sampled during the previous Timer1 period,
+    // the polled modes sample during this one.
+    g_ADCTimestamp = l_ADCTickTime + TIMER1_TICKS_TO_US(g_ADCSampleTime[0]);
+    if (g_ADCAcquisitionMode == ADC_MODE_DMA_SCAN)
+    {
+        g_ADCTimestamp -= TIMER1_TICKS_TO_US(PR1 + 1);
+    }
 
-        // If we are getting the 5V VCC measurement put that in a different place.
-        if (channelnumber==8)
+    // Spike rejection on the channels that have it, also in place, so the statistics and every filter mode see cleaned samples.
+    if (g_Config.PrefilterChannels != 0)
+    {
+        for (channelnumber=0;channelnumber<=7;channelnumber++)
         {
-            g_ADC5VReferenceRaw = ADC1BUF0;
+            if (g_Config.PrefilterChannels & (1 << channelnumber))
+            {
+                g_ADCValuesBuffer[g_ADCValuesBufferIndex][channelnumber] = 
+                    ADCPrefilterPut(channelnumber, g_ADCValuesBuffer[g_ADCValuesBufferIndex][channelnumber]);
+            }
+        }
+    }
+
+    // The running sums are kept up to date on every sample (8 adds and 8 subtracts) so switching filters never needs a refill.
+    UpdateMovingAverages();
+
+    // Run each channel through its decimator.  Oversampled channels (g_ADCOversampleChannels) always use the oversampler, the 
+    // others use the FIR or CIC decimators, which keep their own history and decide when to produce an output.
+    // (In ADC_FILTER_BOXCAR mode the outputs come from UpdateMovingAverages() above)
+    for (channelnumber=0;channelnumber<=7;channelnumber++)
+    {
+        unsigned int sample = g_ADCValuesBuffer[g_ADCValuesBufferIndex][channelnumber];
+        bool updated;
+
+        ADCStatsPut(channelnumber, sample);
+
+        if (g_ADCOversampleChannels & (1 << channelnumber))
+        {
+            updated = ADCOversamplePut(channelnumber, sample, &g_ADCValues[channelnumber]);
+        }
+        else if (g_ADCFilterMode == ADC_FILTER_FIR)
+        {
+            updated = ADCFIRPut(channelnumber, sample, &g_ADCValues[channelnumber]);
+        }
+        else if (g_ADCFilterMode == ADC_FILTER_CIC)
+        {
+            updated = ADCCICPut(channelnumber, sample, &g_ADCValues[channelnumber]);
         }
         else
         {
-            g_ADCValuesBuffer[channelnumber][g_ADCValuesBufferIndex]=ADC1BUF0;
+            updated = false;
+        }
+        if (updated)
+        {
+            g_ADCUpdatedChannels |= (1 << channelnumber);
         }
-        
-        // increment a statistics global
-        g_ADCCaptures++;
     }
 
-    g_ADCValuesBufferIndex = (g_ADCValuesBufferIndex + 1) %  g_ADCBufferSize;
-    // Now that we have captured all 8 channels, if we have collected 10 samples ( we can tell that because the 
-    // g_ADCValuesBufferIndex has looped back around to 0 ) we will compute the average and store that in the 
-    // ADCValues array.  (thus a 10:1 decimation)
-    // g_ADCValuesBufferIndex points to the location of the next sample, which if equal to zero means we have collected 10 samples
-    // and the last sample is at location 9.   For an FIR filter, we will start at 9 and decrement to 0 appying the filter coefficients.
-    if ( g_ADCValuesBufferIndex == 0)
+    // Convert every channel that has a new value (from any of the decimators) to calibrated millivolts, and then through
+    // the channel's linearization table to engineering units.  The statistics window of the channel closes with it.
+    if (g_ADCUpdatedChannels != 0)
     {
-        FilterAndDecimateSamples();        
+        for (channelnumber=0;channelnumber<=7;channelnumber++)
+        {
+            if (g_ADCUpdatedChannels & (1 << channelnumber))
+            {
+                g_ADCMillivolts[channelnumber] = ADCCalibrate(channelnumber, g_ADCValues[channelnumber]);
+                g_ADCEngineering[channelnumber] = ADCLinearize(g_Config.LinearTable[channelnumber], g_ADCMillivolts[channelnumber]);
+                ADCStatsLatch(channelnumber);
+            }
+        }
+    }
+
+    // g_ADCValuesBufferIndex points to the row the next capture goes in.  The ring is one row longer than the window so the
+    // sample leaving the window is still there when UpdateMovingAverages() subtracts it.
+    g_ADCValuesBufferIndex++;
+    if (g_ADCValuesBufferIndex > g_ADCAverageWindow)
+    {
+        g_ADCValuesBufferIndex = 0;
     }
         
     //  For diagnostic purposes we will record the maximum Timer1 value as an indication of how long this conversion took
@@ -172,74 +455,1095 @@ void CollectAllADCSamples()
 }
 
 /* 
-  *      FilterAndDecimateSamples - This funcion takes 10 samples stored in g_ADCValuesBuffer[channel][sample] and does
-  *                                 averaging to generate a single output value per channel, thus performing both a filtering
-  *                                 and decimation.  That output vale is placed in g_ADCValues[channel].    This function will 
-  *                                 optionally perform an interger FIR filter (code removed)
+  *      CollectADCScanBlock() - Average the scans of the most recently completed DMA scan block into the averaging array, and
+  *             hand the individual scans to the burst capture.  The DMA1 interrupt records which half of the ping-pong buffer 
+  *             is complete (g_ADCScanBlockReady) and counts blocks (g_ADCScanBlocks).
+  *             Returns false if no new block has completed since the last call, true if a block was consumed.
+  */
+bool CollectADCScanBlock()
+{
+    unsigned int channelnumber;
+    unsigned int scan;
+    unsigned int sum;
+    unsigned int* block;
+
+    if (g_ADCScanBlocks == l_ADCScanBlocksConsumed)
+    {
+        g_ADCScanMissedBlocks++;
+        return false;
+    }
+    // If more than one block completed since the last tick, only the newest one is used.
+    l_ADCScanBlocksConsumed = g_ADCScanBlocks;
+    block = (g_ADCScanBlockReady == 0) ? adc1ScanBufA : adc1ScanBufB;
+
+    // The block was sampled during the previous Timer1 period, at fixed points set by Timer3.  The regular stream gets the
+    // (rounded) average of the scans, so it still sees one 1KHz sample per channel.  ADC_SCAN_REPEAT 12 bit values fit in 16 bits.
+    for (channelnumber=0;channelnumber<=8;channelnumber++)
+    {
+        unsigned int index = (channelnumber == 8) ? ADC_SCAN_VCC_INDEX : l_ADCScanBlockIndex[channelnumber];
+
+        sum = ADC_SCAN_REPEAT / 2;
+        for (scan=0;scan<ADC_SCAN_REPEAT;scan++)
+        {
+            sum += block[index + (scan * ADC_SCAN_LENGTH)];
+        }
+        if (channelnumber == 8)
+        {
+            g_ADC5VReferenceRaw = sum / ADC_SCAN_REPEAT;
+        }
+        else
+        {
+            g_ADCValuesBuffer[g_ADCValuesBufferIndex][channelnumber] = sum / ADC_SCAN_REPEAT;
+        }
+        g_ADCSampleTime[channelnumber] = ADC_SCAN_SAMPLE_TIME(index);
+    }
+
+    ADCCapturePut(block);
+
+    // increment a statistics global (9 useful conversions per scan)
+    g_ADCCaptures += 9 * ADC_SCAN_REPEAT;
+    return true;
+}
+
+/* 
+  *      CollectPolledADCSamples() - The original (ADC_MODE_POLLED) capture path.  Each of the 9 inputs is selected, sampled
+  *             for 8us and converted while this routine busy waits.  Results go in the averaging array at g_ADCValuesBufferIndex.
+  */
+void CollectPolledADCSamples()
+{
+    unsigned int channelnumber;
+    
+    // AD1,2,3,4 and AD9,10,11,12 are connected to analog inputs, and AD5 is connected to 1/3 +5VCC.
+    // Let's loop and sample all 8 external channels, plus the +5VCC one.
+    for (channelnumber=0;channelnumber<=8;channelnumber++)
+    {
+        CollectSequentialADCSample(channelnumber);
+    }
+}
+
+/* 
+  *      CollectSequentialADCSample() - Sample and convert one channel (0-7, or 8 for the 1/3 +5VCC input) on CH0 in 12 bit mode,
+  *             busy waiting for the 8us sample time and the conversion.  The result goes in the averaging array at 
+  *             g_ADCValuesBufferIndex (or g_ADC5VReferenceRaw), and the hold instant in g_ADCSampleTime[channel].
   */
-void FilterAndDecimateSamples()
+void CollectSequentialADCSample(unsigned int channelnumber)
 {
-    unsigned int channelnumber,samplenumber;
-    unsigned int avg,sum;
+    // the 9th channel will be channel 5 which has a 1/3 VCC +5V connected (for ratiometric reference)
+    AD1CHS0bits.CH0SA = l_ADCChannelInput[channelnumber];
+
+    // Setting SAMP to 1 starts the sample process.   We will wait 8us, then stop sampling.
+    AD1CON1bits.SAMP = 1;
+    DelayuS(8);                     // 8us Sample Settle time
+    AD1CON1bits.SAMP = 0;
+    g_ADCSampleTime[channelnumber] = TMR1;
+
+    // Once sampleing is stopped, converstion automaticly starts.   The AD1CON1bits.DONE indicates when the conversion 
+    // is complete.
+    while (!AD1CON1bits.DONE);      // Wait for conversion to complete (~1us)
+    
+    //  Conversion is complete, lets get the analog value from the ADC buffer and put in the averaging array.
+    //  g_ADCValuesBufferIndex is incremented by CollectAllADCSamples()
+
+    // If we are getting the 5V VCC measurement put that in a different place.
+    if (channelnumber==8)
+    {
+        g_ADC5VReferenceRaw = ADC1BUF0;
+    }
+    else
+    {
+        g_ADCValuesBuffer[g_ADCValuesBufferIndex][channelnumber]=ADC1BUF0;
+    }
+    
+    // increment a statistics global
+    g_ADCCaptures++;
+}
+
+/* 
+  *      CollectSimultaneousADCSamples() - The ADC_MODE_SIMULTANEOUS capture path.  Channel pairs selected in 
+  *             g_Config.SimultaneousPairs are sampled on the 4 sample-and-hold channels at the same instant (10 bit), and
+  *             everything else is sampled one at a time in 12 bit mode like the polled path.  The fixed CH1-CH3 inputs only
+  *             allow these pairs:
+  *                 ADC_PAIR_CH0_CH1 - CH123SA=0: CH1=AN0 (unused), CH2=AN1 (ch0), CH3=AN2 (ch1), CH0=AN5 (+5VCC)
+  *                 ADC_PAIR_CH2_CH3 - CH123SA=1: CH1=AN3 (ch2), CH2=AN4 (ch3), CH3=AN5 (+5VCC), CH0=AN0 (unused)
+  *             so the +5VCC reference is held together with the pair for ratiometric use.  Channels 4-7 (AN9-AN12) can only
+  *             be reached by CH0 and are always sequential.  10 bit results are shifted up 2 so all channels stay on the 
+  *             12 bit scale.
+  */
+void CollectSimultaneousADCSamples()
+{
+    unsigned int channelnumber;
+    unsigned int pending = 0x1FF;       // Bit per channel (and bit 8 for +5VCC) still to be sampled sequentially
+    unsigned int holdtime;
+
+    if (g_Config.SimultaneousPairs & (ADC_PAIR_CH0_CH1 | ADC_PAIR_CH2_CH3))
+    {
+        SetADCResolution(0);
+        if (g_Config.SimultaneousPairs & ADC_PAIR_CH0_CH1)
+        {
+            holdtime = SampleSimultaneousADC(0, 5);
+            g_ADCValuesBuffer[g_ADCValuesBufferIndex][0] = ADC1BUF2 << 2;
+            g_ADCValuesBuffer[g_ADCValuesBufferIndex][1] = ADC1BUF3 << 2;
+            g_ADC5VReferenceRaw = ADC1BUF0 << 2;
+            g_ADCSampleTime[0] = g_ADCSampleTime[1] = g_ADCSampleTime[8] = holdtime;
+            pending &= ~0x103;
+        }
+        if (g_Config.SimultaneousPairs & ADC_PAIR_CH2_CH3)
+        {
+            holdtime = SampleSimultaneousADC(1, 0);
+            g_ADCValuesBuffer[g_ADCValuesBufferIndex][2] = ADC1BUF1 << 2;
+            g_ADCValuesBuffer[g_ADCValuesBufferIndex][3] = ADC1BUF2 << 2;
+            g_ADCSampleTime[2] = g_ADCSampleTime[3] = holdtime;
+            pending &= ~0x00C;
+            // The reference was already held with channel 0/1 if that pair is simultaneous too.
+            if (pending & 0x100)
+            {
+                g_ADC5VReferenceRaw = ADC1BUF3 << 2;
+                g_ADCSampleTime[8] = holdtime;
+                pending &= ~0x100;
+            }
+        }
+    }
+
+    if (pending != 0)
+    {
+        SetADCResolution(1);
+        for (channelnumber=0;channelnumber<=8;channelnumber++)
+        {
+            if (pending & (1 << channelnumber))
+            {
+                CollectSequentialADCSample(channelnumber);
+            }
+        }
+    }
+}
+
+/* 
+  *      SampleSimultaneousADC() - Hold CH0-CH3 at the same instant and convert all 4 (10 bit mode).  ch123sa selects the CH1-CH3
+  *             inputs (0 = AN0/AN1/AN2, 1 = AN3/AN4/AN5) and ch0sa the CH0 input.  Results are left in ADC1BUF0-ADC1BUF3 (CH0 
+  *             first).  Returns the TMR1 count at the hold instant.
+  */
+unsigned int SampleSimultaneousADC(unsigned int ch123sa, unsigned int ch0sa)
+{
+    unsigned int holdtime;
+
+    AD1CHS123bits.CH123SA = ch123sa;
+    AD1CHS0bits.CH0SA = ch0sa;
+    IFS0bits.AD1IF = 0;
+
+    AD1CON1bits.SAMP = 1;
+    DelayuS(8);                     // 8us Sample Settle time
+    AD1CON1bits.SAMP = 0;           // All 4 channels are held here
+    holdtime = TMR1;
+
+    // The 4 conversions take ~12 Tad each, AD1IF is set once all of them are in the buffer.
+    while (!IFS0bits.AD1IF);
+    IFS0bits.AD1IF = 0;
+    g_ADCCaptures += 4;
+    return holdtime;
+}
+
+/* 
+  *      SetADCResolution() - Switch the ADC between 12 bit single channel (twelvebit = 1) and 10 bit 4 channel simultaneous 
+  *             (twelvebit = 0) operation for ADC_MODE_SIMULTANEOUS.  The ADC has to be turned off to change AD12B, and then
+  *             needs its power up time (tDPU, 20us) before the next conversion, so this does nothing if already there.
+  */
+void SetADCResolution(unsigned int twelvebit)
+{
+    if (twelvebit == l_ADC12Bit)
+    {
+        return;
+    }
+    AD1CON1bits.ADON = 0;
+    AD1CON1bits.AD12B = twelvebit;
+    AD1CON1bits.ADON = 1;
+    DelayuS(20);
+    l_ADC12Bit = twelvebit;
+}
+
+/* 
+  *      UpdateMovingAverages - Add the newest sample row (g_ADCValuesBufferIndex) to the per channel running sums and drop the 
+  *                             sample that just left the window, so the cost is the same on every call no matter how long the 
+  *                             window is.  Every g_ADCAverageDecimation calls (in ADC_FILTER_BOXCAR mode) the sums are divided by
+  *                             the window length and the averages are placed in g_ADCValues[channel].
+  */
+void UpdateMovingAverages()
+{
+    unsigned int channelnumber;
+    unsigned int* newest = g_ADCValuesBuffer[g_ADCValuesBufferIndex];
+    unsigned int* oldest;
+
+    // The row leaving the window is g_ADCAverageWindow samples back, which in a ring of g_ADCAverageWindow+1 rows is the next one.
+    oldest = (g_ADCValuesBufferIndex == g_ADCAverageWindow) ? g_ADCValuesBuffer[0] : g_ADCValuesBuffer[g_ADCValuesBufferIndex + 1];
 
     for (channelnumber=0;channelnumber<=7;channelnumber++)
     {
-        avg=sum=0;
-        // for each sample channel, add up all 8 samples.
-        // since each sample is at most 4096 (12 bits), 10 of them added together will still fit
-        // within a 16 bit unsigned integer. 
-        for (samplenumber=0;samplenumber<g_ADCBufferSize; samplenumber++)
+        g_ADCAverageSum[channelnumber] += newest[channelnumber];
+        g_ADCAverageSum[channelnumber] -= oldest[channelnumber];
+    }
+
+    l_ADCAveragePhase++;
+    if (l_ADCAveragePhase < g_ADCAverageDecimation)
+    {
+        return;
+    }
+    l_ADCAveragePhase = 0;
+
+    if (g_ADCFilterMode == ADC_FILTER_BOXCAR)
+    {
+        for (channelnumber=0;channelnumber<=7;channelnumber++)
         {
-            sum+=g_ADCValuesBuffer[channelnumber][samplenumber];
+            // Oversampled channels get their (wider) values from ADCOversamplePut() instead.
+            if (g_ADCOversampleChannels & (1 << channelnumber))
+            {
+                continue;
+            }
+            // 32/16 hardware divide (DIV.UD).  The sum is at most 4095 * ADC_AVERAGE_MAX_WINDOW, so the result fits in 16 bits.
+            g_ADCValues[channelnumber] = __builtin_divud(g_ADCAverageSum[channelnumber], g_ADCAverageWindow);
         }
-        // Integer divide by 10.  ** This assumes the ADCBufferSize is 10. **
-        avg = divu10(sum);
-        g_ADCValues[channelnumber] = avg;
-       
+        g_ADCUpdatedChannels |= ~g_ADCOversampleChannels & 0xFF;
     }
 }
 
 /* 
-  *      divu10 - divide unsigned int (16 bit) by 10 (using fast shifts)
-  *                 This is an optimized interger divid by 10.  To work it needs two unsigned long workspaces 
-  *                 (32 bit)
+  *      SetADCAverage - Change the moving average window length (1 - ADC_AVERAGE_MAX_WINDOW samples) and how often an average
+  *                      is output (every 'decimation' samples).  The window and the running sums are cleared, so the output
+  *                      ramps up from 0 over the first window.   Returns false if the parameters are out of range.
   */
-unsigned divu10(unsigned n) {
-    unsigned long q, r;
-    q = (n >> 1) + (n >> 2);
-    q = q + (q >> 4);
-    q = q + (q >> 8);
-    q = q + (q >> 16);
-    q = q >> 3;
-    r = n - (((q << 2) + q) << 1);
-    return q + (r > 9);
+bool SetADCAverage(unsigned int window, unsigned int decimation)
+{
+    unsigned int channelnumber, samplenumber;
+
+    if ((window == 0) || (window > ADC_AVERAGE_MAX_WINDOW) || (decimation == 0))
+    {
+        return false;
+    }
+    // The averaging state is used by the Timer1 interrupt, so hold that interrupt off while it changes.
+    IEC0bits.T1IE = 0;
+    for (samplenumber=0;samplenumber<=ADC_AVERAGE_MAX_WINDOW;samplenumber++)
+    {
+        for (channelnumber=0;channelnumber<=7;channelnumber++)
+        {
+            g_ADCValuesBuffer[samplenumber][channelnumber] = 0;
+        }
+    }
+    for (channelnumber=0;channelnumber<=7;channelnumber++)
+    {
+        g_ADCAverageSum[channelnumber] = 0;
+    }
+    g_ADCAverageWindow = window;
+    g_ADCAverageDecimation = decimation;
+    g_ADCValuesBufferIndex = 0;
+    l_ADCAveragePhase = 0;
+    IEC0bits.T1IE = 1;
+    return true;
 }
 
+/*
+ *      SetupADCFilters() - Configure the DSP engine for the FIR decimator and load every channel for the current g_ADCFilterMode.
+ *                          ADC_FILTER_FIR gets the default taps and a 10:1 decimation (matching the 100hz CAN output), and
+ *                          ADC_FILTER_CIC gets the CIC + compensation pipeline at the rate in g_Config.ChannelRate[channel].
+ *                          Channels with g_Config.ChannelOversample[channel] set use the oversampler in any mode.
+ *                          This needs the config, so it is called after ConfigurationSystemInit().  Channels can be changed 
+ *                          later with ADCFIRInit() or ADCCICInit().
+ */
+void SetupADCFilters()
+{
+    unsigned int channelnumber;
+#if defined(__dsPIC33F__)
+    // DSP engine: signed fractional multiplies, accumulator A saturation enabled (9.31 super saturation), and conventional
+    // (biased) rounding for SAC.R.  ADCFIRDotProduct() has a plain C version of exactly this arithmetic.
+    CORCONbits.US = 0;
+    CORCONbits.IF = 0;
+    CORCONbits.SATA = 1;
+    CORCONbits.ACCSAT = 1;
+    CORCONbits.RND = 1;
+#endif
+    g_ADCOversampleChannels = 0;
+    for (channelnumber=0;channelnumber<=7;channelnumber++)
+    {
+        // Oversampling is independent of the filter mode.  An out of range setting leaves the channel at the native rate.
+        ADCOversampleInit(channelnumber, g_Config.ChannelOversample[channelnumber]);
+
+        if (g_ADCFilterMode == ADC_FILTER_CIC)
+        {
+            // An out of range rate in the config falls back to the 100hz default.
+            if (!ADCCICInit(channelnumber, g_Config.ChannelRate[channelnumber]))
+            {
+                ADCCICInit(channelnumber, ADC_RATE_100HZ);
+            }
+        }
+        else
+        {
+            ADCFIRInit(channelnumber, g_ADCFIRDefaultTaps, 16, 10);
+        }
+    }
+}
 
 /*
+ *      ADCFIRInit() - Configure the FIR decimator for one channel.  taps is a table of numtaps Q15 coefficients (it should be 
+ *                     in Y memory on the dsPIC), and one output is produced for every 'decimation' input samples.
+ *                     Returns false (and leaves the channel alone) if the parameters are out of range.
+ */
+bool ADCFIRInit(unsigned int channel, int* taps, unsigned int numtaps, unsigned int decimation)
+{
+    unsigned int i;
+    st_ADCFIRFilter* f;
 
+    if ((channel > 7) || (taps == 0) || (numtaps == 0) || (numtaps > ADC_FIR_MAX_TAPS) || (decimation == 0))
+    {
+        return false;
+    }
+    f = &g_ADCFIRFilters[channel];
+    f->NumTaps = numtaps;
+    f->Decimation = decimation;
+    f->Phase = 0;
+    f->HistoryIndex = 0;
+    f->Taps = taps;
+    f->History = l_ADCFIRHistory[channel];
+    for (i=0; i<ADC_FIR_MAX_TAPS*2; i++)
+    {
+        f->History[i] = 0;
+    }
+    return true;
+}
 
+/*
+ *      ADCFIRPut() - Add one sample to a channel's FIR decimator.  Every Decimation samples the filter is evaluated over the
+ *                    newest NumTaps samples and the result is written to *output.  Returns true when *output was written.
+ *                    Samples are only stored on the other calls, so the filter math is only paid at the output rate.
+ */
+bool ADCFIRPut(unsigned int channel, unsigned int sample, unsigned int* output)
+{
+    st_ADCFIRFilter* f = &g_ADCFIRFilters[channel];
+    int result;
+
+    // Store the sample twice (see l_ADCFIRHistory) so the current window never wraps.
+    f->History[f->HistoryIndex] = sample;
+    f->History[f->HistoryIndex + f->NumTaps] = sample;
+    f->HistoryIndex++;
+    if (f->HistoryIndex == f->NumTaps)
+    {
+        f->HistoryIndex = 0;
+    }
+
+    f->Phase++;
+    if (f->Phase < f->Decimation)
+    {
+        return false;
+    }
+    f->Phase = 0;
 
-void SampleFilter_init(SampleFilter* f) {
-  int i;
-  for(i = 0; i < SAMPLEFILTER_TAP_NUM; ++i)
-    f->history[i] = 0;
-  f->last_index = 0;
+    // After the increment HistoryIndex points at the oldest sample, so the window is History[HistoryIndex .. +NumTaps-1].
+    // The taps are applied from oldest to newest, so a non symmetric tap table is stored in reverse time order (h[N-1] first).
+    result = ADCFIRDotProduct(&f->History[f->HistoryIndex], f->Taps, f->NumTaps);
+    // ADC values are unsigned, so a negative overshoot (possible with negative taps) is clipped at 0.
+    *output = (result < 0) ? 0 : result;
+    return true;
 }
 
-void SampleFilter_put(SampleFilter* f, int input) {
-  f->history[f->last_index++] = input;
-  if(f->last_index == SAMPLEFILTER_TAP_NUM)
-    f->last_index = 0;
+/*
+ *      ADCFIRDotProduct() - Q15 dot product of n samples (x) and n taps (h), rounded back to the scale of x.  
+ *                           On the dsPIC this runs on accumulator A with the MAC instruction.  The C version is the bit exact
+ *                           reference of the same math, for building/checking the filter on a host:
+ *                              - each product is x*h shifted left 1 (fractional multiply) into a 40 bit accumulator
+ *                              - the accumulator saturates at 9.31 (only reachable with out of range taps)
+ *                              - SAC.R adds 0x8000 (conventional rounding) and returns bits 31..16, saturated to 16 bits
+ */
+int ADCFIRDotProduct(int* x, int* h, unsigned int n)
+{
+#if defined(__dsPIC33F__)
+    register int acc asm("A");
+    unsigned int i;
+
+    acc = __builtin_clr();
+    for (i=0; i<n; i++)
+    {
+        acc = __builtin_mac(acc, x[i], h[i], 0, 0, 0, 0, 0, 0, 0, 0);
+    }
+    return __builtin_sacr(acc, 0);
+#else
+    long long acc = 0;
+    unsigned int i;
+
+    for (i=0; i<n; i++)
+    {
+        acc += ((long long)x[i] * h[i]) * 2;
+        if (acc > 0x7FFFFFFFFFLL) acc = 0x7FFFFFFFFFLL;
+        if (acc < -0x8000000000LL) acc = -0x8000000000LL;
+    }
+    acc = (acc + 0x8000) >> 16;
+    if (acc > 32767) acc = 32767;
+    if (acc < -32768) acc = -32768;
+    return (int)acc;
+#endif
 }
 
-int SampleFilter_get(SampleFilter* f) {
-  long long acc = 0;
-  int index = f->last_index, i;
-  for(i = 0; i < SAMPLEFILTER_TAP_NUM; ++i) {
-    index = index != 0 ? index-1 : SAMPLEFILTER_TAP_NUM-1;
-    acc += (long long)f->history[index] * filter_taps[i];
-  };
-  return acc >> 16;
+/*
+ *      ADCCICInit() - Configure the CIC + compensation decimator of one channel for one of the ADC_RATE_xxx output rates.
+ *                     The CIC decimates by half of the total and the compensating FIR (using the channel's FIR decimator) 
+ *                     does the final 2:1.  Returns false if the channel or rate is out of range.
+ */
+bool ADCCICInit(unsigned int channel, unsigned int rate)
+{
+    unsigned int i;
+    st_ADCCICFilter* c;
+
+    if ((channel > 7) || (rate >= ADC_RATE_COUNT))
+    {
+        return false;
+    }
+    c = &g_ADCCICFilters[channel];
+    c->Decimation = g_ADCOutputRateDecimation[rate] / 2;
+    c->Gain = 1;
+    for (i=0; i<ADC_CIC_ORDER; i++)
+    {
+        c->Integrator[i] = 0;
+        c->Comb[i] = 0;
+        c->Gain *= c->Decimation;
+    }
+    c->Phase = 0;
+
+    if (c->Decimation == 1)
+    {
+        return ADCFIRInit(channel, g_ADCHalfBandTaps, 11, 2);
+    }
+    return ADCFIRInit(channel, g_ADCCICCompensationTaps, 11, 2);
+}
+
+/*
+ *      ADCCICPut() - Add one sample to a channel's CIC decimator.  The integrators run on every sample (3 long adds), and every
+ *                    Decimation samples the combs run and the normalized result is passed on to the compensating FIR.  Returns
+ *                    true when the FIR produced a new value in *output.
+ *                    The CIC gain is at most 50^3, so 12 bit samples need 29 bits and the 32 bit integrators can wrap freely.
+ */
+bool ADCCICPut(unsigned int channel, unsigned int sample, unsigned int* output)
+{
+    st_ADCCICFilter* c = &g_ADCCICFilters[channel];
+    unsigned long x, y;
+    unsigned int i;
+
+    c->Integrator[0] += sample;
+    for (i=1; i<ADC_CIC_ORDER; i++)
+    {
+        c->Integrator[i] += c->Integrator[i-1];
+    }
+
+    c->Phase++;
+    if (c->Phase < c->Decimation)
+    {
+        return false;
+    }
+    c->Phase = 0;
+
+    x = c->Integrator[ADC_CIC_ORDER-1];
+    for (i=0; i<ADC_CIC_ORDER; i++)
+    {
+        y = x - c->Comb[i];
+        c->Comb[i] = x;
+        x = y;
+    }
+    // Normalize the CIC gain.  This long divide only happens at twice the output rate of the channel.
+    if (c->Gain != 1)
+    {
+        x = x / c->Gain;
+    }
+    if (!ADCFIRPut(channel, (unsigned int)x, output))
+    {
+        return false;
+    }
+    // The compensating FIR has negative taps, so it can overshoot a step.  Keep the result inside the 12 bit range.
+    if (*output > ADC_FULL_SCALE)
+    {
+        *output = ADC_FULL_SCALE;
+    }
+    return true;
+}
+
+/*
+ *      ADCOversampleInit() - Enable oversample and decimate on a channel.  'bits' is the number of extra bits of resolution (1-4),
+ *                            taken from 4^bits samples per output, so 2 gives 14 bit values every 16ms and 4 gives 16 bit values
+ *                            every 256ms.  0 turns oversampling off and puts the channel back on its normal decimator.
+ *                            This only adds resolution when there is at least ~1 LSB of noise on the input to act as dither.
+ *                            Returns false (channel left at the native rate) if the parameters are out of range.
+ */
+bool ADCOversampleInit(unsigned int channel, unsigned int bits)
+{
+    st_ADCOversample* o;
+
+    if (channel > 7)
+    {
+        return false;
+    }
+    g_ADCOversampleChannels &= ~(1 << channel);
+    if ((bits == 0) || (bits > ADC_OVERSAMPLE_MAX_BITS))
+    {
+        return (bits == 0);
+    }
+    o = &g_ADCOversample[channel];
+    o->Sum = 0;
+    o->Count = 0;
+    o->Shift = bits;
+    o->Samples = 1 << (2*bits);
+    g_ADCOversampleChannels |= (1 << channel);
+    return true;
+}
+
+/*
+ *      ADCOversamplePut() - Add one sample to a channel's oversampler.  After 4^Shift samples the sum is shifted right by Shift, 
+ *                           which leaves 12+Shift bits of result in *output.  Returns true when *output was written.
+ */
+bool ADCOversamplePut(unsigned int channel, unsigned int sample, unsigned int* output)
+{
+    st_ADCOversample* o = &g_ADCOversample[channel];
+
+    o->Sum += sample;
+    o->Count++;
+    if (o->Count < o->Samples)
+    {
+        return false;
+    }
+    // At most 256 * 4095 summed and shifted right 4, so the result always fits in 16 bits.
+    *output = (unsigned int)(o->Sum >> o->Shift);
+    o->Sum = 0;
+    o->Count = 0;
+    return true;
+}
+
+/*
+ *      PublishADCSnapshot() - Copy the current decimated (raw and calibrated) values, the +5VCC reference and the CAN counters into the snapshot.
+ *                             Called from the Timer1 interrupt once per decimation cycle.  The sequence counter is made odd
+ *                             before the copy and even after, so a reader can tell if it was interrupted by a publish.
+ */
+void PublishADCSnapshot()
+{
+    unsigned int channelnumber;
+
+    l_ADCSnapshotSequence++;
+    for (channelnumber=0;channelnumber<=7;channelnumber++)
+    {
+        l_ADCSnapshot.ADCValues[channelnumber] = g_ADCValues[channelnumber];
+        l_ADCSnapshot.ADCMillivolts[channelnumber] = g_ADCMillivolts[channelnumber];
+        l_ADCSnapshot.ADCEngineering[channelnumber] = g_ADCEngineering[channelnumber];
+        l_ADCSnapshot.ADCStats[channelnumber] = g_ADCStats[channelnumber];
+    }
+    l_ADCSnapshot.ADC5VReferenceRaw = g_ADC5VReferenceRaw;
+    l_ADCSnapshot.Timestamp = g_ADCTimestamp;
+    l_ADCSnapshot.TimerSeconds = g_TimerSeconds;
+    l_ADCSnapshot.TimerMS = g_TimerMS;
+    l_ADCSnapshot.ADCCaptures = g_ADCCaptures;
+    l_ADCSnapshot.ECANTransmitTried = g_ECANTransmitTried;
+    l_ADCSnapshot.ECANTransmitCompleted = g_ECANTransmitCompleted;
+    l_ADCSnapshot.ECANTransmitTimout = g_ECANTransmitTimout;
+    l_ADCSnapshot.ECANTransmitBusy = g_ECANTransmitBusy;
+    l_ADCSnapshot.ECANError = g_ECANError;
+    l_ADCSnapshot.ECANTXBO = g_ECANTXBO;
+    l_ADCSnapshot.ECANTXBP = g_ECANTXBP;
+    l_ADCSnapshot.ECANTXWAR = g_ECANTXWAR;
+    l_ADCSnapshot.ECANIVRIF = g_ECANIVRIF;
+    l_ADCSnapshot.ECANInterrupts = g_ECANInterrupts;
+    l_ADCSnapshotSequence++;
+}
+
+/*
+ *      ReadADCSnapshot() - Copy the last published snapshot for use outside the interrupt (main loop only).  If a publish 
+ *                          happens while copying (the sequence counter is odd, or changed) the copy is simply done again.  A 
+ *                          publish only happens once per decimation cycle, so this almost never loops more than once.
+ */
+void ReadADCSnapshot(st_ADCSnapshot* snapshot)
+{
+    unsigned int sequence;
+    unsigned int i;
+    volatile unsigned int* source = (volatile unsigned int*)&l_ADCSnapshot;
+    unsigned int* destination = (unsigned int*)snapshot;
+
+    do
+    {
+        sequence = l_ADCSnapshotSequence;
+        if (sequence & 1)
+        {
+            continue;
+        }
+        // Copied a word at a time through the volatile pointer so the copy stays between the two sequence reads.
+        for (i=0; i<sizeof(st_ADCSnapshot)/sizeof(unsigned int); i++)
+        {
+            destination[i] = source[i];
+        }
+    } while ((sequence & 1) || (sequence != l_ADCSnapshotSequence));
 }
-*/
+
+/*
+ *      UpdateRatiometricCompensation() - Run the +5VCC reference through a single pole low pass (time constant 
+ *                          2^ADC_VCC_FILTER_SHIFT samples), work out the unsigned Q1.15 correction g_Config.VCCNominalRaw / 
+ *                          filtered VCC, and scale the newest sample of every channel in g_Config.RatiometricChannels by it.
+ *                          That is one divide per tick, and one MUL.UU, a shift and a compare per corrected channel.
+ *                          If the rail reads half of nominal or less the measurement is treated as bad and no correction is made.
+ */
+void UpdateRatiometricCompensation()
+{
+    unsigned int channelnumber;
+    unsigned int* newest = g_ADCValuesBuffer[g_ADCValuesBufferIndex];
+    unsigned long corrected;
+
+    if (l_ADCVCCFilterSum == 0)
+    {
+        // Start the filter at the first measurement instead of ramping up from 0.
+        l_ADCVCCFilterSum = (unsigned long)g_ADC5VReferenceRaw << ADC_VCC_FILTER_SHIFT;
+    }
+    else
+    {
+        l_ADCVCCFilterSum += g_ADC5VReferenceRaw;
+        l_ADCVCCFilterSum -= l_ADCVCCFilterSum >> ADC_VCC_FILTER_SHIFT;
+    }
+    g_ADCVCCFiltered = (unsigned int)(l_ADCVCCFilterSum >> ADC_VCC_FILTER_SHIFT);
+
+    if (((unsigned long)g_ADCVCCFiltered * 2) <= g_Config.VCCNominalRaw)
+    {
+        g_ADCRatiometricGain = ADC_RATIOMETRIC_UNITY;
+        return;
+    }
+    // nominal < 2 * filtered exactly (no rounding in the compare above), so the Q1.15 result is below 2.0 and fits the 16 bit
+    // DIV.UD quotient.
+    g_ADCRatiometricGain = __builtin_divud((unsigned long)g_Config.VCCNominalRaw << 15, g_ADCVCCFiltered);
+
+    if (g_Config.RatiometricChannels == 0)
+    {
+        return;
+    }
+    for (channelnumber=0;channelnumber<=7;channelnumber++)
+    {
+        if (g_Config.RatiometricChannels & (1 << channelnumber))
+        {
+            corrected = __builtin_muluu(newest[channelnumber], g_ADCRatiometricGain) >> 15;
+            newest[channelnumber] = (corrected > ADC_FULL_SCALE) ? ADC_FULL_SCALE : (unsigned int)corrected;
+        }
+    }
+}
+
+/*
+ *      ADCCalibrate() - Convert a decimated ADC value to millivolts with the channel's integer calibration:
+ *                          mV = (value - CalOffset[channel]) * CalGain[channel] / 32768
+ *                       CalOffset is in 12 bit ADC counts and CalGain is unsigned Q1.15 millivolts per count (so up to 2mV per
+ *                       count).  Oversampled channels have n extra bits, so the offset is shifted up and the result down by n.
+ *                       Values below the offset give 0.  One MUL.UU and a shift, no floating point.
+ */
+unsigned int ADCCalibrate(unsigned int channel, unsigned int value)
+{
+    unsigned int shift = 0;
+    unsigned long offset;
+    unsigned long millivolts;
+
+    if (g_ADCOversampleChannels & (1 << channel))
+    {
+        shift = g_ADCOversample[channel].Shift;
+    }
+    offset = (unsigned long)g_Config.CalOffset[channel] << shift;
+    if (value <= offset)
+    {
+        return 0;
+    }
+    millivolts = __builtin_muluu(value - (unsigned int)offset, g_Config.CalGain[channel]) >> (15 + shift);
+    return (millivolts > 0xFFFF) ? 0xFFFF : (unsigned int)millivolts;
+}
+
+/*
+ *      ADCLinearize() - Convert calibrated millivolts to engineering units through linearization table 'table' (1 based, 
+ *                       0 = no table, the millivolts are returned as they are).  The breakpoint is found with a binary search
+ *                       and the output linearly interpolated between the two neighbouring points.  Inputs outside the table
+ *                       are clamped to the first/last Y.  Each segment's Y step must fit in 16 bits.
+ */
+int ADCLinearize(unsigned int table, unsigned int millivolts)
+{
+    const st_LinearTable* linear;
+    unsigned int low, high, middle;
+    unsigned int dx, dmv;
+    long dy;
+
+    if ((table == 0) || (table > LINEAR_TABLE_COUNT))
+    {
+        return (int)millivolts;
+    }
+    linear = &g_Config.LinearTables[table-1];
+    if ((linear->Points < 2) || (linear->Points > LINEAR_TABLE_POINTS))
+    {
+        return (int)millivolts;
+    }
+
+    high = linear->Points - 1;
+    if (millivolts <= linear->X[0])
+    {
+        return linear->Y[0];
+    }
+    if (millivolts >= linear->X[high])
+    {
+        return linear->Y[high];
+    }
+
+    // X[low] < millivolts < X[high] holds all the way down to adjacent breakpoints.
+    low = 0;
+    while ((high - low) > 1)
+    {
+        middle = (low + high) >> 1;
+        if (millivolts < linear->X[middle])
+        {
+            high = middle;
+        }
+        else
+        {
+            low = middle;
+        }
+    }
+
+    dx = linear->X[high] - linear->X[low];
+    dmv = millivolts - linear->X[low];
+    dy = (long)linear->Y[high] - linear->Y[low];
+    // dmv < dx, so the quotient is smaller than |dy| and the unsigned divide can't overflow.
+    if (dy < 0)
+    {
+        return linear->Y[low] - (int)__builtin_divud(__builtin_muluu((unsigned int)(-dy), dmv), dx);
+    }
+    return linear->Y[low] + (int)__builtin_divud(__builtin_muluu((unsigned int)dy, dmv), dx);
+}
+
+/*
+ *      ADCCaptureArm() - Start a burst capture of the raw 10KHz scans of 'channels' (bit per channel).  The last 
+ *                        'pretriggerrows' scans are kept in a ring until 'triggerchannel' meets 'triggermode'/'triggerlevel'
+ *                        (ADC_TRIGGER_xxx), then the capture runs on until it holds 'rows' scans and freezes until it has been
+ *                        drained ('drain' = ADC_CAPTURE_DRAIN_xxx) and released.  Only ADC_MODE_DMA_SCAN samples fast enough.
+ *                        Returns false (and leaves the capture idle) if the request does not fit in the capture buffer.
+ */
+bool ADCCaptureArm(unsigned int channels, unsigned int triggerchannel, unsigned int triggermode, unsigned int triggerlevel,
+                    unsigned int pretriggerrows, unsigned int rows, unsigned int drain)
+{
+    unsigned int channelnumber;
+    unsigned int count = 0;
+
+    // Stop the interrupt from using the capture while it is changed.
+    g_ADCCapture.State = ADC_CAPTURE_IDLE;
+
+    channels &= 0xFF;
+    for (channelnumber=0;channelnumber<=7;channelnumber++)
+    {
+        if (channels & (1 << channelnumber)) count++;
+    }
+    if ((g_ADCAcquisitionMode != ADC_MODE_DMA_SCAN) || (triggermode == ADC_TRIGGER_NONE) || (triggermode > ADC_TRIGGER_MANUAL) ||
+        (count == 0) || (triggerchannel > 7) || (rows == 0) || (pretriggerrows >= rows) || 
+        (rows > (ADC_CAPTURE_BUFFER_LENGTH / count)))
+    {
+        return false;
+    }
+
+    g_ADCCapture.Channels = channels;
+    g_ADCCapture.ChannelCount = count;
+    g_ADCCapture.TriggerChannel = triggerchannel;
+    g_ADCCapture.TriggerMode = triggermode;
+    g_ADCCapture.TriggerLevel = triggerlevel;
+    g_ADCCapture.PreTriggerRows = pretriggerrows;
+    g_ADCCapture.Rows = rows;
+    g_ADCCapture.Drain = drain;
+    g_ADCCapture.Length = rows * count;
+    g_ADCCapture.WriteIndex = 0;
+    g_ADCCapture.StartIndex = 0;
+    g_ADCCapture.FilledRows = 0;
+    g_ADCCapture.RemainingRows = 0;
+    g_ADCCapture.PreviousSample = 0;
+    g_ADCCapture.DrainFrame = 0;
+    l_ADCCaptureForce = 0;
+    g_ADCCapture.State = ADC_CAPTURE_ARMED;
+    return true;
+}
+
+/*
+ *      SetupADCCapture() - Arm the burst capture from the configuration (g_Config.CaptureXXX).  Nothing is armed if the 
+ *                          configured trigger is ADC_TRIGGER_NONE.
+ */
+void SetupADCCapture()
+{
+    if (g_Config.CaptureTriggerMode == ADC_TRIGGER_NONE)
+    {
+        g_ADCCapture.State = ADC_CAPTURE_IDLE;
+        return;
+    }
+    ADCCaptureArm(g_Config.CaptureChannels, g_Config.CaptureTriggerChannel, g_Config.CaptureTriggerMode, 
+                  g_Config.CaptureTriggerLevel, g_Config.CapturePreTrigger, g_Config.CaptureLength, g_Config.CaptureDrain);
+}
+
+/*
+ *      ADCCaptureForce() - Trigger an armed capture on the next scan, whatever the trigger condition (as soon as the 
+ *                          pre-trigger part of the ring is full).
+ */
+void ADCCaptureForce()
+{
+    l_ADCCaptureForce = 1;
+}
+
+/*
+ *      ADCCapturePut() - Store each scan of a completed DMA scan block in the capture ring and look for the trigger.  Called 
+ *                        from CollectADCScanBlock() in the Timer1 interrupt.  The trigger is only looked for once the pre-trigger
+ *                        rows (and at least one previous sample) are there, and the row that triggers is the first post-trigger
+ *                        row.  Once Rows rows are held the ring is frozen, with the oldest sample at StartIndex.
+ */
+void ADCCapturePut(const unsigned int* block)
+{
+    unsigned int scan;
+    unsigned int channelnumber;
+    unsigned int sample;
+    unsigned int triggerindex;
+    bool triggered;
+
+    if ((g_ADCCapture.State != ADC_CAPTURE_ARMED) && (g_ADCCapture.State != ADC_CAPTURE_TRIGGERED))
+    {
+        return;
+    }
+    triggerindex = l_ADCScanBlockIndex[g_ADCCapture.TriggerChannel];
+
+    for (scan=0;scan<ADC_SCAN_REPEAT;scan++, block += ADC_SCAN_LENGTH)
+    {
+        for (channelnumber=0;channelnumber<=7;channelnumber++)
+        {
+            if (g_ADCCapture.Channels & (1 << channelnumber))
+            {
+                l_ADCCaptureBuffer[g_ADCCapture.WriteIndex++] = block[l_ADCScanBlockIndex[channelnumber]];
+            }
+        }
+        if (g_ADCCapture.WriteIndex >= g_ADCCapture.Length)
+        {
+            g_ADCCapture.WriteIndex = 0;
+        }
+
+        sample = block[triggerindex];
+        if (g_ADCCapture.State == ADC_CAPTURE_ARMED)
+        {
+            triggered = false;
+            if ((g_ADCCapture.FilledRows >= g_ADCCapture.PreTriggerRows) && (g_ADCCapture.FilledRows != 0))
+            {
+                switch (g_ADCCapture.TriggerMode)
+                {
+                    case ADC_TRIGGER_RISING:
+                        triggered = (g_ADCCapture.PreviousSample < g_ADCCapture.TriggerLevel) && (sample >= g_ADCCapture.TriggerLevel);
+                        break;
+                    case ADC_TRIGGER_FALLING:
+                        triggered = (g_ADCCapture.PreviousSample > g_ADCCapture.TriggerLevel) && (sample <= g_ADCCapture.TriggerLevel);
+                        break;
+                    case ADC_TRIGGER_SLOPE:
+                        triggered = ((sample > g_ADCCapture.PreviousSample) ? (sample - g_ADCCapture.PreviousSample) : 
+                                     (g_ADCCapture.PreviousSample - sample)) >= g_ADCCapture.TriggerLevel;
+                        break;
+                    default:
+                        break;
+                }
+                triggered = triggered || (l_ADCCaptureForce != 0);
+            }
+            else
+            {
+                g_ADCCapture.FilledRows++;
+            }
+            if (triggered)
+            {
+                l_ADCCaptureForce = 0;
+                // The block is from the previous Timer1 period, one conversion every ADC_SCAN_PR3+1 cycles (40 per us).
+                g_ADCCapture.TriggerTime = l_ADCTickTime - TIMER1_TICKS_TO_US(PR1 + 1) + 
+                    ((((ADC_SCAN_PR3 + 1) / 2) + (((scan * ADC_SCAN_LENGTH) + triggerindex) * (unsigned long)(ADC_SCAN_PR3 + 1))) / 40);
+                g_ADCCapture.RemainingRows = g_ADCCapture.Rows - g_ADCCapture.PreTriggerRows;
+                g_ADCCapture.State = ADC_CAPTURE_TRIGGERED;
+            }
+        }
+        g_ADCCapture.PreviousSample = sample;
+
+        if (g_ADCCapture.State == ADC_CAPTURE_TRIGGERED)
+        {
+            g_ADCCapture.RemainingRows--;
+            if (g_ADCCapture.RemainingRows == 0)
+            {
+                g_ADCCapture.StartIndex = g_ADCCapture.WriteIndex;
+                g_ADCCapture.DrainFrame = 0;
+                g_ADCCapture.Completed++;
+                g_ADCCapture.State = ADC_CAPTURE_COMPLETE;
+                return;
+            }
+        }
+    }
+}
+
+/*
+ *      ADCCaptureSample() - Sample 'index' of a completed capture, counting from the oldest.  Samples are in row order (one 
+ *                           row per scan) and within a row in channel order, ChannelCount samples per row.
+ */
+unsigned int ADCCaptureSample(unsigned int index)
+{
+    index += g_ADCCapture.StartIndex;
+    if (index >= g_ADCCapture.Length)
+    {
+        index -= g_ADCCapture.Length;
+    }
+    return l_ADCCaptureBuffer[index];
+}
+
+/*
+ *      ADCCaptureRelease() - Called once a completed capture has been drained.  Re-arms from the configuration, so with a
+ *                            configured trigger the device keeps catching events.
+ */
+void ADCCaptureRelease()
+{
+    SetupADCCapture();
+}
+
+/*
+ *      ADCStatsPut() - Add one 1KHz sample to the channel's statistics window.  Fixed cost: two compares, an add and a
+ *                      MUL.UU, with no divides (those are left to ADCStatsMean() and ADCStatsRMS()).  Past 
+ *                      ADC_STATS_MAX_SAMPLES only Min and Max are updated.
+ */
+void ADCStatsPut(unsigned int channel, unsigned int sample)
+{
+    st_ADCStats* window = &l_ADCStatsWindow[channel];
+
+    if (window->Count == 0)
+    {
+        window->Min = sample;
+        window->Max = sample;
+    }
+    else if (sample < window->Min)
+    {
+        window->Min = sample;
+    }
+    else if (sample > window->Max)
+    {
+        window->Max = sample;
+    }
+    if (window->Count == ADC_STATS_MAX_SAMPLES)
+    {
+        return;
+    }
+    window->Count++;
+    window->Sum += sample;
+    window->SumSquares += __builtin_muluu(sample, sample);
+}
+
+/*
+ *      ADCStatsLatch() - Close the channel's statistics window when it produces a decimated value: copy it to g_ADCStats[],
+ *                        flag it for the CAN stats frame, and start a new window.
+ */
+void ADCStatsLatch(unsigned int channel)
+{
+    g_ADCStats[channel] = l_ADCStatsWindow[channel];
+    g_ADCStatsPending |= (1 << channel);
+    l_ADCStatsWindow[channel].Count = 0;
+    l_ADCStatsWindow[channel].Sum = 0;
+    l_ADCStatsWindow[channel].SumSquares = 0;
+}
+
+/*
+ *      ADCStatsMean() - Rounded mean of a statistics window (0 for an empty window).  The sum is at most 
+ *                       4095 * ADC_STATS_MAX_SAMPLES, so the 32/16 hardware divide can't overflow.
+ */
+unsigned int ADCStatsMean(const st_ADCStats* stats)
+{
+    if (stats->Count == 0)
+    {
+        return 0;
+    }
+    return __builtin_divud(stats->Sum + (stats->Count >> 1), stats->Count);
+}
+
+/*
+ *      ADCStatsRMS() - RMS of a statistics window, sqrt(SumSquares / Count), in ADC counts.  The mean square needs a 32 bit 
+ *                      quotient, so this is a library divide followed by a 16 step bitwise square root.  Only called for the
+ *                      stats frame and the console, not per sample.
+ */
+unsigned int ADCStatsRMS(const st_ADCStats* stats)
+{
+    unsigned long square;
+    unsigned long root = 0;
+    unsigned long bit = 1UL << 30;
+
+    if (stats->Count == 0)
+    {
+        return 0;
+    }
+    square = stats->SumSquares / stats->Count;
+    while (bit > square)
+    {
+        bit >>= 2;
+    }
+    while (bit != 0)
+    {
+        if (square >= root + bit)
+        {
+            square -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else
+        {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return (unsigned int)root;
+}
+
+/*
+ *      ADCPrefilterPut() - Median / Hampel spike rejection on one channel, ahead of the decimators.  The newest sample goes into
+ *                          the channel's history and the median of the last g_Config.PrefilterLength (3 or 5) samples is found
+ *                          with a fixed sorting network (3 or 7 compare-exchanges, no data dependent loops).  The middle sample
+ *                          of the history is returned as it is unless it is more than g_Config.PrefilterThreshold counts from
+ *                          the median, in which case it is an outlier and the median is returned instead (threshold 0 is a 
+ *                          plain median filter).  The output is delayed by half the filter length (1 or 2 samples).
+ */
+unsigned int ADCPrefilterPut(unsigned int channel, unsigned int sample)
+{
+    unsigned int* history = l_ADCPrefilterHistory[channel];
+    unsigned int a, b, c, d, e;
+    unsigned int middle, median, deviation;
+
+    // The first sample fills the history, so the filter starts out settled instead of pulling towards 0.
+    if ((l_ADCPrefilterPrimed & (1 << channel)) == 0)
+    {
+        l_ADCPrefilterPrimed |= (1 << channel);
+        history[0] = history[1] = history[2] = history[3] = sample;
+    }
+
+    if (g_Config.PrefilterLength >= 5)
+    {
+        a = history[0];
+        b = history[1];
+        c = history[2];
+        d = history[3];
+        e = sample;
+        history[0] = b;
+        history[1] = c;
+        history[2] = d;
+        history[3] = e;
+        middle = c;
+        // 7 compare-exchange median of 5
+        ADC_SORT2(a,b);
+        ADC_SORT2(d,e);
+        ADC_SORT2(a,d);
+        ADC_SORT2(b,e);
+        ADC_SORT2(b,c);
+        ADC_SORT2(c,d);
+        ADC_SORT2(b,c);
+        median = c;
+    }
+    else
+    {
+        a = history[2];
+        b = history[3];
+        c = sample;
+        history[2] = b;
+        history[3] = c;
+        middle = b;
+        // 3 compare-exchange median of 3
+        ADC_SORT2(a,b);
+        ADC_SORT2(b,c);
+        ADC_SORT2(a,b);
+        median = b;
+    }
+
+    deviation = (middle > median) ? (middle - median) : (median - middle);
+    if (deviation > g_Config.PrefilterThreshold)
+    {
+        g_ADCPrefilterOutliers[channel]++;
+        return median;
+    }
+    return middle;
+}
+
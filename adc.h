@@ -22,29 +22,235 @@
 #ifndef ADC_H
 #define	ADC_H
 
+#include <stdbool.h>
+
 #ifdef	__cplusplus
 extern "C" {
 #endif
 
+// ADC acquisition modes (g_ADCAcquisitionMode)
+//      ADC_MODE_POLLED   - Each channel is selected, sampled and converted by hand from within the Timer1 interrupt.
+//      ADC_MODE_DMA_SCAN - ADC1 scans all inputs on its own, triggered by Timer3, and DMA1 writes the results into a
+//                          ping-pong buffer.  The Timer1 interrupt only consumes completed blocks.
+//      ADC_MODE_SIMULTANEOUS - Polled, but the channel pairs in g_Config.SimultaneousPairs are held at the same instant on the
+//                          CH0-CH3 sample-and-holds (10 bit), and the rest are sampled one at a time (12 bit).
+#define ADC_MODE_POLLED     0
+#define ADC_MODE_DMA_SCAN   1
+#define ADC_MODE_SIMULTANEOUS 2
+
+// Channel pairs for ADC_MODE_SIMULTANEOUS (bits of g_Config.SimultaneousPairs).  A pair that is not selected is sampled
+// sequentially at 12 bits.
+#define ADC_PAIR_CH0_CH1    0x01
+#define ADC_PAIR_CH2_CH3    0x02
+
+// Number of conversions in one scan of the inputs.  AN0 (VRef+) is scanned as a dummy entry so that a scan is exactly 10
+// conversions.  Each DMA block holds ADC_SCAN_REPEAT back to back scans at 100KHz, which lines each block up with one 1ms 
+// Timer1 tick.  The regular stream uses the average of the scans in a block, burst capture (ADCCapturePut) uses every scan.
+#define ADC_SCAN_LENGTH         10
+#define ADC_SCAN_REPEAT         10
+#define ADC_SCAN_BLOCK_LENGTH   (ADC_SCAN_LENGTH * ADC_SCAN_REPEAT)
+// Timer3 period for the scan trigger (40MHz / 400 = 100KHz, one conversion every 10us, so each input every 100us)
+#define ADC_SCAN_PR3            399
+
+// Burst capture of the raw 10KHz scans into a circular pre-trigger buffer (ADC_MODE_DMA_SCAN only, see ADCCaptureArm())
+//      ADC_TRIGGER_NONE    - Capture disabled
+//      ADC_TRIGGER_RISING  - Trigger channel goes from below to at or above TriggerLevel
+//      ADC_TRIGGER_FALLING - Trigger channel goes from above to at or below TriggerLevel
+//      ADC_TRIGGER_SLOPE   - Trigger channel changes by TriggerLevel counts or more between two scans (100us)
+//      ADC_TRIGGER_MANUAL  - Only ADCCaptureForce() triggers
+#define ADC_TRIGGER_NONE        0
+#define ADC_TRIGGER_RISING      1
+#define ADC_TRIGGER_FALLING     2
+#define ADC_TRIGGER_SLOPE       3
+#define ADC_TRIGGER_MANUAL      4
+
+// Capture states (st_ADCCapture.State)
+#define ADC_CAPTURE_IDLE        0
+#define ADC_CAPTURE_ARMED       1       // Filling the pre-trigger ring and watching for the trigger
+#define ADC_CAPTURE_TRIGGERED   2       // Filling the post-trigger samples
+#define ADC_CAPTURE_COMPLETE    3       // Frozen, waiting to be drained
+
+// Where a completed capture is drained to
+#define ADC_CAPTURE_DRAIN_CAN   0       // One frame per idle Timer1 tick on g_Config.CanCapture_ID (TransmitADCCaptureFrame)
+#define ADC_CAPTURE_DRAIN_UART  1       // Printed by the console loop
+#define ADC_CAPTURE_DRAIN_ISOTP 2       // Read by an ISO-TP tester (ISOTP_SERVICE_READ_CAPTURE)
+
+// Capture buffer size in samples.  A row is one scan of the selected channels, so this is shared between rows and channels.
+#define ADC_CAPTURE_BUFFER_LENGTH   1024
+
 void SetupADC();
+void SetupADCScanTimer();
+void ADCScanTimerShift(int cycles);
+void ADCScanTimerRestore();
 void CollectAllADCSamples();
+bool CollectADCScanBlock();
+void CollectPolledADCSamples();
+void CollectSequentialADCSample(unsigned int channelnumber);
+void CollectSimultaneousADCSamples();
+unsigned int SampleSimultaneousADC(unsigned int ch123sa, unsigned int ch0sa);
+void SetADCResolution(unsigned int twelvebit);
 unsigned int GetSingleADCSample(unsigned int channel);
-unsigned divu10(unsigned n);
-void FilterAndDecimateSamples();
-#define SAMPLEFILTER_TAP_NUM 10
+void UpdateMovingAverages();
+bool SetADCAverage(unsigned int window, unsigned int decimation);
+
+// Decimation filter modes (g_ADCFilterMode)
+//      ADC_FILTER_BOXCAR - Moving average of g_ADCAverageWindow samples, output every g_ADCAverageDecimation samples
+//      ADC_FILTER_FIR    - Q15 FIR decimator per channel, run on the DSP MAC unit (ADCFIRPut)
+//      ADC_FILTER_CIC    - 3 stage CIC decimator followed by a 2:1 compensating FIR, with the output rate of each channel 
+//                          picked from g_ADCOutputRateDecimation[] by g_Config.ChannelRate[channel] (ADCCICPut)
+#define ADC_FILTER_BOXCAR   0
+#define ADC_FILTER_FIR      1
+#define ADC_FILTER_CIC      2
+
+// Output rates for ADC_FILTER_CIC, stored per channel in g_Config.ChannelRate[]
+#define ADC_RATE_10HZ       0
+#define ADC_RATE_50HZ       1
+#define ADC_RATE_100HZ      2
+#define ADC_RATE_500HZ      3
+#define ADC_RATE_COUNT      4
+
+// Largest 12 bit ADC value
+#define ADC_FULL_SCALE      4095
+
+// Ratiometric compensation: the +5VCC low pass time constant (2^n samples) and 1.0 in the unsigned Q1.15 gain.
+#define ADC_VCC_FILTER_SHIFT    6
+#define ADC_RATIOMETRIC_UNITY   0x8000
+// Raw reading of AN5 (1/3 of the rail, 2.49V VRef+) for a 5.000V rail, the default g_Config.VCCNominalRaw
+#define ADC_VCC_NOMINAL_RAW     2742
+
+// Number of integrator/comb stages in the CIC decimator
+#define ADC_CIC_ORDER       3
 
+// Longest FIR supported by the per channel delay lines.
+#define ADC_FIR_MAX_TAPS    24
+
+typedef struct {
+    unsigned int NumTaps;           // Number of taps in use (1 - ADC_FIR_MAX_TAPS)
+    unsigned int Decimation;        // One output for every Decimation input samples
+    unsigned int Phase;             // Input samples since the last output
+    unsigned int HistoryIndex;      // Position of the oldest sample (and where the next one is written)
+    int* Taps;                      // Q15 coefficients, Y memory
+    int* History;                   // Delay line (2*ADC_FIR_MAX_TAPS), X memory
+} st_ADCFIRFilter;
+
+typedef struct {
+    unsigned long Integrator[ADC_CIC_ORDER];    // Integrator stages, run at the input rate (wrap around is expected)
+    unsigned long Comb[ADC_CIC_ORDER];          // Previous input of each comb stage (differential delay of 1)
+    unsigned long Gain;                         // Decimation ^ ADC_CIC_ORDER, divided out of each output
+    unsigned int Decimation;                    // CIC decimation ratio (half of the total, the FIR does the last 2:1)
+    unsigned int Phase;                         // Input samples since the last CIC output
+} st_ADCCICFilter;
+
+// Most extra bits the oversampler supports (4^4 = 256 samples, 16 bit results)
+#define ADC_OVERSAMPLE_MAX_BITS 4
+
+// Longest median / Hampel prefilter (g_Config.PrefilterLength is 3 or 5)
+#define ADC_PREFILTER_MAX_LENGTH 5
+
+typedef struct {
+    unsigned long Sum;              // Sum of the samples so far
+    unsigned int Count;             // Samples in Sum
+    unsigned int Samples;           // Samples per output (4^Shift)
+    unsigned int Shift;             // Extra bits of resolution, 1 - ADC_OVERSAMPLE_MAX_BITS
+} st_ADCOversample;
+
+// Integer statistics of the 1KHz samples (12 bit, after ratiometric correction) that went into one decimated output of a 
+// channel.  Accumulated in the Timer1 interrupt and latched into g_ADCStats[] each time the channel produces a new value.  
+// Min and Max cover the whole window, Sum and SumSquares only its first ADC_STATS_MAX_SAMPLES samples (a 10hz CIC or 4 bit
+// oversampled output is exactly that many, a long SetADCAverage() decimation more), so SumSquares (4095^2 * 256) still fits
+// in 32 bits.
+#define ADC_STATS_MAX_SAMPLES   256
 typedef struct {
-  double history[SAMPLEFILTER_TAP_NUM];
-  unsigned int last_index;
-} SampleFilter;
+    unsigned int Min;
+    unsigned int Max;
+    unsigned int Count;             // Samples in Sum and SumSquares
+    unsigned long Sum;
+    unsigned long SumSquares;
+} st_ADCStats;
 
-void SampleFilter_init(SampleFilter* f);
-void SampleFilter_put(SampleFilter* f, double input);
-double SampleFilter_get(SampleFilter* f);
+// A consistent copy of the decimated ADC values and the CAN counters, published by the Timer1 interrupt once per decimation
+// cycle (PublishADCSnapshot) and read by the main loop (ReadADCSnapshot) with a sequence counter instead of disabling interrupts.
+typedef struct {
+    unsigned int ADCValues[8];
+    unsigned int ADCMillivolts[8];
+    int ADCEngineering[8];
+    st_ADCStats ADCStats[8];
+    unsigned int ADC5VReferenceRaw;
+    unsigned long Timestamp;                // Timebase (us) of the newest sample set (g_ADCTimestamp)
+    unsigned int TimerSeconds;              // Timestamp of the publish (g_TimerSeconds.g_TimerMS)
+    unsigned int TimerMS;
+    unsigned int ADCCaptures;
+    unsigned int ECANTransmitTried;
+    unsigned int ECANTransmitCompleted;
+    unsigned int ECANTransmitTimout;
+    unsigned int ECANTransmitBusy;
+    unsigned int ECANError;
+    unsigned int ECANTXBO;
+    unsigned int ECANTXBP;
+    unsigned int ECANTXWAR;
+    unsigned int ECANIVRIF;
+    unsigned int ECANInterrupts;
+} st_ADCSnapshot;
+
+extern st_ADCFIRFilter g_ADCFIRFilters[8];
+extern st_ADCOversample g_ADCOversample[8];
+extern unsigned int g_ADCOversampleChannels;
+extern st_ADCCICFilter g_ADCCICFilters[8];
+extern int g_ADCFIRDefaultTaps[16];
+extern const unsigned int g_ADCOutputRateDecimation[ADC_RATE_COUNT];
 
+void SetupADCFilters();
+bool ADCFIRInit(unsigned int channel, int* taps, unsigned int numtaps, unsigned int decimation);
+bool ADCFIRPut(unsigned int channel, unsigned int sample, unsigned int* output);
+int ADCFIRDotProduct(int* x, int* h, unsigned int n);
+bool ADCCICInit(unsigned int channel, unsigned int rate);
+bool ADCCICPut(unsigned int channel, unsigned int sample, unsigned int* output);
 
+typedef struct {
+    volatile unsigned int State;        // ADC_CAPTURE_xxx
+    unsigned int Channels;              // Bit per channel captured
+    unsigned int ChannelCount;          // Number of bits set in Channels (samples per row)
+    unsigned int TriggerChannel;
+    unsigned int TriggerMode;           // ADC_TRIGGER_xxx
+    unsigned int TriggerLevel;          // Raw 12 bit ADC counts (level) or counts per scan (slope)
+    unsigned int PreTriggerRows;        // Rows kept from before the trigger
+    unsigned int Rows;                  // Total rows in the capture (pre + post trigger)
+    unsigned int Drain;                 // ADC_CAPTURE_DRAIN_xxx
+    unsigned int Length;                // Rows * ChannelCount, the size of the ring in samples
+    unsigned int WriteIndex;            // Next sample position in the ring
+    unsigned int StartIndex;            // Position of the oldest sample once complete
+    unsigned int FilledRows;            // Rows stored since arming (stops counting at PreTriggerRows)
+    unsigned int RemainingRows;         // Rows still to store after the trigger
+    unsigned int PreviousSample;        // Last trigger channel sample, for edges and slopes
+    unsigned long TriggerTime;          // Timebase (us) of the trigger channel's sample that triggered
+    unsigned int DrainFrame;            // Next CAN frame to send (0 = header)
+    unsigned int Completed;             // Number of captures completed since startup
+} st_ADCCapture;
 
+bool ADCCaptureArm(unsigned int channels, unsigned int triggerchannel, unsigned int triggermode, unsigned int triggerlevel,
+                    unsigned int pretriggerrows, unsigned int rows, unsigned int drain);
+void SetupADCCapture();
+void ADCCaptureForce();
+void ADCCapturePut(const unsigned int* block);
+unsigned int ADCCaptureSample(unsigned int index);
+void ADCCaptureRelease();
+extern st_ADCCapture g_ADCCapture;
 
+void UpdateRatiometricCompensation();
+unsigned int ADCCalibrate(unsigned int channel, unsigned int value);
+int ADCLinearize(unsigned int table, unsigned int millivolts);
+void ADCStatsPut(unsigned int channel, unsigned int sample);
+void ADCStatsLatch(unsigned int channel);
+unsigned int ADCStatsMean(const st_ADCStats* stats);
+unsigned int ADCStatsRMS(const st_ADCStats* stats);
+extern st_ADCStats g_ADCStats[8];
+extern unsigned int g_ADCStatsPending;
+unsigned int ADCPrefilterPut(unsigned int channel, unsigned int sample);
+extern unsigned int g_ADCPrefilterOutliers[8];
+void PublishADCSnapshot();
+void ReadADCSnapshot(st_ADCSnapshot* snapshot);
+bool ADCOversampleInit(unsigned int channel, unsigned int bits);
+bool ADCOversamplePut(unsigned int channel, unsigned int sample, unsigned int* output);
 
 #ifdef	__cplusplus
 }
@@ -14,284 +14,2215 @@
 #include "system.h"
 #include "EEPROM.h"
 #include "global.h"
+#include "adc.h"
+#include "timer1.h"
 
 /*
  * 
  */
 
-// This is the actual DMA Buffer, which holds up to 4 messages.
+// This is the actual DMA Buffer, which holds ECAN1_MSG_BUF_LENGTH messages.
 ECAN1MSGBUF ecan1msgBuf __attribute__((space(dma),section(".dmabuffer"), aligned(ECAN1_MSG_BUF_LENGTH*16)));
 
+// Report by exception state (CAN_REPORT_CHANGE), per CAN packet.  See CANReportPacket().
+unsigned int l_CANPacketAge[CAN_MESSAGE_COUNT];     // ms since the message was last sent
+bool l_CANPacketChanged[CAN_MESSAGE_COUNT];         // A channel moved beyond its deadband since the message was last sent
+unsigned int l_CANLastSent[CAN_MESSAGE_COUNT][8];  // Each channel's value as the message last sent it, in its format
+unsigned int l_CANHeartbeatAge = 0;             // ms since the last heartbeat
+unsigned int l_CANHeartbeatCount = 0;
+
+// Poll requests (see CANPollRequest()): the messages requested and not yet sent (bit per message), and the timebase (us) each
+// was first requested at.  Request to queued latency of the answers, in us.
+volatile unsigned int l_CANPollPending = 0;
+unsigned long l_CANPollTime[CAN_MESSAGE_COUNT];
+unsigned int g_CANPollAnswered = 0;
+unsigned int g_CANPollLatencyLast = 0;
+unsigned int g_CANPollLatencyMax = 0;
+
+// The CAN messages as compiled from g_Config.CanMessages (see CompileCANMessages()), the value unused data bytes and samples
+// copy, and the status nibble of the current sample set (CAN_STATUS_xxx).
+st_CANMessageProgram l_CANMessageProgram[CAN_MESSAGE_COUNT];
+const unsigned int l_CANZero = 0;
+unsigned int l_CANStatus = 0;
+unsigned int l_CANDroppedLast = 0;
+static void CANBuildBytes(const st_CANMessageProgram* program, unsigned int* frame);
+static void CANBuildPacked12(const st_CANMessageProgram* program, unsigned int* frame);
+
+// Timebase (us) at which each transmit buffer was last loaded (see ECANTransmitRefill()), and at which the last frame was 
+// queued.
+unsigned long g_ECANFrameTime[ECAN1_MSG_BUF_LENGTH];
+unsigned long l_ECANLastQueued = 0;
+
+// A class with no reservation, or with its reservation in the RAM ring
+#define ECAN_TX_RESERVED_NONE       0xFFFF
+#define ECAN_TX_RESERVED_QUEUE      0xFFFE
+
+// Transmit queue (see ECANTransmitReserve()): a ring per class, the class's transmit buffer priority and drop policy, the 
+// class of the frame last loaded into each transmit buffer, the buffers reserved but not yet committed (bit per buffer), and
+// where each class's reservation is (ECAN_TX_RESERVED_xxx or the buffer number).
+st_ECANTxQueue l_ECANTxQueue[ECAN_TX_CLASSES];
+const unsigned int l_ECANTxPriority[ECAN_TX_CLASSES] = {3, 2, 1, 0};
+const unsigned int l_ECANTxPolicy[ECAN_TX_CLASSES] = {ECAN_TX_DROP_OLDEST, ECAN_TX_DROP_NEWEST, ECAN_TX_DROP_OLDEST, ECAN_TX_DROP_NEWEST};
+unsigned int l_ECANTxClass[ECAN1_TX_BUFFERS];
+unsigned int l_ECANTxReserved = 0;
+unsigned int l_ECANTxReservation[ECAN_TX_CLASSES] = {ECAN_TX_RESERVED_NONE, ECAN_TX_RESERVED_NONE, ECAN_TX_RESERVED_NONE, ECAN_TX_RESERVED_NONE};
+static unsigned int* ECANTransmitReserveFrame(unsigned int txclass, unsigned int* refused);
+
+// The transmit control registers C1TR01CON..C1TR67CON are consecutive, with the even buffer in the low byte and the odd 
+// buffer in the high byte, so each buffer has its own control byte.  It is only ever read or written as a byte: a word
+// read-modify-write could write back a TXREQ the module has just cleared in the other buffer of the register and send that
+// frame again.  That includes the SYNC buffer 7, the high byte of C1TR67CON.
+#define ECAN_TXCON(buffer)          (((volatile unsigned char*)&C1TR01CON)[buffer])
+#define ECAN_TXEN                   0x80
+#define ECAN_TXREQ                  0x08
+#define ECAN_TXPRI                  0x03
+
+// Commands received on CanCommand_ID, waiting for ProcessECANCommands(): DLC and data words of each frame.  Written only by
+// the ECAN interrupt (l_ECANCommandHead) and read only by the main loop (l_ECANCommandTail).
+unsigned int l_ECANCommand[ECAN_COMMAND_QUEUE_LENGTH][5];
+volatile unsigned int l_ECANCommandHead = 0;
+volatile unsigned int l_ECANCommandTail = 0;
+unsigned int g_ECANCommandsLost = 0;
+
+// A SYNC frame is waiting in ECAN1_SYNC_BUFFER.  The ECAN interrupt reports the TMR1 phase it completed at to SyncTransmitted().
+volatile bool g_ECANSyncQueued = false;
+
+// J1939 address claim (see J1939Tick()): the state and address in use, this node's NAME (4 words, LSB first), ms left of the
+// claim wait, addresses tried since the preferred one was lost, and what the ECAN interrupt has seen since the last tick: 
+// another node claiming our address (with its NAME) and a request for our address.
+volatile unsigned int g_J1939State = J1939_STATE_OFF;
+uint8_t g_J1939Address = J1939_NULL_ADDRESS;
+unsigned int l_J1939Name[4];
+unsigned int l_J1939ClaimWait = 0;
+unsigned int l_J1939AddressesTried = 0;
+volatile bool l_J1939Contention = false;
+unsigned int l_J1939ContenderName[4];
+volatile bool l_J1939ClaimRequested = false;
+bool l_J1939ClaimPending = false;
+
+// The BAM message being sent (Packets is 0 when none), and the first sample of the capture chunk it carries.
+st_J1939Transport l_J1939Transport;
+unsigned int l_J1939CaptureStart = 0;
+static uint8_t J1939CaptureByte(unsigned int offset);
+static void J1939Received(unsigned int buffernumber);
+static void J1939StartAddressClaim();
+static void IsoTpReceived(unsigned int buffernumber, unsigned int target, unsigned int source);
+
+// ISO-TP (see IsoTpTick()).  Receive side, written by the ECAN interrupt: the request being reassembled, its length, bytes 
+// and next consecutive frame so far, consecutive frames left in the block, ms left for the next one (0 = not receiving), the
+// tester it is from, a complete request waiting for IsoTpTick(), and a flow control (ISOTP_FC_xxx) to send.
+uint8_t l_IsoTpRxBuffer[ISOTP_RX_BUFFER_LENGTH];
+unsigned int l_IsoTpRxLength = 0;
+unsigned int l_IsoTpRxOffset = 0;
+unsigned int l_IsoTpRxSequence = 0;
+unsigned int l_IsoTpRxBlockLeft = 0;
+volatile unsigned int l_IsoTpRxTimeout = 0;
+uint8_t l_IsoTpRxTester = 0;
+volatile bool l_IsoTpRequestReady = false;
+volatile bool l_IsoTpSendFlowControl = false;
+unsigned int l_IsoTpFlowStatus = ISOTP_FC_CTS;
+// Transmit side: the response in progress, the flow control received for it (ISOTP_FC_xxx, block size and STmin), the 
+// service it answers, and its first bytes (the response code and a short reply or header).
+st_IsoTpTransmit l_IsoTpTx;
+volatile bool l_IsoTpFlowReceived = false;
+volatile uint8_t l_IsoTpFlow[3];
+uint8_t l_IsoTpService = 0;
+uint8_t l_IsoTpReply[9];
+unsigned int g_IsoTpRequests = 0;
+unsigned int g_IsoTpResponses = 0;
+unsigned int g_IsoTpAborted = 0;
+
+// Bus load accounting for the current second (see UpdateCANBusLoad())
+unsigned long l_CANBitsThisSecond = 0;
+unsigned int l_CANFramesThisSecond = 0;
+
 /*
- *      BuildCANPackets() -     This routine till fill in the global CAN packet structures with data from the global
- *                              ADC structures.  Obviously this is not a nested thread safe process given the use of
- *                              single global variables.   This routine will eventually be significantly enhanced so it
- *                              can follow a configurable structure conversion.    This routeine does get the two CAN ID 
- *                              numbers from the CanMessageN_ID globals, and those globals are configured from the 
- *                              simulated EEPROM memory.   No return values or failures states.
+ *      ECANExtendedHeader() -  Frame words 0-2 (SID, EID, DLC) for a 29 bit ID.
  */
-void BuildCANPackets()
+static void ECANExtendedHeader(unsigned int* frame, unsigned long id, unsigned int dlc)
 {
-    // Take the data from the ADC buffer and put them in the CAN Packet Buffers
-    /* g_ADCValues[0]= 0x0123;
-    g_ADCValues[1]= 0x0456;
-    g_ADCValues[2]= 0x0789;
-    g_ADCValues[3]= 0x0ABC; */
-    
-    
-    g_CANPacket1[0] = (g_Config.CanMessage1_ID & 0x000007FF) << 2 ; // Simple SID
-    g_CANPacket1[1] = 0;                                            // No EID
-    g_CANPacket1[2] = 8;                                            // 8 bytes of data
-    // These compressions are backwards, as they should be the LSB before the MSB  *TOFIX*
-    g_CANPacket1[3] = (g_ADCValues[0]<<4)|(g_ADCValues[1]>>8);      // Bytes 0 & 1  
-    g_CANPacket1[4] = (g_ADCValues[1]<<8)|(g_ADCValues[2]>>4);      // Bytes 2 & 3
-    g_CANPacket1[5] = (g_ADCValues[2]<<12)|(g_ADCValues[3]);        // Bytes 4 & 5
-    g_CANPacket1[6] = g_CANSequenceNumber;                          // Bytes 6 & 7
-    g_CANPacket1[7] = 0x00;                                         // Unused
-    
-    g_CANPacket2[0] = (g_Config.CanMessage2_ID & 0x000007FF) << 2 ; // Simple SID
-    g_CANPacket2[1] = 0;                                            // No EID
-    g_CANPacket2[2] = 8;                                            // 8 bytes of data
-    // These compressions are backwards, as they should be the LSB before the MSB  *TOFIX*
-    g_CANPacket2[3] = g_ADCValues[4];                               // Bytes 0 & 1  
-    g_CANPacket2[4] = g_ADCValues[5];                               // Bytes 2 & 3
-    g_CANPacket2[5] = g_ADCValues[6];                               // Bytes 4 & 5
-    g_CANPacket2[6] = g_CANSequenceNumber++;                        // Bytes 6 & 7
-    g_CANPacket2[7] = 0x00;                                         // Unused
-    
+    frame[0] = (((unsigned int)(id >> 18) & 0x07FF) << 2) | 0x0003;    // SID<10:0>, SRR and IDE
+    frame[1] = (unsigned int)(id >> 6) & 0x0FFF;                        // EID<17:6>
+    frame[2] = ((unsigned int)id << 10) | dlc;                          // EID<5:0> and DLC
 }
 
 /*
- *      TransmitCANPackets() -     This routine will transmit the two global CAN packets as built using the 
- *                                 BuldCANPackets() routine.   The TransmitECANFrame function used to transmit
- *                                 will add the packet to the DMA transmit buffers and flag for transmission but
- *                                 will not wait for the transmit to complete.  If the transmission fails later, the
- *                                 DMA buffers are cleared for transmit and the transmission is lost.
- *                              
+ *      J1939FrameHeader() - Frame words 0-2 (SID, EID, DLC) for a J1939 frame from this node: the 29 bit ID is priority, the
+ *                           PGN (with the destination address in its low byte for PDU1 PGNs) and the source address.
  */
-void TransmitCANPackets()
+static void J1939FrameHeader(unsigned int* frame, unsigned int priority, unsigned long pgn, unsigned int dlc)
 {
-    TransmitECANFrame( &g_CANPacket2 );
-    TransmitECANFrame( &g_CANPacket1 );    
+    ECANExtendedHeader(frame, ((unsigned long)(priority & 0x07) << 26) | ((pgn & 0x0003FFFF) << 8) | g_J1939Address, dlc);
 }
 
-void TransmitECANStartupFrame()
+/*
+ *      CANFrameHeader() -  Frame words 0-2 (SID, EID, DLC) for one of this node's frames: its 11 bit ID, or in CAN_ID_J1939 
+ *                          mode its PGN (g_Config.J1939PGN + 'pgnoffset', J1939_PGN_xxx).
+ */
+static void CANFrameHeader(unsigned int* frame, unsigned int sid, unsigned int pgnoffset, unsigned int dlc)
 {
+    if (g_Config.CanIDMode == CAN_ID_J1939)
+    {
+        J1939FrameHeader(frame, g_Config.J1939Priority, g_Config.J1939PGN + pgnoffset, dlc);
+        return;
+    }
+    frame[0] = (sid & 0x000007FF) << 2 ;                            // Simple SID
+    frame[1] = 0;                                                   // No EID
+    frame[2] = dlc;
+}
 
-    g_CANPacket1[0] = (g_Config.CanStartup_ID & 0x000007FF) << 2 ; // Simple SID
-    g_CANPacket1[1] = 0;                                            // No EID
-    g_CANPacket1[2] = 8;                                            // 8 bytes of data
-    g_CANPacket1[3] = g_Config.CanStartup_SerialNumber;             // Bytes 0 & 1  
-    g_CANPacket1[4] = 0xAABB;                                       // Bytes 2 & 3
-    g_CANPacket1[5] = 0xCCDD;                                       // Bytes 4 & 5
-    g_CANPacket1[6] = 0xEEFF;                                       // Bytes 6 & 7
-    g_CANPacket1[7] = 0x00;                                         // Unused    
-    TransmitECANFrame( &g_CANPacket1 ); 
-
+/*
+ *      CANMessageValues() -    The array of channel values a CAN message sends for its CAN_FORMAT_xxx setting.  The engineering
+ *                              units are signed, but go out as the same 16 bit two's complement words.
+ */
+static unsigned int* CANMessageValues(uint8_t format)
+{
+    if (format == CAN_FORMAT_MILLIVOLTS)
+    {
+        return g_ADCMillivolts;
+    }
+    if (format == CAN_FORMAT_ENGINEERING)
+    {
+        return (unsigned int*)g_ADCEngineering;
+    }
+    return g_ADCValues;
+}
 
+/*
+ *      CANPackedShift() -      The extra bits a channel's values carry, to bring them back to 12 bits for CAN_FORMAT_PACKED12.
+ *                              This is the oversampler as it is running (set up by SetupADCFilters() at startup), not
+ *                              g_Config.ChannelOversample[], which can be changed over CAN without the ADC path following it.
+ */
+static unsigned int CANPackedShift(unsigned int channel)
+{
+    return (g_ADCOversampleChannels & (1 << channel)) ? g_ADCOversample[channel].Shift : 0;
 }
+
 /*
- *      TransmitECANFrame() -   Transmit a single CAN frame.  The frame is put into the DMA buffer frame in a slot that is not
- *                              currently being used, and that slot is flagged for transmit.  Transmission happens automaticly
- *                              and if there is a problem that is detected in the interrrupt vector functions.
- *                              
+ *      CompileCANMessages() -  Turn the message maps in g_Config.CanMessages into l_CANMessageProgram: the frame's ID words
+ *                              (11 bit or J1939) and length, the channels it carries, and for each of the 8 data bytes a pointer to the byte it is 
+ *                              copied from (a channel value in the message's format, the +5VCC reading, the sequence number, the
+ *                              status nibble or a constant 0).  CAN_FORMAT_PACKED12 messages get a pointer to each of their 5
+ *                              samples instead.  Called when the configuration is loaded or changed (or the J1939 address),
+ *                              so BuildCANMessage() never looks at the configuration.
  */
-bool TransmitECANFrame(unsigned int (*packet)[])
+void CompileCANMessages()
 {
- 
+    st_CANMessageMap* map;
+    st_CANMessageProgram* program;
+    unsigned int* values;
+    unsigned int header[3];
+    unsigned int message;
+    unsigned int i;
+    uint8_t code;
 
-    g_ECANTransmitTried++;
-    // buffernumber is the DMAbuffer we are going to use. ECAN1_MSG_BUF_LENGTH is defined as the number of buffers in the DMA
-    // space allocation.  That number (typically 4 or 8) is also configued in the CAN module.  The first 8 buffers in the DMA buffer 
-    // are the only ones that can be used for ECAN transmission, so no need to have more than 8.  This code currently only uses the first
-    // two buffers since we are only transmitting 2 frames at a time.  We should expand it to be more generic.
-    // Once you fill a DMA buffer with stuff to send, you set a flag in the CAN module (corresponding to which buffer you are using)
-    // to tell the CAN module to start transmitting (using DMA)
-    int buffernumber = 0;
-    
-    int maxtime = 0;
+    for (message=0; message<CAN_MESSAGE_COUNT; message++)
+    {
+        map = &g_Config.CanMessages[message];
+        program = &l_CANMessageProgram[message];
+        values = CANMessageValues(map->Format);
 
-    // We will first check the TXREQ0 flag, which tells us if buffer 0 is still being used. 
+        CANFrameHeader(header, map->ID, J1939_PGN_DATA + message, 0);
+        program->SID = header[0];
+        program->EID = header[1];
+        program->EIDLow = header[2];
+        program->DLC = (map->Length > 8) ? 8 : map->Length;
+        program->Channels = 0;
+        program->Values = values;
+        // The deadband baseline is the message's own, in its own format, starting from the values as they are now.
+        for (i=0; i<8; i++)
+        {
+            l_CANLastSent[message][i] = values[i];
+        }
 
-      
-    if ( C1TR01CONbits.TXREQ0 == 1)
-    {
-        
-        // Since buffer 0 is still being used, lets look to see if buffer 1 is available. 
-        if ( C1TR01CONbits.TXREQ1 == 1)
+        if (map->Format == CAN_FORMAT_PACKED12)
         {
-            // If both buffers are busy, we are going to loop and wait for buffer 0 to become free.  We could loop looking at both buffers,
-            // but we know that since we submit buffer 0 before buffer 1, buffer 0 will be the first to get freed.  This while loop will
-            // only delay 400us for the buffer to become free.  This number should really be based on the CAN bus rate.  In the case of a 
-            // 1mbit bus a frame should be transmitted in less than 288us, so 400us is enough time.
-            while ( C1TR01CONbits.TXREQ0 == 1)
+            program->Build = CANBuildPacked12;
+            program->DLC = (map->Length == 0) ? 0 : 8;
+            for (i=0; i<5; i++)
             {
-                maxtime++;
-                DelayuS(10);
-                if (maxtime >= 40) 
+                code = map->Data[i];
+                program->Shift[i] = 0;
+                if (code == CAN_DATA_CH0_LSB)
                 {
-                    // This is a failsafe.  If we are waiting for more than 400us for space, something is wrong and we will just skip
-                    //   this packet transmission.
-                    break;
+                    program->Sample[i] = &g_ADCValues[0];
+                    program->Shift[i] = CANPackedShift(0);
+                    program->Channels |= 0x01;
+                }
+                else if ((code >= CAN_DATA_CH1_LSB) && (code <= CAN_DATA_CH7_MSB))
+                {
+                    program->Sample[i] = &g_ADCValues[1 + ((code - CAN_DATA_CH1_LSB) >> 1)];
+                    program->Shift[i] = CANPackedShift(1 + ((code - CAN_DATA_CH1_LSB) >> 1));
+                    program->Channels |= 1 << (1 + ((code - CAN_DATA_CH1_LSB) >> 1));
+                }
+                else if (code == CAN_DATA_VCC_LSB)
+                {
+                    program->Sample[i] = &g_ADCVCCFiltered;
+                }
+                else if (code == CAN_DATA_STATUS)
+                {
+                    program->Sample[i] = &l_CANStatus;
+                }
+                else
+                {
+                    program->Sample[i] = &l_CANZero;
                 }
             }
+            continue;
+        }
 
-            // At this point, we are either here because buffer 0 is available, or we have timed out.
-            // Let's check the flag one last time.. if it is free we will use buffer 0, if not that means
-            // we have timed out.  
-            if ( C1TR01CONbits.TXREQ0 == 0)
+        program->Build = CANBuildBytes;
+        for (i=0; i<8; i++)
+        {
+            code = (i < program->DLC) ? map->Data[i] : CAN_DATA_ZERO;
+            if ((code >= CAN_DATA_CH0_LSB) && (code <= CAN_DATA_CH0_MSB))
+            {
+                program->Source[i] = (const uint8_t*)&values[0] + (code - CAN_DATA_CH0_LSB);
+                program->Channels |= 0x01;
+            }
+            else if ((code >= CAN_DATA_CH1_LSB) && (code <= CAN_DATA_CH7_MSB))
+            {
+                program->Source[i] = (const uint8_t*)&values[1 + ((code - CAN_DATA_CH1_LSB) >> 1)] + ((code - CAN_DATA_CH1_LSB) & 1);
+                program->Channels |= 1 << (1 + ((code - CAN_DATA_CH1_LSB) >> 1));
+            }
+            else if ((code == CAN_DATA_VCC_LSB) || (code == CAN_DATA_VCC_MSB))
+            {
+                program->Source[i] = (const uint8_t*)&g_ADCVCCFiltered + (code - CAN_DATA_VCC_LSB);
+            }
+            else if ((code == CAN_DATA_SEQUENCE_LSB) || (code == CAN_DATA_SEQUENCE_MSB))
+            {
+                program->Source[i] = (const uint8_t*)&g_CANSequenceNumber + (code - CAN_DATA_SEQUENCE_LSB);
+            }
+            else if (code == CAN_DATA_STATUS)
             {
-                buffernumber = 0;
+                program->Source[i] = (const uint8_t*)&l_CANStatus;
             }
             else
             {
-                // If we run out of time, something must be wrong.  We will set the buffernumber to 99 to indicate
-                // a timeout condition.
-                buffernumber = 99;
+                program->Source[i] = (const uint8_t*)&l_CANZero;
             }
-           
-        } 
-        else
-        {
-            // it looks like buffer 1 is available for transmit. 
-            buffernumber = 1;
         }
     }
-    else
+}
+
+/*
+ *      BuildCANMessage() -     Fill in a reserved frame with one message, as compiled by CompileCANMessages().
+ */
+void BuildCANMessage(unsigned int message, unsigned int* frame)
+{
+    const st_CANMessageProgram* program = &l_CANMessageProgram[message];
+
+    program->Build(program, frame);
+}
+
+/*
+ *      CANBuildBytes() -       Byte mapped messages.  The 16 bit values are little-endian in memory, the same byte order as the
+ *                              CAN data, so LSB / MSB codes select the byte directly.
+ */
+static void CANBuildBytes(const st_CANMessageProgram* program, unsigned int* frame)
+{
+    uint8_t* data = (uint8_t*)&frame[3];
+
+    frame[0] = program->SID;
+    frame[1] = program->EID;
+    frame[2] = program->EIDLow | program->DLC;
+    data[0] = *program->Source[0];
+    data[1] = *program->Source[1];
+    data[2] = *program->Source[2];
+    data[3] = *program->Source[3];
+    data[4] = *program->Source[4];
+    data[5] = *program->Source[5];
+    data[6] = *program->Source[6];
+    data[7] = *program->Source[7];
+}
+
+/*
+ *      CANBuildPacked12() -    CAN_FORMAT_PACKED12 messages: five 12 bit samples and the low 4 bits of the sequence number, 
+ *                              little-endian (see ecan.h).  Each 16 bit frame word takes the pieces of the samples that fall
+ *                              in it.
+ */
+static void CANBuildPacked12(const st_CANMessageProgram* program, unsigned int* frame)
+{
+    unsigned int s0 = (*program->Sample[0] >> program->Shift[0]) & 0x0FFF;
+    unsigned int s1 = (*program->Sample[1] >> program->Shift[1]) & 0x0FFF;
+    unsigned int s2 = (*program->Sample[2] >> program->Shift[2]) & 0x0FFF;
+    unsigned int s3 = (*program->Sample[3] >> program->Shift[3]) & 0x0FFF;
+    unsigned int s4 = (*program->Sample[4] >> program->Shift[4]) & 0x0FFF;
+
+    frame[0] = program->SID;
+    frame[1] = program->EID;
+    frame[2] = program->EIDLow | program->DLC;
+    frame[3] = s0 | (s1 << 12);                                     // Bits 0-15
+    frame[4] = (s1 >> 4) | (s2 << 8);                               // Bits 16-31
+    frame[5] = (s2 >> 8) | (s3 << 4);                               // Bits 32-47
+    frame[6] = s4 | (g_CANSequenceNumber << 12);                    // Bits 48-63
+}
+
+/*
+ *      CANUpdateStatus() -     Work out the status nibble (CAN_STATUS_xxx) for the sample set about to be sent.
+ */
+static void CANUpdateStatus()
+{
+    unsigned int status = 0;
+
+    if (g_ECANTransmitTimout != l_CANDroppedLast)
+    {
+        status |= CAN_STATUS_DROPPED;
+    }
+    if (g_ADCVCCFiltered < (g_Config.VCCNominalRaw / 2))
+    {
+        status |= CAN_STATUS_VCC_FAULT;
+    }
+    if ((g_Config.SyncMode == SYNC_MASTER) || 
+        ((g_Config.SyncMode == SYNC_SLAVE) && (g_SyncFrames != 0) && (abs(g_SyncError) <= SYNC_LOCK_LIMIT)))
+    {
+        status |= CAN_STATUS_SYNC;
+    }
+    if ((g_ADCCapture.State == ADC_CAPTURE_ARMED) || (g_ADCCapture.State == ADC_CAPTURE_TRIGGERED))
     {
-        // Buffer 0 is free, so lets use it.
-        buffernumber = 0;
+        status |= CAN_STATUS_CAPTURE;
     }
+    l_CANStatus = status;
+}
 
-    // buffernumer is either 0,1, or 99.  
-    
-    //  If we timed out, add to the diag counters and fail out
-    if ( buffernumber == 99)
+/*
+ *      CANPollRequest() -  Called from the ECAN interrupt with messages requested (bit per message) and the timebase the request
+ *                          was received at.  The messages go out at the next Timer1 tick.  A message requested again before 
+ *                          then is sent once, and its latency counts from the first request.
+ */
+static void CANPollRequest(unsigned int messages, unsigned long received)
+{
+    unsigned int message;
+
+    for (message=0; message<CAN_MESSAGE_COUNT; message++)
     {
-        g_ECANTransmitTimout++;
-        return false;
+        if ((messages & (1 << message)) && ((l_CANPollPending & (1 << message)) == 0) && (l_CANMessageProgram[message].DLC != 0))
+        {
+            l_CANPollTime[message] = received;
+            l_CANPollPending |= (1 << message);
+        }
     }
+}
 
-    //  We are good to overwrite a new message in the transmit buffer and send.  buffernumber has the buffer we should use.
-    ecan1msgBuf[buffernumber][0] = (*packet)[0];   
-    ecan1msgBuf[buffernumber][1] = (*packet)[1];   
-    ecan1msgBuf[buffernumber][2] = (*packet)[2];   
-    ecan1msgBuf[buffernumber][3] = (*packet)[3];
-    ecan1msgBuf[buffernumber][4] = (*packet)[4];
-    ecan1msgBuf[buffernumber][5] = (*packet)[5];
-    ecan1msgBuf[buffernumber][6] = (*packet)[6];
-   
+/*
+ *      CANPollAnswered() - A requested message has been queued: record the request to queued latency.  The data class has the
+ *                          highest transmit priority, so from here it only waits for frames already queued ahead of it and 
+ *                          the bus.
+ */
+static void CANPollAnswered(unsigned int message)
+{
+    unsigned long latency = l_ECANLastQueued - l_CANPollTime[message];
 
-    if (buffernumber == 0)
+    g_CANPollLatencyLast = (latency > 0xFFFF) ? 0xFFFF : (unsigned int)latency;
+    if (g_CANPollLatencyLast > g_CANPollLatencyMax)
     {
-        // Enable this buffer to transmit
-        C1TR01CONbits.TXREQ0 = 1;
+        g_CANPollLatencyMax = g_CANPollLatencyLast;
     }
-    else
+    g_CANPollAnswered++;
+}
+
+/*
+ *      CANReportPacket() - Report by exception decision for one message, made every Timer1 tick.  A channel with a new value
+ *                          that differs from the value this message last sent by more than its deadband marks the message
+ *                          changed.  Each message keeps its own last sent values, so messages sharing a channel, or
+ *                          carrying it in different formats, each see the change.
+ *                          The message goes out once it is changed and ReportMinInterval has passed, or when ReportMaxInterval
+ *                          passes without a send.  Returns true if the packet should be sent now.
+ */
+static bool CANReportPacket(unsigned int packet, unsigned int channels)
+{
+    unsigned int mask = l_CANMessageProgram[packet].Channels;
+    const unsigned int* values = l_CANMessageProgram[packet].Values;
+    unsigned int channelnumber;
+    int difference;
+
+    if (l_CANPacketAge[packet] < 0xFFFF)
     {
-        C1TR01CONbits.TXREQ1 = 1;
+        l_CANPacketAge[packet]++;
+    }
+    for (channelnumber=0;channelnumber<=7;channelnumber++)
+    {
+        if (channels & mask & (1 << channelnumber))
+        {
+            // Two's complement difference, so this works for the signed engineering units as well.
+            difference = (int)(values[channelnumber] - l_CANLastSent[packet][channelnumber]);
+            if ((unsigned int)abs(difference) > g_Config.Deadband[channelnumber])
+            {
+                l_CANPacketChanged[packet] = true;
+            }
+        }
     }
-    
-    
-    return true;
 
+    if ((l_CANPacketChanged[packet] && (l_CANPacketAge[packet] >= g_Config.ReportMinInterval)) ||
+        ((g_Config.ReportMaxInterval != 0) && (l_CANPacketAge[packet] >= g_Config.ReportMaxInterval)))
+    {
+        for (channelnumber=0;channelnumber<=7;channelnumber++)
+        {
+            if (mask & (1 << channelnumber))
+            {
+                l_CANLastSent[packet][channelnumber] = values[channelnumber];
+            }
+        }
+        l_CANPacketAge[packet] = 0;
+        l_CANPacketChanged[packet] = false;
+        return true;
+    }
+    if (channels & mask)
+    {
+        g_CANPacketsSuppressed++;
+    }
+    return false;
 }
 
 /*
- *      ConfigureECAN1() -   Configure the ECAN1 module for tranmission use.
- *                              
+ *      TransmitUpdatedCANPackets() - Called every Timer1 tick with the channels that have a new value ('channels' is a bit per
+ *                                    channel, g_ADCUpdatedChannels, and may be 0).  In CAN_REPORT_PERIODIC mode the messages 
+ *                                    that carry a new value are built and sent, so each message goes out at the rate of its 
+ *                                    fastest channel.  Messages with a Length of 0 are off.  In CAN_REPORT_CHANGE mode CANReportPacket() decides, and the heartbeat is sent.
+ *                                    In CAN_REPORT_POLL mode only requested messages go out (plus the heartbeat), and in
+ *                                    every mode the messages requested since the last tick are added.
+ *                                    The sequence number advances once per call that sends anything.
  */
-void ConfigureECAN1()
+void TransmitUpdatedCANPackets(unsigned int channels)
 {
-    // Put CAN Module in Configuration mode and wait for it to get there.
-    C1CTRL1bits.REQOP=4;
-    while (C1CTRL1bits.OPMODE!=4);
+    bool send;
+    bool sent = false;
+    unsigned int* frame;
+    unsigned int message;
+    unsigned int polled;
+    unsigned int interruptenabled;
 
-    // Setup ECAN Timing Bits
+    // A J1939 node sends nothing until it has claimed its address.
+    if ((g_Config.CanIDMode == CAN_ID_J1939) && (g_J1939State != J1939_STATE_CLAIMED))
+    {
+        l_CANPollPending = 0;
+        return;
+    }
 
-    // Baud Rate Prescaler based on CAN_BRP_VAL.  This determines the basic CANbus datarate.
-    C1CFG1bits.BRP = CAN_BRP_VAL;
+    // Take the poll requests the ECAN interrupt has received so far, later ones are answered next tick.
+    interruptenabled = IEC2bits.C1IE;
+    IEC2bits.C1IE = 0;
+    polled = l_CANPollPending;
+    l_CANPollPending = 0;
+    IEC2bits.C1IE = interruptenabled;
 
-    // Synronization Jump Width set of 4 (based on datasheet)
-    C1CFG1bits.SJW = 0x3;
-    // Phase 1 Segment Time is 8 (based on datasheet)
-    C1CFG2bits.SEG1PH = 0x7;
-    // Allow Phase 2 Segment time to be programmable. 
-    C1CFG2bits.SEG2PHTS = 0x1;
-    // and then set the Phase 2 Segment Time to 6 (based on datasheet)
-    C1CFG2bits.SEG2PH = 0x5;
-    // Propegation Segment time is 5 (based on datasheet)
-    C1CFG2bits.PRSEG = 0x4;
-    // Bus is sampled 3 times (based on datasheet)
-    C1CFG2bits.SAM = 0x1;
+    CANUpdateStatus();
+    for (message=0; message<CAN_MESSAGE_COUNT; message++)
+    {
+        if (l_CANMessageProgram[message].DLC == 0)
+        {
+            continue;
+        }
+        if (g_Config.CanReportMode == CAN_REPORT_CHANGE)
+        {
+            send = CANReportPacket(message, channels);
+        }
+        else if (g_Config.CanReportMode == CAN_REPORT_POLL)
+        {
+            send = false;
+        }
+        else
+        {
+            send = (channels & l_CANMessageProgram[message].Channels) != 0;
+        }
+        if ((send || (polled & (1 << message))) && ((frame = ECANTransmitReserve(ECAN_TX_CLASS_DATA)) != NULL))
+        {
+            BuildCANMessage(message, frame);
+            ECANTransmitCommit(ECAN_TX_CLASS_DATA);
+            sent = true;
+            if (polled & (1 << message))
+            {
+                CANPollAnswered(message);
+            }
+        }
+    }
+    if (g_Config.CanReportMode != CAN_REPORT_PERIODIC)
+    {
+        TransmitCANHeartbeat();
+    }
 
-    // Configure the size of the DMA buffer ( in number of messages).  Only the first 8 messages in the DMA buffer can be used for
-    // transmit, so we will only support 4 or 8 message buffers.
-    if ( ECAN1_MSG_BUF_LENGTH == 4)
+    if (sent)
     {
-        C1FCTRLbits.DMABS = 0b000;   //  On a 24H this means the DMA buffer is 4 messages wide (8 words for each message)
+        l_CANDroppedLast = g_ECANTransmitTimout;
+        if (g_Config.CanTimestampMode == CAN_TIMESTAMP_FRAME)
+        {
+            TransmitCANTimestampFrame();
+        }
+        g_CANSequenceNumber++;
     }
-    else if (ECAN1_MSG_BUF_LENGTH == 8)
+
+    if (g_ADCStatsPending & g_Config.StatsChannels)
     {
-        C1FCTRLbits.DMABS = 0b010;   //  On a 24H this means the DMA buffer is 8 messages wide (8 words for each message)
+        TransmitADCStatsFrame();
     }
+}
 
-    // Switch to Normal Operation mode.  This will loop and wait for the module to get ready.
-    C1CTRL1bits.REQOP = 0;
-    while (C1CTRL1bits.OPMODE!= 0);
+/*
+ *      TransmitADCStatsFrame() -   Send the statistics of one channel whose window closed (g_ADCStatsPending) and has a stats 
+ *                                  frame enabled (g_Config.StatsChannels), on CanStats_ID + channel.  At most one per Timer1
+ *                                  tick, queued below the data packets so the stats never hold them up.  A 
+ *                                  channel that closes another window before its frame goes out just sends the newer one.
+ *                                      Bytes 0&1 min, 2&3 max, 4&5 mean, 6&7 RMS (raw 12 bit ADC counts, LSB first)
+ */
+void TransmitADCStatsFrame()
+{
+    unsigned int* frame;
+    unsigned int pending = g_ADCStatsPending & g_Config.StatsChannels;
+    unsigned int channelnumber = 0;
+    st_ADCStats* stats;
 
-    // Configure Buffer 0 (First buffer in the DMA Area) as a transmit buffer)
+    frame = ECANTransmitReserve(ECAN_TX_CLASS_STATS);
+    if (frame == NULL)
+    {
+        return;
+    }
 
-    C1TR01CONbits.TXEN0 =1;
-    C1TR01CONbits.TX0PRI = 0b11;
-    C1TR01CONbits.TXREQ0 = 0;
-    
-    // Configure Buffer 1 (Second buffer in the DMA Area) as a transmit buffer)
-    
-    C1TR01CONbits.TXEN1 =1;
-    C1TR01CONbits.TX1PRI = 0b11;
-    C1TR01CONbits.TXREQ1 = 0;
+    while ((pending & (1 << channelnumber)) == 0)
+    {
+        channelnumber++;
+    }
+    stats = &g_ADCStats[channelnumber];
 
-    // Configure the DMA Channel 0
+    CANFrameHeader(frame, g_Config.CanStats_ID + channelnumber, J1939_PGN_STATS + channelnumber, 8);
+    frame[3] = stats->Min;                                          // Bytes 0 & 1
+    frame[4] = stats->Max;                                          // Bytes 2 & 3
+    frame[5] = ADCStatsMean(stats);                                 // Bytes 4 & 5
+    frame[6] = ADCStatsRMS(stats);                                  // Bytes 6 & 7
+    ECANTransmitCommit(ECAN_TX_CLASS_STATS);
+    g_ADCStatsPending &= ~(1 << channelnumber);
+}
 
-    DMACS0 = 0;
-    
-    // DMA0CON - Disable Channel, Word Transfer Size, Direct to Peripheral from RAM, Interrupt on full transfer, 
-    //           Normal Operation, Peripheral Indirect Addressing, Continuous no Ping-Pong
-    DMA0CON = 0x2020;
-    
-    // DMA0PAD - This is set to the address of the ECAN module from the datasheet.  0x0442 is the Transmit ECAN Address (C1TXD))
-    DMA0PAD = 0x0442;
-    
-    // DMA0CNT - Number of words to transfer (+1 is added to this number).   ECAN needs needs 6 words for a standard message
-    // Note that while the 'message' in the DMA buffer is 8 words long, the CAN module will only request 6 words over DMA for a simple 
-    // message.  If this number is configured incorrectly the only fault is the DMA interrupts will not occur at the correct interval.
-    // Effectivly this number is just used to count DMA transfers for the purpose of firing the DMA interrupt on completion.
-    DMA0CNT = 5;
-    
-    // DMA0REQ - Automatic DMA by Request, DMA Request from ' ECAN1 TX Data Request '
-    DMA0REQ = 0x0046;
-    
-    // DMA0STA - Set to the address of the DMA buffer
-    DMA0STA = __builtin_dmaoffset(&ecan1msgBuf);
-    
-    // Enable the DMA Channel now (which means as soon as the ECAN is triggered, it will start a DMA transfer)
-    DMA0CONbits.CHEN = 1;
+/*
+ *      TransmitCANTimestampFrame() -   Follows the data packets of a sample set (same sequence number) on CanTimestamp_ID, so 
+ *                                      receivers can place the samples in time and see how long they took to get out:
+ *                                          Bytes 0-3 sample set timestamp (g_ADCTimestamp, us, LSB first)
+ *                                          Bytes 4&5 sequence number of the data packets
+ *                                          Bytes 6&7 us from the sample set to the last data packet being loaded for 
+ *                                                    transmission (0xFFFF if longer)
+ */
+void TransmitCANTimestampFrame()
+{
+    unsigned int* frame;
+    unsigned long latency = l_ECANLastQueued - g_ADCTimestamp;
 
-    // Enable ECAN1 Interrupts, and enable transmit interrupt.  This will turn on the ECAN1 interrupt, and configure that interrupt
-    // to occur for either transmission completion, or error.
-    IEC2bits.C1IE = 1;
-    C1INTEbits.TBIE = 1;
-    C1INTEbits.ERRIE = 1;
+    frame = ECANTransmitReserve(ECAN_TX_CLASS_DATA);
+    if (frame == NULL)
+    {
+        return;
+    }
 
-    // Enable the DMA Channel 0 completion interrupt.  This interrupt will fire at the completion of each DMA transfer.  This is being used
-    // for debugging and statistics purposes only.  In production we will probably turn this off.
-    IEC0bits.DMA0IE = 1;
-    
-    // Clear the full and overflow flags.
-    C1RXFUL1=C1RXFUL2=C1RXOVF1=C1RXOVF2=0x0000;
+    CANFrameHeader(frame, g_Config.CanTimestamp_ID, J1939_PGN_TIMESTAMP, 8);
+    frame[3] = (unsigned int)g_ADCTimestamp;                        // Bytes 0 & 1
+    frame[4] = (unsigned int)(g_ADCTimestamp >> 16);                // Bytes 2 & 3
+    frame[5] = g_CANSequenceNumber;                                 // Bytes 4 & 5
+    frame[6] = (latency > 0xFFFF) ? 0xFFFF : (unsigned int)latency; // Bytes 6 & 7
+    ECANTransmitCommit(ECAN_TX_CLASS_DATA);
+}
 
-    // ECAN1 is ready for transmission.  To send, set TXREQ flag for corresponding buffer.   ECAN Interrupt will confirm message transmission.
-    
+/*
+ *      TransmitCANHeartbeat() -    In CAN_REPORT_CHANGE and CAN_REPORT_POLL modes a quiet node sends nothing, so every HeartbeatInterval ms it sends
+ *                                  a heartbeat on CanStartup_ID to show it is alive:
+ *                                      Bytes 0&1 serial number, 2&3 heartbeat count, 4&5 packets suppressed, 
+ *                                      6&7 bus load (0.1%)
+ */
+void TransmitCANHeartbeat()
+{
+    unsigned int* frame;
+
+    if (g_Config.HeartbeatInterval == 0)
+    {
+        return;
+    }
+    l_CANHeartbeatAge++;
+    if (l_CANHeartbeatAge < g_Config.HeartbeatInterval)
+    {
+        return;
+    }
+    l_CANHeartbeatAge = 0;
+    l_CANHeartbeatCount++;
+
+    frame = ECANTransmitReserve(ECAN_TX_CLASS_STATUS);
+    if (frame == NULL)
+    {
+        return;
+    }
+
+    CANFrameHeader(frame, g_Config.CanStartup_ID, J1939_PGN_HEARTBEAT, 8);
+    frame[3] = g_Config.CanStartup_SerialNumber;                    // Bytes 0 & 1
+    frame[4] = l_CANHeartbeatCount;                                 // Bytes 2 & 3
+    frame[5] = g_CANPacketsSuppressed;                              // Bytes 4 & 5
+    frame[6] = g_CANBusLoad;                                        // Bytes 6 & 7
+    ECANTransmitCommit(ECAN_TX_CLASS_STATUS);
+}
 
+/*
+ *      UpdateCANBusLoad() - Called once a second from the Timer1 interrupt.  Latches the number of frames this node sent over
+ *                           the last second and the share of the bus they used (g_CANFramesPerSecond and g_CANBusLoad in 0.1%).
+ *                           Frame lengths are counted without stuff bits (47 + 8 per data byte standard, 67 + 8 extended), so
+ *                           the real load is up to ~20% higher.
+ */
+void UpdateCANBusLoad()
+{
+    g_CANFramesPerSecond = l_CANFramesThisSecond;
+    g_CANBusLoad = l_CANBitsThisSecond / (g_Config.CanBitrate / 1000);
+    l_CANFramesThisSecond = 0;
+    l_CANBitsThisSecond = 0;
 }
+
+/*
+ *      TransmitADCCaptureFrame() - Send the next frame of a completed burst capture (g_ADCCapture) on g_Config.CanCapture_ID.
+ *                                  Called every Timer1 tick while a capture waits to be drained over CAN.  A frame only goes 
+ *                                  out when the capture ring has room, at the lowest priority, so the regular packets are never held up.
+ *                                  Frame 0 is a header:    Bytes 0&1 0xFFFF, 2&3 channels | trigger channel << 8, 
+ *                                                          4&5 pre-trigger rows, 6&7 total rows
+ *                                  Then the samples, 3 per frame: Bytes 0&1 index of the first sample, 2-7 up to 3 samples.
+ *                                  In CAN_ID_J1939 mode the samples go in BAM messages of J1939_CAPTURE_SAMPLES instead (see 
+ *                                  J1939CaptureChunk()).  After the last sample the capture is released (and re-armed if 
+ *                                  configured).
+ */
+void TransmitADCCaptureFrame()
+{
+    unsigned int* frame;
+    unsigned int samples = g_ADCCapture.Length;
+    unsigned int chunk = (g_Config.CanIDMode == CAN_ID_J1939) ? J1939_CAPTURE_SAMPLES : 3;
+    unsigned int index;
+    unsigned int count;
+    unsigned int i;
+
+    if (g_Config.CanIDMode == CAN_ID_J1939)
+    {
+        // One BAM message at a time, and only with the address claimed.  A last chunk of 3 samples or less is a single frame.
+        if ((g_J1939State != J1939_STATE_CLAIMED) || (l_J1939Transport.Packets != 0))
+        {
+            return;
+        }
+        if (g_ADCCapture.DrainFrame != 0)
+        {
+            index = (g_ADCCapture.DrainFrame - 1) * chunk;
+            if (index >= samples)
+            {
+                ADCCaptureRelease();
+                return;
+            }
+            count = samples - index;
+            if (count > 3)
+            {
+                l_J1939CaptureStart = index;
+                J1939BAMStart(g_Config.J1939PGN + J1939_PGN_CAPTURE, 2 + (((count > chunk) ? chunk : count) * 2), J1939CaptureByte);
+                g_ADCCapture.DrainFrame++;
+                return;
+            }
+        }
+    }
+
+    frame = ECANTransmitTryReserve(ECAN_TX_CLASS_CAPTURE);
+    if (frame == NULL)
+    {
+        return;
+    }
+
+    if (g_ADCCapture.DrainFrame == 0)
+    {
+        CANFrameHeader(frame, g_Config.CanCapture_ID, J1939_PGN_CAPTURE, 8);
+        frame[3] = 0xFFFF;
+        frame[4] = g_ADCCapture.Channels | (g_ADCCapture.TriggerChannel << 8);
+        frame[5] = g_ADCCapture.PreTriggerRows;
+        frame[6] = g_ADCCapture.Rows;
+    }
+    else
+    {
+        index = (g_ADCCapture.DrainFrame - 1) * chunk;
+        frame[3] = index;
+        for (i=0; (i<3) && (index<samples); i++, index++)
+        {
+            frame[4+i] = ADCCaptureSample(index);
+        }
+        CANFrameHeader(frame, g_Config.CanCapture_ID, J1939_PGN_CAPTURE, 2 + (i * 2));     // Short last frame
+    }
+    ECANTransmitCommit(ECAN_TX_CLASS_CAPTURE);
+    g_ADCCapture.DrainFrame++;
+    if (((g_ADCCapture.DrainFrame - 1) * chunk) >= samples)
+    {
+        ADCCaptureRelease();
+    }
+}
+
+void TransmitECANStartupFrame()
+{
+    unsigned int* frame;
+
+    // A J1939 node announces itself by claiming its address instead.
+    if (g_Config.CanIDMode == CAN_ID_J1939)
+    {
+        J1939StartAddressClaim();
+        return;
+    }
+
+    frame = ECANTransmitReserve(ECAN_TX_CLASS_STATUS);
+    if (frame == NULL)
+    {
+        return;
+    }
+    frame[0] = (g_Config.CanStartup_ID & 0x000007FF) << 2 ; // Simple SID
+    frame[1] = 0;                                                  // No EID
+    frame[2] = 8;                                                  // 8 bytes of data
+    frame[3] = g_Config.CanStartup_SerialNumber;                   // Bytes 0 & 1  
+    frame[4] = 0xAABB;                                             // Bytes 2 & 3
+    frame[5] = 0xCCDD;                                             // Bytes 4 & 5
+    frame[6] = 0xEEFF;                                             // Bytes 6 & 7
+    ECANTransmitCommit(ECAN_TX_CLASS_STATUS);
+}
+
+/*
+ *      ECANTransmitBuffer() -  The transmit buffer a frame of 'txclass' can go into now, or ECAN1_TX_BUFFERS if none.  The ECAN
+ *                              module sends the highest priority first and, within a priority, the highest buffer number, so
+ *                              a class's frames only go into a buffer below all of its frames still waiting (or reserved) in
+ *                              the buffers.  That keeps each class in order.
+ */
+static unsigned int ECANTransmitBuffer(unsigned int txclass)
+{
+    unsigned int buffernumber;
+    unsigned int lowest = ECAN1_TX_BUFFERS;
+
+    for (buffernumber=0; buffernumber<ECAN1_TX_BUFFERS; buffernumber++)
+    {
+        if (((ECAN_TXCON(buffernumber) & ECAN_TXREQ) || (l_ECANTxReserved & (1 << buffernumber))) &&
+            (l_ECANTxClass[buffernumber] == txclass))
+        {
+            lowest = buffernumber;
+            break;
+        }
+    }
+    buffernumber = lowest;
+    while (buffernumber != 0)
+    {
+        buffernumber--;
+        if (((ECAN_TXCON(buffernumber) & ECAN_TXREQ) == 0) && ((l_ECANTxReserved & (1 << buffernumber)) == 0))
+        {
+            return buffernumber;
+        }
+    }
+    return ECAN1_TX_BUFFERS;
+}
+
+/*
+ *      ECANTransmitLoad() - Start a frame that is in place in a transmit buffer: bus load accounting, the class's priority and
+ *                           TXREQ.
+ */
+static void ECANTransmitLoad(unsigned int buffernumber, unsigned int txclass)
+{
+    g_ECANFrameTime[buffernumber] = ReadTimebase();
+    l_ECANTxClass[buffernumber] = txclass;
+
+    // Bus load accounting (see UpdateCANBusLoad()).  Word 0 bit 0 is IDE (extended ID).
+    l_CANFramesThisSecond++;
+    l_CANBitsThisSecond += ((ecan1msgBuf[buffernumber][0] & 0x0001) ? 67 : 47) + ((ecan1msgBuf[buffernumber][2] & 0x000F) * 8);
+
+    // The buffer is idle, so its whole control byte is written at once: enable, the class's priority and TXREQ.
+    ECAN_TXCON(buffernumber) = ECAN_TXEN | ECAN_TXREQ | l_ECANTxPriority[txclass];
+}
+
+/*
+ *      ECANTransmitReserve() - Reserve room for one CAN frame of a class (ECAN_TX_CLASS_xxx) and return a pointer to its 7 words
+ *                              (SID, EID, DLC, 4 data words) for the caller to fill in, then ECANTransmitCommit().  When the 
+ *                              class has nothing queued and a transmit buffer is free, the frame is built in place in the DMA
+ *                              buffer.  Otherwise it goes into the class's RAM ring, and ECANTransmitRefill() copies it to a 
+ *                              buffer as they complete.  This never waits: when the ring is full the class's policy drops 
+ *                              either its oldest frame (the new one supersedes it) or the new one, and then NULL is returned.
+ *                              Each class can have one reservation at a time.  A NULL return, or an oldest frame dropped,
+ *                              counts in g_ECANTransmitTimout.
+ */
+unsigned int* ECANTransmitReserve(unsigned int txclass)
+{
+    return ECANTransmitReserveFrame(txclass, &g_ECANTransmitTimout);
+}
+
+/*
+ *      ECANTransmitTryReserve() -  ECANTransmitReserve() for a sender that keeps its frame and tries again later when NULL is
+ *                                  returned, so that counts in g_ECANTransmitBusy instead of as a dropped frame.
+ */
+unsigned int* ECANTransmitTryReserve(unsigned int txclass)
+{
+    return ECANTransmitReserveFrame(txclass, &g_ECANTransmitBusy);
+}
+
+/*
+ *      ECANTransmitReserveFrame() - ECANTransmitReserve() and ECANTransmitTryReserve(), counting a refused reservation in
+ *                                   'refused'.
+ */
+static unsigned int* ECANTransmitReserveFrame(unsigned int txclass, unsigned int* refused)
+{
+    st_ECANTxQueue* queue = &l_ECANTxQueue[txclass];
+    unsigned int* frame = NULL;
+    unsigned int buffernumber;
+    unsigned int interruptenabled, timerenabled;
+
+    // The ECAN interrupt refills the buffers from the same rings, and the Timer1 interrupt sends as well when this is called 
+    // from the main loop (the command replies).
+    interruptenabled = IEC2bits.C1IE;
+    timerenabled = IEC0bits.T1IE;
+    IEC2bits.C1IE = 0;
+    IEC0bits.T1IE = 0;
+
+    g_ECANTransmitTried++;
+    if (l_ECANTxReservation[txclass] != ECAN_TX_RESERVED_NONE)
+    {
+        (*refused)++;
+    }
+    else if ((queue->Count == 0) && ((buffernumber = ECANTransmitBuffer(txclass)) < ECAN1_TX_BUFFERS))
+    {
+        l_ECANTxReserved |= (1 << buffernumber);
+        l_ECANTxClass[buffernumber] = txclass;
+        l_ECANTxReservation[txclass] = buffernumber;
+        frame = (unsigned int*)ecan1msgBuf[buffernumber];
+    }
+    else
+    {
+        if (queue->Count == ECAN_TX_QUEUE_LENGTH)
+        {
+            if (l_ECANTxPolicy[txclass] == ECAN_TX_DROP_OLDEST)
+            {
+                g_ECANTransmitTimout++;
+                queue->Head = (queue->Head + 1) % ECAN_TX_QUEUE_LENGTH;
+                queue->Count--;
+            }
+            else
+            {
+                (*refused)++;
+            }
+        }
+        if (queue->Count < ECAN_TX_QUEUE_LENGTH)
+        {
+            l_ECANTxReservation[txclass] = ECAN_TX_RESERVED_QUEUE;
+            frame = queue->Frames[(queue->Head + queue->Count) % ECAN_TX_QUEUE_LENGTH];
+        }
+    }
+
+    IEC0bits.T1IE = timerenabled;
+    IEC2bits.C1IE = interruptenabled;
+    return frame;
+}
+
+/*
+ *      ECANTransmitCommit() - Send the frame reserved (and now filled in) by ECANTransmitReserve().
+ */
+void ECANTransmitCommit(unsigned int txclass)
+{
+    unsigned int reservation;
+    unsigned int interruptenabled, timerenabled;
+
+    interruptenabled = IEC2bits.C1IE;
+    timerenabled = IEC0bits.T1IE;
+    IEC2bits.C1IE = 0;
+    IEC0bits.T1IE = 0;
+
+    reservation = l_ECANTxReservation[txclass];
+
+    if (reservation == ECAN_TX_RESERVED_QUEUE)
+    {
+        l_ECANTxQueue[txclass].Count++;
+        ECANTransmitRefill();
+    }
+    else if (reservation != ECAN_TX_RESERVED_NONE)
+    {
+        l_ECANTxReserved &= ~(1 << reservation);
+        ECANTransmitLoad(reservation, txclass);
+    }
+    l_ECANTxReservation[txclass] = ECAN_TX_RESERVED_NONE;
+    l_ECANLastQueued = ReadTimebase();
+
+    IEC0bits.T1IE = timerenabled;
+    IEC2bits.C1IE = interruptenabled;
+}
+
+/*
+ *      ECANTransmitRefill() -  Move queued frames into free transmit buffers, highest priority class first (see 
+ *                              ECANTransmitBuffer() for the order within a class).  Called from ECANTransmitCommit() with the
+ *                              ECAN interrupt held off, and from the ECAN interrupt as buffers complete.
+ */
+void ECANTransmitRefill()
+{
+    st_ECANTxQueue* queue;
+    unsigned int* frame;
+    unsigned int txclass;
+    unsigned int buffernumber;
+
+    for (txclass=0; txclass<ECAN_TX_CLASSES; txclass++)
+    {
+        queue = &l_ECANTxQueue[txclass];
+        while (queue->Count != 0)
+        {
+            buffernumber = ECANTransmitBuffer(txclass);
+            if (buffernumber >= ECAN1_TX_BUFFERS)
+            {
+                break;
+            }
+            frame = queue->Frames[queue->Head];
+            ecan1msgBuf[buffernumber][0] = frame[0];
+            ecan1msgBuf[buffernumber][1] = frame[1];
+            ecan1msgBuf[buffernumber][2] = frame[2];
+            ecan1msgBuf[buffernumber][3] = frame[3];
+            ecan1msgBuf[buffernumber][4] = frame[4];
+            ecan1msgBuf[buffernumber][5] = frame[5];
+            ecan1msgBuf[buffernumber][6] = frame[6];
+            queue->Head = (queue->Head + 1) % ECAN_TX_QUEUE_LENGTH;
+            queue->Count--;
+            ECANTransmitLoad(buffernumber, txclass);
+        }
+    }
+}
+
+/*
+ *      ECANTransmitAbort() - Cancel every frame in the transmit buffers, including a SYNC frame.  The frames still in the rings 
+ *                            go out with the next refill.
+ */
+void ECANTransmitAbort()
+{
+    unsigned int buffernumber;
+
+    for (buffernumber=0; buffernumber<=ECAN1_SYNC_BUFFER; buffernumber++)
+    {
+        ECAN_TXCON(buffernumber) = ECAN_TXCON(buffernumber) & (ECAN_TXEN | ECAN_TXPRI);
+    }
+    g_ECANSyncQueued = false;
+}
+
+/*
+ *      ECANBitTimingValid() -  True if a bit timing is within the limits of the ECAN module and gives 'bitrate' (within 
+ *                              ECAN_BITRATE_TOLERANCE).
+ */
+bool ECANBitTimingValid(const st_CANBitTiming* timing, unsigned long bitrate)
+{
+    unsigned long clocks;
+    unsigned int ntq = 1 + timing->PropSeg + timing->Phase1 + timing->Phase2;
+
+    if ((timing->BRP > ECAN_BRP_MAX) || (ntq < ECAN_TQ_MIN) || (ntq > ECAN_TQ_MAX) ||
+        (timing->PropSeg < 1) || (timing->PropSeg > ECAN_SEGMENT_MAX) || 
+        (timing->Phase1 < 1) || (timing->Phase1 > ECAN_SEGMENT_MAX) ||
+        (timing->Phase2 < ECAN_PHASE2_MIN) || (timing->Phase2 > ECAN_SEGMENT_MAX) || ((timing->PropSeg + timing->Phase1) < timing->Phase2) ||
+        (timing->SJW < 1) || (timing->SJW > ECAN_SJW_MAX) || (timing->SJW > timing->Phase2))
+    {
+        return false;
+    }
+    // FCAN clocks per bit, against FCAN clocks per second.
+    clocks = 2UL * (timing->BRP + 1) * ntq * bitrate;
+    return ((clocks > FCAN) ? (clocks - FCAN) : (FCAN - clocks)) <= ECAN_BITRATE_TOLERANCE;
+}
+
+/*
+ *      ECANBitTiming() -   Solve the bit timing for a bit rate (bits/s) with the sample point nearest 'samplepoint' (% of the
+ *                          bit).  Every prescaler is tried, with the whole number of TQ per bit nearest the bit rate.  Of those 
+ *                          within ECAN_BITRATE_TOLERANCE the closest bit rate wins, then the closest sample point, then the most
+ *                          TQ per bit (the lowest prescaler).  The TQ after the sample point become Phase2 (ECAN_PHASE2_MIN
+ *                          to ECAN_SEGMENT_MAX), those before it Phase1 (up to ECAN_SEGMENT_MAX) and the rest PropSeg, and SJW is
+ *                          as large as Phase2 allows.  Only arithmetic on FCAN, so it can be checked on a PC against the table
+ *                          in ecan.h.  Returns false, leaving 'timing' alone, if no timing gives the bit rate.
+ */
+bool ECANBitTiming(unsigned long bitrate, unsigned int samplepoint, st_CANBitTiming* timing)
+{
+    st_CANBitTiming candidate;
+    unsigned long clocks;
+    unsigned long rateerror;
+    unsigned long bestrateerror = 0xFFFFFFFF;
+    unsigned int bestpointerror = 0xFFFF;
+    unsigned int pointerror;
+    unsigned int brp;
+    unsigned int ntq;
+    unsigned int phase2;
+    unsigned int before;
+
+    if ((bitrate == 0) || (samplepoint > 100))
+    {
+        return false;
+    }
+    for (brp=0; brp<=ECAN_BRP_MAX; brp++)
+    {
+        ntq = (unsigned int)(((FCAN / (2UL * (brp + 1))) + (bitrate / 2)) / bitrate);
+        if ((ntq < ECAN_TQ_MIN) || (ntq > ECAN_TQ_MAX))
+        {
+            continue;
+        }
+        clocks = 2UL * (brp + 1) * ntq * bitrate;
+        rateerror = (clocks > FCAN) ? (clocks - FCAN) : (FCAN - clocks);
+        if (rateerror > ECAN_BITRATE_TOLERANCE)
+        {
+            continue;
+        }
+
+        // The sample point, limited by the segment lengths.  Sync + PropSeg + Phase1 is at most 1 + 2 * ECAN_SEGMENT_MAX TQ
+        // and Phase2 at most ECAN_SEGMENT_MAX, so an early sample point comes out as late as the segments need.
+        phase2 = ntq - ((ntq * samplepoint + 50) / 100);
+        if (phase2 < ECAN_PHASE2_MIN)
+        {
+            phase2 = ECAN_PHASE2_MIN;
+        }
+        if (phase2 + 1 + (2 * ECAN_SEGMENT_MAX) < ntq)
+        {
+            phase2 = ntq - 1 - (2 * ECAN_SEGMENT_MAX);
+        }
+        if (phase2 > ECAN_SEGMENT_MAX)
+        {
+            phase2 = ECAN_SEGMENT_MAX;
+        }
+        before = ntq - 1 - phase2;
+        candidate.BRP = brp;
+        candidate.Phase2 = phase2;
+        candidate.Phase1 = (before - 1 > ECAN_SEGMENT_MAX) ? ECAN_SEGMENT_MAX : before - 1;
+        candidate.PropSeg = before - candidate.Phase1;
+        candidate.SJW = (phase2 > ECAN_SJW_MAX) ? ECAN_SJW_MAX : phase2;
+        if (!ECANBitTimingValid(&candidate, bitrate))
+        {
+            continue;
+        }
+
+        // Sample point error in 0.1% of the bit.
+        pointerror = (unsigned int)((ntq - phase2) * 1000UL / ntq);
+        pointerror = (pointerror > samplepoint * 10) ? (pointerror - samplepoint * 10) : (samplepoint * 10 - pointerror);
+        if ((rateerror < bestrateerror) || ((rateerror == bestrateerror) && (pointerror < bestpointerror)))
+        {
+            bestrateerror = rateerror;
+            bestpointerror = pointerror;
+            *timing = candidate;
+        }
+    }
+    return bestpointerror != 0xFFFF;
+}
+
+/*
+ *      ConfigureECAN1() -   Configure the ECAN1 module for tranmission use.
+ *                              
+ */
+void ConfigureECAN1()
+{
+    unsigned int buffernumber;
+
+    // The CAN messages are compiled from the configuration just loaded.
+    CompileCANMessages();
+    for (buffernumber=0; buffernumber<CAN_MESSAGE_COUNT; buffernumber++)
+    {
+        l_CANPacketAge[buffernumber] = 0;
+        l_CANPacketChanged[buffernumber] = false;
+    }
+
+    // Put CAN Module in Configuration mode and wait for it to get there.
+    C1CTRL1bits.REQOP=4;
+    while (C1CTRL1bits.OPMODE!=4);
+
+    // Setup ECAN Timing Bits
+
+    // The timing in the configuration is used as is when it is valid for CanBitrate, so a hand tuned timing is kept.  Otherwise
+    // (the bit rate was changed, or the timing is damaged) it is solved again, and if CanBitrate cannot be solved the default 
+    // 1Mbit/s is used.
+    if (!ECANBitTimingValid(&g_Config.CanTiming, g_Config.CanBitrate) &&
+        !ECANBitTiming(g_Config.CanBitrate, g_Config.CanSamplePoint, &g_Config.CanTiming))
+    {
+        g_Config.CanBitrate = CAN_BITRATE;
+        ECANBitTiming(g_Config.CanBitrate, 70, &g_Config.CanTiming);
+    }
+
+    // Baud Rate Prescaler.  This determines the time quantum, TQ = 2 * (BRP + 1) / FCAN.
+    C1CFG1bits.BRP = g_Config.CanTiming.BRP;
+
+    // Synronization Jump Width
+    C1CFG1bits.SJW = g_Config.CanTiming.SJW - 1;
+    // Phase 1 Segment Time
+    C1CFG2bits.SEG1PH = g_Config.CanTiming.Phase1 - 1;
+    // Allow Phase 2 Segment time to be programmable. 
+    C1CFG2bits.SEG2PHTS = 0x1;
+    // and then set the Phase 2 Segment Time
+    C1CFG2bits.SEG2PH = g_Config.CanTiming.Phase2 - 1;
+    // Propegation Segment time
+    C1CFG2bits.PRSEG = g_Config.CanTiming.PropSeg - 1;
+    // Bus is sampled 3 times (based on datasheet)
+    C1CFG2bits.SAM = 0x1;
+
+    // Configure the size of the DMA buffer ( in number of messages).  Only the first 8 messages in the DMA buffer can be used for
+    // transmit, so we will only support 4 or 8 message buffers.
+    if ( ECAN1_MSG_BUF_LENGTH == 4)
+    {
+        C1FCTRLbits.DMABS = 0b000;   //  On a 24H this means the DMA buffer is 4 messages wide (8 words for each message)
+    }
+    else if (ECAN1_MSG_BUF_LENGTH == 8)
+    {
+        C1FCTRLbits.DMABS = 0b010;   //  On a 24H this means the DMA buffer is 8 messages wide (8 words for each message)
+    }
+    else if (ECAN1_MSG_BUF_LENGTH == 16)
+    {
+        C1FCTRLbits.DMABS = 0b100;   //  16 messages, the buffers past the first 8 can only receive.
+    }
+    // The receive FIFO runs from ECAN1_RX_FIFO_START to the end of the DMA buffer.
+    C1FCTRLbits.FSA = ECAN1_RX_FIFO_START;
+
+    // Receive filter 0 accepts the SYNC frame (standard ID CanSync_ID, all 11 bits compared by mask 0), filter 1 this 
+    // node's commands (CanCommand_ID), filters 2-4 remote requests for the CAN messages, and in CAN_ID_J1939 mode filters 5 
+    // and 6 (mask 1 compares only the PDU format) J1939 address claims and requests, and filter 7 ISO-TP frames (PDU format 
+    // 0xDA), into the FIFO.  Everything else is ignored by the hardware.  The filter registers are in the second register
+    // window and are only set here.  So CanSync_ID and CanCommand_ID can't be changed while running (ECANConfigKeeps()), and
+    // a message whose ID is changed with CAN_COMMAND_SET_CONFIG can't be polled by remote request until the board restarts.
+    C1CTRL1bits.WIN = 1;
+    C1RXF0SIDbits.SID = g_Config.CanSync_ID;
+    C1RXF0SIDbits.EXIDE = 0;
+    C1RXF1SIDbits.SID = g_Config.CanCommand_ID;
+    C1RXF1SIDbits.EXIDE = 0;
+    C1RXF2SIDbits.SID = g_Config.CanMessages[0].ID;
+    C1RXF2SIDbits.EXIDE = 0;
+    C1RXF3SIDbits.SID = g_Config.CanMessages[1].ID;
+    C1RXF3SIDbits.EXIDE = 0;
+    C1RXF4SIDbits.SID = g_Config.CanMessages[2].ID;
+    C1RXF4SIDbits.EXIDE = 0;
+    C1RXM0SIDbits.SID = 0x7FF;
+    C1RXM0SIDbits.MIDE = 1;
+    C1RXF5SIDbits.SID = (J1939_PGN_ADDRESS_CLAIM >> 10) & 0x07FF;
+    C1RXF5SIDbits.EID = (J1939_PGN_ADDRESS_CLAIM >> 8) & 0x0003;
+    C1RXF5SIDbits.EXIDE = 1;
+    C1RXF5EID = 0;
+    C1RXF6SIDbits.SID = (J1939_PGN_REQUEST >> 10) & 0x07FF;
+    C1RXF6SIDbits.EID = (J1939_PGN_REQUEST >> 8) & 0x0003;
+    C1RXF6SIDbits.EXIDE = 1;
+    C1RXF6EID = 0;
+    C1RXF7SIDbits.SID = (ISOTP_PGN >> 10) & 0x07FF;
+    C1RXF7SIDbits.EID = (ISOTP_PGN >> 8) & 0x0003;
+    C1RXF7SIDbits.EXIDE = 1;
+    C1RXF7EID = 0;
+    C1RXM1SIDbits.SID = 0x003F;                 // ID bits 23-18 ...
+    C1RXM1SIDbits.EID = 0x0003;                 // ... and 17-16: the PDU format
+    C1RXM1SIDbits.MIDE = 1;
+    C1RXM1EID = 0;
+    C1FMSKSEL1bits.F0MSK = 0;
+    C1FMSKSEL1bits.F1MSK = 0;
+    C1FMSKSEL1bits.F2MSK = 0;
+    C1FMSKSEL1bits.F3MSK = 0;
+    C1FMSKSEL1bits.F4MSK = 0;
+    C1FMSKSEL1bits.F5MSK = 1;
+    C1FMSKSEL1bits.F6MSK = 1;
+    C1FMSKSEL1bits.F7MSK = 1;
+    C1BUFPNT1bits.F0BP = 0xF;
+    C1BUFPNT1bits.F1BP = 0xF;
+    C1BUFPNT1bits.F2BP = 0xF;
+    C1BUFPNT1bits.F3BP = 0xF;
+    C1BUFPNT2bits.F4BP = 0xF;
+    C1BUFPNT2bits.F5BP = 0xF;
+    C1BUFPNT2bits.F6BP = 0xF;
+    C1BUFPNT2bits.F7BP = 0xF;
+    C1CTRL1bits.WIN = 0;
+    C1FEN1bits.FLTEN0 = 1;
+    C1FEN1bits.FLTEN1 = 1;
+    C1FEN1bits.FLTEN2 = (g_Config.CanMessages[0].Length != 0);
+    C1FEN1bits.FLTEN3 = (g_Config.CanMessages[1].Length != 0);
+    C1FEN1bits.FLTEN4 = (g_Config.CanMessages[2].Length != 0);
+    C1FEN1bits.FLTEN5 = (g_Config.CanIDMode == CAN_ID_J1939);
+    C1FEN1bits.FLTEN6 = (g_Config.CanIDMode == CAN_ID_J1939);
+    C1FEN1bits.FLTEN7 = 1;
+
+    // Switch to Normal Operation mode.  This will loop and wait for the module to get ready.
+    C1CTRL1bits.REQOP = 0;
+    while (C1CTRL1bits.OPMODE!= 0);
+
+    // Configure Buffers 0 to ECAN1_TX_BUFFERS-1 as the transmit queue's buffers.  Their priority is set with each frame
+    // (see ECANTransmitRefill()).
+
+    for (buffernumber=0; buffernumber<ECAN1_TX_BUFFERS; buffernumber++)
+    {
+        ECAN_TXCON(buffernumber) = ECAN_TXEN;
+    }
+    for (buffernumber=0; buffernumber<ECAN_TX_CLASSES; buffernumber++)
+    {
+        l_ECANTxQueue[buffernumber].Head = 0;
+        l_ECANTxQueue[buffernumber].Count = 0;
+    }
+
+    // Configure Buffer 7 as the SYNC frame transmit buffer, at the highest priority.
+    ECAN_TXCON(ECAN1_SYNC_BUFFER) = ECAN_TXEN | ECAN_TXPRI;
+
+    // Configure the DMA Channel 0
+
+    DMACS0 = 0;
+    
+    // DMA0CON - Disable Channel, Word Transfer Size, Direct to Peripheral from RAM, Interrupt on full transfer, 
+    //           Normal Operation, Peripheral Indirect Addressing, Continuous no Ping-Pong
+    DMA0CON = 0x2020;
+    
+    // DMA0PAD - This is set to the address of the ECAN module from the datasheet.  0x0442 is the Transmit ECAN Address (C1TXD))
+    DMA0PAD = 0x0442;
+    
+    // DMA0CNT - Number of words to transfer (+1 is added to this number).   ECAN needs needs 6 words for a standard message
+    // Note that while the 'message' in the DMA buffer is 8 words long, the CAN module will only request 6 words over DMA for a simple 
+    // message.  If this number is configured incorrectly the only fault is the DMA interrupts will not occur at the correct interval.
+    // Effectivly this number is just used to count DMA transfers for the purpose of firing the DMA interrupt on completion.
+    DMA0CNT = 5;
+    
+    // DMA0REQ - Automatic DMA by Request, DMA Request from ' ECAN1 TX Data Request '
+    DMA0REQ = 0x0046;
+    
+    // DMA0STA - Set to the address of the DMA buffer
+    DMA0STA = __builtin_dmaoffset(&ecan1msgBuf);
+    
+    // Enable the DMA Channel now (which means as soon as the ECAN is triggered, it will start a DMA transfer)
+    DMA0CONbits.CHEN = 1;
+
+    // Configure the DMA Channel 2 for reception
+
+    DMACS0 = 0;
+
+    // DMA2CON - Word Transfer Size, Peripheral to RAM, Interrupt on full transfer, Peripheral Indirect Addressing, Continuous 
+    //           no Ping-Pong.  The ECAN module supplies the buffer number, so received frames land in the FIFO buffers.
+    DMA2CON = 0x0020;
+
+    // DMA2PAD - 0x0440 is the Receive ECAN Address (C1RXD)
+    DMA2PAD = 0x0440;
+
+    // DMA2CNT - A received message is 8 words (+1 is added to this number)
+    DMA2CNT = 7;
+
+    // DMA2REQ - Automatic DMA by Request, DMA Request from ' ECAN1 RX Data Ready '
+    DMA2REQ = 0x0022;
+
+    DMA2STA = __builtin_dmaoffset(&ecan1msgBuf);
+    DMA2CONbits.CHEN = 1;
+
+    // Enable ECAN1 Interrupts, and enable transmit interrupt.  This will turn on the ECAN1 interrupt, and configure that interrupt
+    // to occur for either transmission completion, or error.
+    IEC2bits.C1IE = 1;
+    C1INTEbits.TBIE = 1;
+    C1INTEbits.RBIE = 1;
+    C1INTEbits.ERRIE = 1;
+
+    // Enable the DMA Channel 0 completion interrupt.  This interrupt will fire at the completion of each DMA transfer.  This is being used
+    // for debugging and statistics purposes only.  In production we will probably turn this off.
+    IEC0bits.DMA0IE = 1;
+    
+    // Clear the full and overflow flags.
+    C1RXFUL1=C1RXFUL2=C1RXOVF1=C1RXOVF2=0x0000;
+
+    // ECAN1 is ready for transmission.  To send, set TXREQ flag for corresponding buffer.   ECAN Interrupt will confirm message transmission.
+    
+
+}
+
+/*
+ *      TransmitSyncFrame() -   SYNC frame on CanSync_ID (SYNC_MASTER, see SyncTick()).  It goes out of its own transmit buffer
+ *                              so the regular frames never delay it, and the ECAN interrupt records the TMR1 phase at which it 
+ *                              completed.  That phase is only known afterwards, so each frame carries the phase of the previous
+ *                              one:
+ *                                  Byte 0 sequence number
+ *                                  Byte 1 0
+ *                                  Bytes 2&3 TMR1 when the previous SYNC frame completed (SYNC_PHASE_INVALID if unknown)
+ *                              If the previous frame has still not gone out this one is skipped.
+ */
+void TransmitSyncFrame(unsigned int sequence, unsigned int phase)
+{
+    if (ECAN_TXCON(ECAN1_SYNC_BUFFER) & ECAN_TXREQ)
+    {
+        g_ECANTransmitTimout++;
+        return;
+    }
+    ecan1msgBuf[ECAN1_SYNC_BUFFER][0] = (g_Config.CanSync_ID & 0x000007FF) << 2 ; // Simple SID
+    ecan1msgBuf[ECAN1_SYNC_BUFFER][1] = 0;                                  // No EID
+    ecan1msgBuf[ECAN1_SYNC_BUFFER][2] = 4;                                  // 4 bytes of data
+    ecan1msgBuf[ECAN1_SYNC_BUFFER][3] = sequence & 0x00FF;                  // Bytes 0 & 1
+    ecan1msgBuf[ECAN1_SYNC_BUFFER][4] = phase;                              // Bytes 2 & 3
+    g_ECANFrameTime[ECAN1_SYNC_BUFFER] = ReadTimebase();
+    l_CANFramesThisSecond++;
+    l_CANBitsThisSecond += 47 + (4 * 8);
+    g_ECANSyncQueued = true;
+    // The buffer is idle, so its whole control byte is written, as in ECANTransmitLoad().
+    ECAN_TXCON(ECAN1_SYNC_BUFFER) = ECAN_TXEN | ECAN_TXREQ | ECAN_TXPRI;
+}
+
+/*
+ *      ECANCommandPut() -  Copy a received command out of its receive buffer for ProcessECANCommands().  If the main loop has
+ *                          fallen behind by ECAN_COMMAND_QUEUE_LENGTH commands the new one is lost (and counted).
+ */
+static void ECANCommandPut(unsigned int buffernumber)
+{
+    unsigned int next = (l_ECANCommandHead + 1) % ECAN_COMMAND_QUEUE_LENGTH;
+    unsigned int* command;
+
+    if (next == l_ECANCommandTail)
+    {
+        g_ECANCommandsLost++;
+        return;
+    }
+    command = l_ECANCommand[l_ECANCommandHead];
+    command[0] = ecan1msgBuf[buffernumber][2] & 0x000F;
+    command[1] = ecan1msgBuf[buffernumber][3];
+    command[2] = ecan1msgBuf[buffernumber][4];
+    command[3] = ecan1msgBuf[buffernumber][5];
+    command[4] = ecan1msgBuf[buffernumber][6];
+    l_ECANCommandHead = next;
+}
+
+/*
+ *      ReceiveECANFrames() -   Called from the ECAN interrupt when the receive FIFO has frames, with TMR1 as read on entry to 
+ *                              the interrupt.  Each full buffer is handed on by its standard ID and then released.  Remote
+ *                              frames are poll requests for the message with that ID.
+ */
+void ReceiveECANFrames(unsigned int phase)
+{
+    unsigned int buffernumber;
+    unsigned int sid;
+    unsigned int message;
+    unsigned long received = ReadTimebase();
+
+    buffernumber = C1FIFObits.FNRB;
+    while (C1RXFUL1 & (1 << buffernumber))
+    {
+        sid = (ecan1msgBuf[buffernumber][0] >> 2) & 0x07FF;
+        if (ecan1msgBuf[buffernumber][0] & 0x0001)
+        {
+            // IDE: J1939 network management (filters 5 and 6 are only on in CAN_ID_J1939 mode).
+            J1939Received(buffernumber);
+        }
+        else if (ecan1msgBuf[buffernumber][0] & 0x0002)
+        {
+            // SRR set in a standard frame: remote transmission request on a message's configured 11 bit ID (filters 2-4), 
+            // also in CAN_ID_J1939 mode where the program's header holds the 29 bit ID instead.
+            for (message=0; message<CAN_MESSAGE_COUNT; message++)
+            {
+                if ((l_CANMessageProgram[message].DLC != 0) && ((g_Config.CanMessages[message].ID & 0x07FF) == sid))
+                {
+                    CANPollRequest(1 << message, received);
+                }
+            }
+        }
+        else if ((sid == g_Config.CanSync_ID) && ((ecan1msgBuf[buffernumber][2] & 0x000F) >= 4))
+        {
+            SyncReceived(ecan1msgBuf[buffernumber][3] & 0x00FF, ecan1msgBuf[buffernumber][4], phase);
+        }
+        else if (sid == g_Config.CanCommand_ID)
+        {
+            // Polls are taken here rather than waiting for the console loop.
+            if (((ecan1msgBuf[buffernumber][2] & 0x000F) >= 2) && ((ecan1msgBuf[buffernumber][3] & 0x00FF) == CAN_COMMAND_POLL))
+            {
+                CANPollRequest(ecan1msgBuf[buffernumber][3] >> 8, received);
+            }
+            else
+            {
+                ECANCommandPut(buffernumber);
+            }
+        }
+        // Software can only clear the RXFUL bits, writing a 1 leaves one as it is.  So only this buffer's bit is written 
+        // as 0, without a read-modify-write that could clear the bit of a buffer the module has filled in the meantime.
+        C1RXFUL1 = ~(1 << buffernumber);
+        buffernumber = C1FIFObits.FNRB;
+    }
+}
+
+/*
+ *      ECANCommandReply() - Send the reply to a command on CanCommand_ID + CAN_COMMAND_REPLY_OFFSET:
+ *                              Byte 0 command | 0x80, byte 1 result (CAN_RESULT_xxx), bytes 2&3 the command's bytes 2&3,
+ *                              bytes 4-7 data
+ */
+static void ECANCommandReply(unsigned int command, unsigned int result, unsigned int argument, unsigned int data0, unsigned int data1)
+{
+    unsigned int* frame;
+
+    // The Timer1 interrupt sends on the status class too (heartbeat, address claim, ISO-TP flow control), so it is held off
+    // while the reply holds the class's reservation.
+    IEC0bits.T1IE = 0;
+    frame = ECANTransmitReserve(ECAN_TX_CLASS_STATUS);
+    if (frame == NULL)
+    {
+        IEC0bits.T1IE = 1;
+        return;
+    }
+    frame[0] = ((g_Config.CanCommand_ID + CAN_COMMAND_REPLY_OFFSET) & 0x000007FF) << 2 ; // Simple SID
+    frame[1] = 0;                                                   // No EID
+    frame[2] = 8;                                                   // 8 bytes of data
+    frame[3] = (command | 0x80) | (result << 8);                    // Bytes 0 & 1
+    frame[4] = argument;                                            // Bytes 2 & 3
+    frame[5] = data0;                                               // Bytes 4 & 5
+    frame[6] = data1;                                               // Bytes 6 & 7
+    ECANTransmitCommit(ECAN_TX_CLASS_STATUS);
+    IEC0bits.T1IE = 1;
+}
+
+/*
+ *      ECANConfigKeeps() - Whether writing 'count' bytes at byte 'offset' of g_Config leaves alone the settings that are only 
+ *                          taken at startup: CanIDMode (the receive filters and the J1939 address claim), and CanSync_ID and
+ *                          CanCommand_ID (receive filters 0 and 1).  ReceiveECANFrames() compares against g_Config, so a new 
+ *                          command ID would pass the filter under neither ID and leave the node deaf to every command, 
+ *                          SAVE_CONFIG and REBOOT included, until a power cycle.
+ */
+static bool ECANConfigKeeps(const uint8_t* bytes, unsigned int offset, unsigned int count)
+{
+    const uint8_t* config = (const uint8_t*)&g_Config;
+    const unsigned int fixed[3][2] = {
+        {&g_Config.CanIDMode - config, sizeof(g_Config.CanIDMode)},
+        {(const uint8_t*)&g_Config.CanSync_ID - config, sizeof(g_Config.CanSync_ID)},
+        {(const uint8_t*)&g_Config.CanCommand_ID - config, sizeof(g_Config.CanCommand_ID)}};
+    unsigned int setting;
+    unsigned int i;
+
+    for (setting=0; setting<3; setting++)
+    {
+        for (i=fixed[setting][0]; i<(fixed[setting][0] + fixed[setting][1]); i++)
+        {
+            if ((i >= offset) && (i < (offset + count)) && (bytes[i - offset] != config[i]))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ *      ProcessECANCommands() - Carry out the commands received on CanCommand_ID (see ecan.h for the protocol).  Called from the 
+ *                              console loop, so the slow ones (saving the configuration, rebooting) never run in an interrupt.
+ *                              Anything the Timer1 interrupt is using is changed with that interrupt held off.
+ */
+void ProcessECANCommands()
+{
+    unsigned int* command;
+    unsigned int code, count, argument;
+    unsigned int result;
+    unsigned int data[2];
+    uint8_t* config = (uint8_t*)&g_Config;
+    unsigned int i;
+
+    while (l_ECANCommandTail != l_ECANCommandHead)
+    {
+        command = l_ECANCommand[l_ECANCommandTail];
+        code = command[1] & 0x00FF;
+        count = command[1] >> 8;
+        argument = command[2];
+        data[0] = command[3];
+        data[1] = command[4];
+        result = CAN_RESULT_OK;
+
+        switch (code)
+        {
+            case CAN_COMMAND_GET_CONFIG:
+                if ((count == 0) || (count > 4) || ((argument + count) > sizeof(st_CAL)))
+                {
+                    result = CAN_RESULT_BAD_ARGUMENT;
+                    break;
+                }
+                data[0] = data[1] = 0;
+                for (i=0; i<count; i++)
+                {
+                    ((uint8_t*)data)[i] = config[argument + i];
+                }
+                break;
+
+            case CAN_COMMAND_SET_CONFIG:
+                // The version byte at offset 0 is not settable, and the frame has to carry all the bytes.
+                if ((count == 0) || (count > 4) || (argument == 0) || ((argument + count) > sizeof(st_CAL)) || 
+                    (command[0] < (4 + count)))
+                {
+                    result = CAN_RESULT_BAD_ARGUMENT;
+                    break;
+                }
+                if (!ECANConfigKeeps((uint8_t*)data, argument, count))
+                {
+                    result = CAN_RESULT_BAD_ARGUMENT;
+                    break;
+                }
+                IEC0bits.T1IE = 0;
+                for (i=0; i<count; i++)
+                {
+                    config[argument + i] = ((uint8_t*)data)[i];
+                }
+                CompileCANMessages();
+                IEC0bits.T1IE = 1;
+                break;
+
+            case CAN_COMMAND_SAVE_CONFIG:
+                if (!WriteConfig(&g_Config))
+                {
+                    result = CAN_RESULT_FAILED;
+                }
+                break;
+
+            case CAN_COMMAND_CAPTURE:
+                // An idle capture is armed from the configuration with a manual trigger, then triggered.  One already
+                // triggered or waiting to be drained is left alone and the command fails.
+                IEC0bits.T1IE = 0;
+                if (((g_ADCCapture.State != ADC_CAPTURE_IDLE) && (g_ADCCapture.State != ADC_CAPTURE_ARMED)) ||
+                    ((g_ADCCapture.State == ADC_CAPTURE_IDLE) &&
+                     !ADCCaptureArm(g_Config.CaptureChannels, g_Config.CaptureTriggerChannel, ADC_TRIGGER_MANUAL, 
+                                    g_Config.CaptureTriggerLevel, g_Config.CapturePreTrigger, g_Config.CaptureLength, 
+                                    g_Config.CaptureDrain)))
+                {
+                    result = CAN_RESULT_FAILED;
+                }
+                else
+                {
+                    ADCCaptureForce();
+                }
+                IEC0bits.T1IE = 1;
+                break;
+
+            case CAN_COMMAND_SET_RATE:
+                // Byte 1 channels (bit per channel), byte 2 ADC_RATE_xxx.  The decimators only change in ADC_FILTER_CIC mode, 
+                // otherwise the rate is kept for when the configuration is saved and the board restarted in that mode.
+                if ((argument & 0x00FF) >= ADC_RATE_COUNT)
+                {
+                    result = CAN_RESULT_BAD_ARGUMENT;
+                    break;
+                }
+                IEC0bits.T1IE = 0;
+                for (i=0; i<8; i++)
+                {
+                    if (count & (1 << i))
+                    {
+                        g_Config.ChannelRate[i] = argument & 0x00FF;
+                        if (g_ADCFilterMode == ADC_FILTER_CIC)
+                        {
+                            ADCCICInit(i, argument & 0x00FF);
+                        }
+                    }
+                }
+                IEC0bits.T1IE = 1;
+                break;
+
+            case CAN_COMMAND_SET_BITRATE:
+                // Bytes 4-7 bit rate, byte 1 sample point.  Only the configuration changes, the bus keeps its rate until 
+                // the board restarts.
+                if (command[0] < 8)
+                {
+                    result = CAN_RESULT_BAD_ARGUMENT;
+                    break;
+                }
+                if (!ECANBitTiming(((unsigned long)data[1] << 16) | data[0], count, &g_Config.CanTiming))
+                {
+                    result = CAN_RESULT_BAD_ARGUMENT;
+                    break;
+                }
+                g_Config.CanBitrate = ((unsigned long)data[1] << 16) | data[0];
+                g_Config.CanSamplePoint = count;
+                argument = g_Config.CanTiming.SJW;
+                data[0] = g_Config.CanTiming.BRP | (g_Config.CanTiming.PropSeg << 8);
+                data[1] = g_Config.CanTiming.Phase1 | (g_Config.CanTiming.Phase2 << 8);
+                break;
+
+            case CAN_COMMAND_REBOOT:
+                // Bytes 2&3 have to be this board's serial number.
+                if (argument != g_Config.CanStartup_SerialNumber)
+                {
+                    result = CAN_RESULT_BAD_ARGUMENT;
+                    break;
+                }
+                ECANCommandReply(code, result, argument, 0, 0);
+                DelaymS(10);
+                SystemReset();
+                break;
+
+            default:
+                result = CAN_RESULT_UNKNOWN;
+                break;
+        }
+        if (((code != CAN_COMMAND_GET_CONFIG) && (code != CAN_COMMAND_SET_BITRATE)) || (result != CAN_RESULT_OK))
+        {
+            data[0] = data[1] = 0;
+        }
+        ECANCommandReply(code, result, argument, data[0], data[1]);
+        l_ECANCommandTail = (l_ECANCommandTail + 1) % ECAN_COMMAND_QUEUE_LENGTH;
+    }
+}
+
+/*
+ *      J1939StartAddressClaim() -  Build this node's NAME and claim the preferred address (g_Config.J1939Address).  Called once
+ *                                  at startup in place of the startup frame.  The NAME is, LSB first:
+ *                                      Bits 0-20 identity number (serial number), 21-31 manufacturer code, 32-39 ECU and 
+ *                                      function instance (0), 40-47 function, 48-59 vehicle system (0), 60-62 industry group,
+ *                                      63 arbitrary address capable (1)
+ */
+static void J1939StartAddressClaim()
+{
+    l_J1939Name[0] = g_Config.CanStartup_SerialNumber;
+    l_J1939Name[1] = (J1939_NAME_MANUFACTURER << 5) & 0xFFE0;
+    l_J1939Name[2] = J1939_NAME_FUNCTION << 8;
+    l_J1939Name[3] = 0x8000 | ((J1939_NAME_INDUSTRY & 0x07) << 12);
+
+    g_J1939Address = g_Config.J1939Address;
+    l_J1939AddressesTried = 0;
+    l_J1939ClaimWait = J1939_CLAIM_TIME;
+    l_J1939ClaimPending = true;
+    g_J1939State = J1939_STATE_CLAIMING;
+    CompileCANMessages();
+}
+
+/*
+ *      J1939TransmitClaim() -  Send Address Claimed (our NAME from g_J1939Address) or, once every address is lost, Cannot Claim 
+ *                              (the same from the null address).  Returns false if the status queue had no room.
+ */
+static bool J1939TransmitClaim()
+{
+    unsigned int* frame = ECANTransmitTryReserve(ECAN_TX_CLASS_STATUS);
+
+    if (frame == NULL)
+    {
+        return false;
+    }
+    J1939FrameHeader(frame, 6, J1939_PGN_ADDRESS_CLAIM | J1939_GLOBAL_ADDRESS, 8);
+    frame[3] = l_J1939Name[0];
+    frame[4] = l_J1939Name[1];
+    frame[5] = l_J1939Name[2];
+    frame[6] = l_J1939Name[3];
+    ECANTransmitCommit(ECAN_TX_CLASS_STATUS);
+    return true;
+}
+
+/*
+ *      J1939Received() -   A 29 bit frame from the ECAN interrupt: ISO-TP frames go to IsoTpReceived(), J1939 address claims
+ *                          and requests (see ConfigureECAN1()) are only noted here and J1939Tick() acts on them.
+ */
+static void J1939Received(unsigned int buffernumber)
+{
+    unsigned int pf = (((ecan1msgBuf[buffernumber][0] >> 2) & 0x003F) << 2) | ((ecan1msgBuf[buffernumber][1] >> 10) & 0x0003);
+    unsigned int ps = (ecan1msgBuf[buffernumber][1] >> 2) & 0x00FF;
+    unsigned int sa = ((ecan1msgBuf[buffernumber][1] & 0x0003) << 6) | (ecan1msgBuf[buffernumber][2] >> 10);
+    unsigned int dlc = ecan1msgBuf[buffernumber][2] & 0x000F;
+
+    if (pf == (ISOTP_PGN >> 8))
+    {
+        IsoTpReceived(buffernumber, ps, sa);
+        return;
+    }
+    if (g_J1939State == J1939_STATE_OFF)
+    {
+        return;
+    }
+    if ((pf == (J1939_PGN_ADDRESS_CLAIM >> 8)) && (sa == g_J1939Address) && (dlc == 8))
+    {
+        l_J1939ContenderName[0] = ecan1msgBuf[buffernumber][3];
+        l_J1939ContenderName[1] = ecan1msgBuf[buffernumber][4];
+        l_J1939ContenderName[2] = ecan1msgBuf[buffernumber][5];
+        l_J1939ContenderName[3] = ecan1msgBuf[buffernumber][6];
+        l_J1939Contention = true;
+    }
+    else if ((pf == (J1939_PGN_REQUEST >> 8)) && ((ps == g_J1939Address) || (ps == J1939_GLOBAL_ADDRESS)) && (dlc >= 3) &&
+             (ecan1msgBuf[buffernumber][3] == J1939_PGN_ADDRESS_CLAIM) && ((ecan1msgBuf[buffernumber][4] & 0x00FF) == 0))
+    {
+        l_J1939ClaimRequested = true;
+    }
+}
+
+/*
+ *      J1939Tick() -   Called every Timer1 tick.  In CAN_ID_J1939 mode runs the address claim: a contender for our address 
+ *                      with a lower NAME wins it and we move to the next free self-configurable address (Cannot Claim when
+ *                      they are all gone), otherwise we claim it again.  A request for the address claim is answered, and 
+ *                      J1939_CLAIM_TIME after the last claim the node may send.  Also sends the BAM message in progress,
+ *                      one packet every J1939_BAM_INTERVAL ms.
+ */
+void J1939Tick()
+{
+    st_J1939Transport* transport = &l_J1939Transport;
+    unsigned int* frame;
+    unsigned int offset;
+    unsigned int i;
+    int compare = 0;
+
+    if (g_J1939State == J1939_STATE_OFF)
+    {
+        return;
+    }
+
+    if (l_J1939Contention)
+    {
+        l_J1939Contention = false;
+        // NAMEs compare as 64 bit numbers, the lower one wins.
+        for (i=4; (i != 0) && (compare == 0); i--)
+        {
+            compare = (l_J1939Name[i-1] < l_J1939ContenderName[i-1]) ? -1 : (l_J1939Name[i-1] > l_J1939ContenderName[i-1]) ? 1 : 0;
+        }
+        if ((compare > 0) && (g_J1939State != J1939_STATE_CANNOT_CLAIM))
+        {
+            l_J1939AddressesTried++;
+            if (l_J1939AddressesTried > (J1939_ADDRESS_LAST - J1939_ADDRESS_FIRST))
+            {
+                g_J1939Address = J1939_NULL_ADDRESS;
+                g_J1939State = J1939_STATE_CANNOT_CLAIM;
+            }
+            else
+            {
+                g_J1939Address = (g_J1939Address < J1939_ADDRESS_FIRST) || (g_J1939Address >= J1939_ADDRESS_LAST) ? 
+                                 J1939_ADDRESS_FIRST : g_J1939Address + 1;
+                l_J1939ClaimWait = J1939_CLAIM_TIME;
+                g_J1939State = J1939_STATE_CLAIMING;
+            }
+            transport->Packets = 0;
+            CompileCANMessages();
+        }
+        l_J1939ClaimPending = true;
+    }
+    if (l_J1939ClaimRequested)
+    {
+        l_J1939ClaimRequested = false;
+        l_J1939ClaimPending = true;
+    }
+    if (l_J1939ClaimPending && J1939TransmitClaim())
+    {
+        l_J1939ClaimPending = false;
+    }
+    if (g_J1939State == J1939_STATE_CLAIMING)
+    {
+        if (--l_J1939ClaimWait == 0)
+        {
+            g_J1939State = J1939_STATE_CLAIMED;
+        }
+        return;
+    }
+
+    // BAM: the TP.CM announcement, then the numbered TP.DT packets of 7 bytes (the last padded with 0xFF).
+    if ((transport->Packets == 0) || (g_J1939State != J1939_STATE_CLAIMED))
+    {
+        return;
+    }
+    if (transport->Wait != 0)
+    {
+        transport->Wait--;
+        return;
+    }
+    frame = ECANTransmitTryReserve(ECAN_TX_CLASS_CAPTURE);
+    if (frame == NULL)
+    {
+        return;
+    }
+    if (transport->Next == 0)
+    {
+        J1939FrameHeader(frame, J1939_TP_PRIORITY, J1939_PGN_TP_CM | J1939_GLOBAL_ADDRESS, 8);
+        frame[3] = J1939_TP_BAM | (transport->Length << 8);                         // Control, size LSB
+        frame[4] = (transport->Length >> 8) | (transport->Packets << 8);            // Size MSB, packets
+        frame[5] = 0xFF | ((unsigned int)transport->PGN << 8);                      // Reserved, PGN LSB
+        frame[6] = (unsigned int)(transport->PGN >> 8);                             // PGN
+    }
+    else
+    {
+        J1939FrameHeader(frame, J1939_TP_PRIORITY, J1939_PGN_TP_DT | J1939_GLOBAL_ADDRESS, 8);
+        offset = (transport->Next - 1) * 7;
+        ((uint8_t*)&frame[3])[0] = transport->Next;
+        for (i=1; i<8; i++, offset++)
+        {
+            ((uint8_t*)&frame[3])[i] = (offset < transport->Length) ? transport->Byte(offset) : 0xFF;
+        }
+    }
+    ECANTransmitCommit(ECAN_TX_CLASS_CAPTURE);
+    transport->Wait = J1939_BAM_INTERVAL - 1;
+    transport->Next++;
+    if (transport->Next > transport->Packets)
+    {
+        transport->Packets = 0;
+    }
+}
+
+/*
+ *      J1939BAMStart() -   Start broadcasting a message of 9 to J1939_BAM_MAX bytes on 'pgn' with the BAM transport protocol.
+ *                          'byte' returns each byte of the message as J1939Tick() sends it, so the message is never copied.
+ *                          Returns false if one is already in progress or the length is out of range.
+ */
+bool J1939BAMStart(unsigned long pgn, unsigned int length, uint8_t (*byte)(unsigned int offset))
+{
+    st_J1939Transport* transport = &l_J1939Transport;
+
+    if ((transport->Packets != 0) || (length <= 8) || (length > J1939_BAM_MAX))
+    {
+        return false;
+    }
+    transport->PGN = pgn;
+    transport->Length = length;
+    transport->Byte = byte;
+    transport->Next = 0;
+    transport->Wait = 0;
+    transport->Packets = (length + 6) / 7;
+    return true;
+}
+
+/*
+ *      J1939CaptureByte() - Byte of the capture chunk being sent by BAM: bytes 0&1 index of the first sample 
+ *                           (l_J1939CaptureStart), then the samples LSB first.
+ */
+static uint8_t J1939CaptureByte(unsigned int offset)
+{
+    if (offset < 2)
+    {
+        return (uint8_t)(l_J1939CaptureStart >> (offset * 8));
+    }
+    offset -= 2;
+    return (uint8_t)(ADCCaptureSample(l_J1939CaptureStart + (offset >> 1)) >> ((offset & 1) * 8));
+}
+
+/*
+ *      IsoTpAddress() -    This node's ISO-TP address: the claimed J1939 address, or the low 7 bits of CanCommand_ID.
+ */
+static unsigned int IsoTpAddress()
+{
+    return (g_Config.CanIDMode == CAN_ID_J1939) ? g_J1939Address : (g_Config.CanCommand_ID & 0x007F);
+}
+
+/*
+ *      IsoTpReserve() -    Reserve a frame of 'txclass' to the tester, with its ID and padding in place, and return its 8 data
+ *                          bytes (or NULL if the queue has no room) for the caller to fill in and commit.
+ */
+static uint8_t* IsoTpReserve(unsigned int txclass, unsigned int target)
+{
+    unsigned int* frame = ECANTransmitTryReserve(txclass);
+
+    if (frame == NULL)
+    {
+        return NULL;
+    }
+    ECANExtendedHeader(frame, ((unsigned long)ISOTP_PRIORITY << 26) | ((unsigned long)(ISOTP_PGN | target) << 8) | IsoTpAddress(), 8);
+    frame[3] = (ISOTP_PADDING << 8) | ISOTP_PADDING;
+    frame[4] = frame[3];
+    frame[5] = frame[3];
+    frame[6] = frame[3];
+    return (uint8_t*)&frame[3];
+}
+
+/*
+ *      IsoTpReceived() -   An ISO-TP frame from the ECAN interrupt, to 'target' from 'source'.  Single frames and first plus 
+ *                          consecutive frames are reassembled into l_IsoTpRxBuffer, and a complete request is left for 
+ *                          IsoTpTick().  Flow control frames are passed on to the response being sent.  A request that comes 
+ *                          while the last one is still waiting is ignored.
+ */
+static void IsoTpReceived(unsigned int buffernumber, unsigned int target, unsigned int source)
+{
+    const uint8_t* data = (const uint8_t*)&ecan1msgBuf[buffernumber][3];
+    unsigned int dlc = ecan1msgBuf[buffernumber][2] & 0x000F;
+    unsigned int length;
+    unsigned int i;
+
+    if ((target != IsoTpAddress()) || (dlc == 0))
+    {
+        return;
+    }
+    switch (data[0] & 0xF0)
+    {
+        case ISOTP_PCI_SINGLE:
+            length = data[0] & 0x0F;
+            if (l_IsoTpRequestReady || (length == 0) || (length > 7) || (length >= dlc))
+            {
+                break;
+            }
+            for (i=0; i<length; i++)
+            {
+                l_IsoTpRxBuffer[i] = data[1+i];
+            }
+            l_IsoTpRxLength = length;
+            l_IsoTpRxTester = source;
+            l_IsoTpRxTimeout = 0;
+            l_IsoTpRequestReady = true;
+            break;
+
+        case ISOTP_PCI_FIRST:
+            length = ((data[0] & 0x0F) << 8) | data[1];
+            if (l_IsoTpRequestReady || (dlc < 8) || (length < 8))
+            {
+                break;
+            }
+            l_IsoTpRxTester = source;
+            if (length > ISOTP_RX_BUFFER_LENGTH)
+            {
+                l_IsoTpFlowStatus = ISOTP_FC_OVERFLOW;
+                l_IsoTpSendFlowControl = true;
+                break;
+            }
+            for (i=0; i<6; i++)
+            {
+                l_IsoTpRxBuffer[i] = data[2+i];
+            }
+            l_IsoTpRxLength = length;
+            l_IsoTpRxOffset = 6;
+            l_IsoTpRxSequence = 1;
+            l_IsoTpRxBlockLeft = ISOTP_BLOCK_SIZE;
+            l_IsoTpRxTimeout = ISOTP_TIMEOUT;
+            l_IsoTpFlowStatus = ISOTP_FC_CTS;
+            l_IsoTpSendFlowControl = true;
+            break;
+
+        case ISOTP_PCI_CONSECUTIVE:
+            if ((l_IsoTpRxTimeout == 0) || (source != l_IsoTpRxTester))
+            {
+                break;
+            }
+            if ((data[0] & 0x0F) != l_IsoTpRxSequence)
+            {
+                // A lost or repeated frame ends the request.
+                l_IsoTpRxTimeout = 0;
+                g_IsoTpAborted++;
+                break;
+            }
+            for (i=1; (i<dlc) && (l_IsoTpRxOffset<l_IsoTpRxLength); i++)
+            {
+                l_IsoTpRxBuffer[l_IsoTpRxOffset++] = data[i];
+            }
+            l_IsoTpRxSequence = (l_IsoTpRxSequence + 1) & 0x0F;
+            l_IsoTpRxTimeout = ISOTP_TIMEOUT;
+            if (l_IsoTpRxOffset >= l_IsoTpRxLength)
+            {
+                l_IsoTpRxTimeout = 0;
+                l_IsoTpRequestReady = true;
+            }
+            else if ((ISOTP_BLOCK_SIZE != 0) && (--l_IsoTpRxBlockLeft == 0))
+            {
+                l_IsoTpRxBlockLeft = ISOTP_BLOCK_SIZE;
+                l_IsoTpFlowStatus = ISOTP_FC_CTS;
+                l_IsoTpSendFlowControl = true;
+            }
+            break;
+
+        case ISOTP_PCI_FLOW:
+            if ((l_IsoTpTx.State == ISOTP_TX_FLOW) && (source == l_IsoTpTx.Target) && (dlc >= 3))
+            {
+                l_IsoTpFlow[0] = data[0] & 0x0F;
+                l_IsoTpFlow[1] = data[1];
+                l_IsoTpFlow[2] = data[2];
+                l_IsoTpFlowReceived = true;
+            }
+            break;
+    }
+}
+
+/*
+ *      IsoTpResponseByte() - Byte of the response being sent: the reply bytes set up by IsoTpService(), then the st_CAL image 
+ *                            or the capture samples.
+ */
+static uint8_t IsoTpResponseByte(unsigned int offset)
+{
+    if ((l_IsoTpService == ISOTP_SERVICE_READ_CONFIG) && (offset != 0))
+    {
+        return ((const uint8_t*)&g_Config)[offset - 1];
+    }
+    if ((l_IsoTpService == ISOTP_SERVICE_READ_CAPTURE) && (offset >= 9))
+    {
+        offset -= 9;
+        return (uint8_t)(ADCCaptureSample(offset >> 1) >> ((offset & 1) * 8));
+    }
+    return l_IsoTpReply[offset];
+}
+
+/*
+ *      IsoTpService() - Carry out the request in l_IsoTpRxBuffer and set up the response in l_IsoTpTx.  Runs in the Timer1 
+ *                       interrupt, so g_Config can change here without holding anything off.
+ */
+static void IsoTpService()
+{
+    uint8_t* config = (uint8_t*)&g_Config;
+    unsigned int result = CAN_RESULT_OK;
+    unsigned int i;
+
+    l_IsoTpService = l_IsoTpRxBuffer[0];
+    l_IsoTpTx.Length = 1;
+    switch (l_IsoTpService)
+    {
+        case ISOTP_SERVICE_READ_CONFIG:
+            l_IsoTpTx.Length = 1 + sizeof(st_CAL);
+            break;
+
+        case ISOTP_SERVICE_WRITE_CONFIG:
+            // The image has to keep the settings only taken at startup (see ECANConfigKeeps()).
+            if ((l_IsoTpRxLength != 1 + sizeof(st_CAL)) || (l_IsoTpRxBuffer[1] != (uint8_t)g_Config.version) ||
+                !ECANConfigKeeps(&l_IsoTpRxBuffer[1], 0, sizeof(st_CAL)))
+            {
+                result = CAN_RESULT_BAD_ARGUMENT;
+                break;
+            }
+            for (i=0; i<sizeof(st_CAL); i++)
+            {
+                config[i] = l_IsoTpRxBuffer[1+i];
+            }
+            CompileCANMessages();
+            break;
+
+        case ISOTP_SERVICE_READ_CAPTURE:
+            if ((g_ADCCapture.State != ADC_CAPTURE_COMPLETE) || (g_ADCCapture.Drain != ADC_CAPTURE_DRAIN_ISOTP))
+            {
+                result = CAN_RESULT_FAILED;
+                break;
+            }
+            l_IsoTpReply[1] = 0xFF;
+            l_IsoTpReply[2] = 0xFF;
+            l_IsoTpReply[3] = g_ADCCapture.Channels;
+            l_IsoTpReply[4] = g_ADCCapture.TriggerChannel;
+            l_IsoTpReply[5] = g_ADCCapture.PreTriggerRows;
+            l_IsoTpReply[6] = g_ADCCapture.PreTriggerRows >> 8;
+            l_IsoTpReply[7] = g_ADCCapture.Rows;
+            l_IsoTpReply[8] = g_ADCCapture.Rows >> 8;
+            l_IsoTpTx.Length = 9 + (g_ADCCapture.Length * 2);
+            break;
+
+        default:
+            result = CAN_RESULT_UNKNOWN;
+            break;
+    }
+    if (result == CAN_RESULT_OK)
+    {
+        l_IsoTpReply[0] = l_IsoTpService | ISOTP_RESPONSE;
+    }
+    else
+    {
+        l_IsoTpReply[0] = ISOTP_NEGATIVE;
+        l_IsoTpReply[1] = l_IsoTpService;
+        l_IsoTpReply[2] = result;
+        l_IsoTpTx.Length = 3;
+        l_IsoTpService = ISOTP_NEGATIVE;
+    }
+    l_IsoTpTx.Byte = IsoTpResponseByte;
+    l_IsoTpTx.Target = l_IsoTpRxTester;
+    l_IsoTpTx.State = ISOTP_TX_START;
+}
+
+/*
+ *      IsoTpDone() - The response is over, sent or aborted.  A capture that was read is released either way.
+ */
+static void IsoTpDone(bool sent)
+{
+    if (sent)
+    {
+        g_IsoTpResponses++;
+    }
+    else
+    {
+        g_IsoTpAborted++;
+    }
+    if (l_IsoTpService == ISOTP_SERVICE_READ_CAPTURE)
+    {
+        ADCCaptureRelease();
+    }
+    l_IsoTpTx.State = ISOTP_TX_IDLE;
+}
+
+/*
+ *      IsoTpTick() -   Called every Timer1 tick.  Times out a request being received, sends the flow control the ECAN 
+ *                      interrupt asked for, starts on a complete request once the last response is done, and moves the 
+ *                      response on: the single or first frame, then blocks of consecutive frames as the tester's flow 
+ *                      control allows.
+ */
+void IsoTpTick()
+{
+    st_IsoTpTransmit* tx = &l_IsoTpTx;
+    uint8_t* data;
+    unsigned int interruptenabled;
+    unsigned int frames;
+    unsigned int i;
+
+    // The ECAN interrupt restarts the timeout with each consecutive frame.
+    interruptenabled = IEC2bits.C1IE;
+    IEC2bits.C1IE = 0;
+    if ((l_IsoTpRxTimeout != 0) && (--l_IsoTpRxTimeout == 0))
+    {
+        g_IsoTpAborted++;
+    }
+    IEC2bits.C1IE = interruptenabled;
+
+    if (l_IsoTpSendFlowControl && ((data = IsoTpReserve(ECAN_TX_CLASS_STATUS, l_IsoTpRxTester)) != NULL))
+    {
+        data[0] = ISOTP_PCI_FLOW | l_IsoTpFlowStatus;
+        data[1] = ISOTP_BLOCK_SIZE;
+        data[2] = ISOTP_STMIN;
+        ECANTransmitCommit(ECAN_TX_CLASS_STATUS);
+        l_IsoTpSendFlowControl = false;
+    }
+
+    if ((tx->State == ISOTP_TX_IDLE) && l_IsoTpRequestReady)
+    {
+        g_IsoTpRequests++;
+        IsoTpService();
+        l_IsoTpRequestReady = false;
+    }
+
+    switch (tx->State)
+    {
+        case ISOTP_TX_START:
+            if ((data = IsoTpReserve(ECAN_TX_CLASS_CAPTURE, tx->Target)) == NULL)
+            {
+                break;
+            }
+            if (tx->Length <= 7)
+            {
+                data[0] = ISOTP_PCI_SINGLE | tx->Length;
+                for (i=0; i<tx->Length; i++)
+                {
+                    data[1+i] = tx->Byte(i);
+                }
+                ECANTransmitCommit(ECAN_TX_CLASS_CAPTURE);
+                IsoTpDone(true);
+                break;
+            }
+            data[0] = ISOTP_PCI_FIRST | (tx->Length >> 8);
+            data[1] = tx->Length;
+            for (i=0; i<6; i++)
+            {
+                data[2+i] = tx->Byte(i);
+            }
+            // Wait for the flow control before the first frame can go, as the answer may come before this tick is over.
+            tx->Offset = 6;
+            tx->Sequence = 1;
+            tx->Timeout = ISOTP_TIMEOUT;
+            l_IsoTpFlowReceived = false;
+            tx->State = ISOTP_TX_FLOW;
+            ECANTransmitCommit(ECAN_TX_CLASS_CAPTURE);
+            break;
+
+        case ISOTP_TX_FLOW:
+            if (!l_IsoTpFlowReceived)
+            {
+                if (--tx->Timeout == 0)
+                {
+                    IsoTpDone(false);
+                }
+                break;
+            }
+            l_IsoTpFlowReceived = false;
+            if (l_IsoTpFlow[0] == ISOTP_FC_WAIT)
+            {
+                tx->Timeout = ISOTP_TIMEOUT;
+                break;
+            }
+            if (l_IsoTpFlow[0] != ISOTP_FC_CTS)
+            {
+                IsoTpDone(false);
+                break;
+            }
+            // STmin 0x00-0x7F is ms, 0xF1-0xF9 100-900us (a whole tick here), anything else counts as the longest.
+            tx->BlockLeft = l_IsoTpFlow[1];
+            tx->STmin = (l_IsoTpFlow[2] <= 0x7F) ? l_IsoTpFlow[2] : ((l_IsoTpFlow[2] >= 0xF1) && (l_IsoTpFlow[2] <= 0xF9)) ? 1 : 0x7F;
+            tx->Wait = 0;
+            tx->State = ISOTP_TX_SENDING;
+            // Fall through to send the first consecutive frame now.
+
+        case ISOTP_TX_SENDING:
+            if (tx->Wait != 0)
+            {
+                tx->Wait--;
+                break;
+            }
+            // The consecutive frames are counted from when they are queued, so the gap is STmin + 1 ticks to stay clear 
+            // of STmin when the one before waited in the queue.
+            for (frames=0; frames<((tx->STmin == 0) ? ISOTP_FRAMES_PER_TICK : 1); frames++)
+            {
+                if ((data = IsoTpReserve(ECAN_TX_CLASS_CAPTURE, tx->Target)) == NULL)
+                {
+                    break;
+                }
+                data[0] = ISOTP_PCI_CONSECUTIVE | tx->Sequence;
+                for (i=1; (i<8) && (tx->Offset<tx->Length); i++)
+                {
+                    data[i] = tx->Byte(tx->Offset++);
+                }
+                tx->Sequence = (tx->Sequence + 1) & 0x0F;
+                tx->Wait = tx->STmin;
+                if (tx->Offset >= tx->Length)
+                {
+                    ECANTransmitCommit(ECAN_TX_CLASS_CAPTURE);
+                    IsoTpDone(true);
+                    break;
+                }
+                if ((tx->BlockLeft != 0) && (--tx->BlockLeft == 0))
+                {
+                    // The end of a block: as for the first frame, wait for the flow control before the frame goes.
+                    tx->Timeout = ISOTP_TIMEOUT;
+                    l_IsoTpFlowReceived = false;
+                    tx->State = ISOTP_TX_FLOW;
+                    ECANTransmitCommit(ECAN_TX_CLASS_CAPTURE);
+                    break;
+                }
+                ECANTransmitCommit(ECAN_TX_CLASS_CAPTURE);
+            }
+            break;
+    }
+}
+
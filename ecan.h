@@ -12,18 +12,344 @@
 extern "C" {
 #endif
 
-#define  ECAN1_MSG_BUF_LENGTH 	8
+#define  ECAN1_MSG_BUF_LENGTH 	16
+// Buffers 0-7 can transmit: 0-6 are fed by the transmit queue (see ECANTransmitReserve()) and 7 is kept for the SYNC frame 
+// (see TransmitSyncFrame()).  Buffers 8-15 are the receive FIFO, filled by DMA2.
+#define  ECAN1_TX_BUFFERS       7
+#define  ECAN1_SYNC_BUFFER      7
+#define  ECAN1_RX_FIFO_START    8
 // ECAN1MSGBUF is a collection of ECAN1_MSG_BUG_LENGTH message buffers, each 8 words in size.)
 // 8 words corresponds to word 0,1,2 being setup and SID, and word 3,4,5,6 being the packet data. Word 7 is unused.   
-typedef uint16_t ECAN1MSGBUF [ECAN1_MSG_BUF_LENGTH][8];
+// The words are unsigned int, as handed out by ECANTransmitReserve(), so the frames in the rings and in the buffers agree.
+typedef unsigned int ECAN1MSGBUF [ECAN1_MSG_BUF_LENGTH][8];
 extern ECAN1MSGBUF  ecan1msgBuf __attribute__((space(dma)));
 
 
-void BuildCANPackets();
-void TransmitCANPackets();
+// Value formats for each CAN message (g_Config.CanMessages[n].Format)
+//      CAN_FORMAT_RAW        - Decimated ADC values (g_ADCValues)
+//      CAN_FORMAT_MILLIVOLTS - Calibrated millivolts (g_ADCMillivolts), 16 bits per channel
+//      CAN_FORMAT_ENGINEERING - Linearized engineering units (g_ADCEngineering), signed 16 bits per channel
+//      CAN_FORMAT_PACKED12   - Five raw 12 bit samples and the sequence number, packed little-endian into 8 bytes:
+//                                  bits 0-11 sample 0, 12-23 sample 1, 24-35 sample 2, 36-47 sample 3, 48-59 sample 4,
+//                                  60-63 sequence number (low 4 bits)
+//                              Data[0..4] of the message map select the samples with the CAN_DATA_CHn_LSB, CAN_DATA_VCC_LSB,
+//                              CAN_DATA_STATUS or CAN_DATA_ZERO codes.  Oversampled channels are shifted back to 12 bits.
+//                              Two messages carry all 8 channels, +5VCC and the status nibble, e.g. CH0-CH4, and 
+//                              CH5-CH7, VCC, STATUS.
+#define CAN_FORMAT_RAW          0
+#define CAN_FORMAT_MILLIVOLTS   1
+#define CAN_FORMAT_ENGINEERING  2
+#define CAN_FORMAT_PACKED12     3
+
+// Status nibble (CAN_DATA_STATUS), worked out for each sample set
+//      CAN_STATUS_DROPPED   - Frames were dropped from the transmit queue since the previous set
+//      CAN_STATUS_VCC_FAULT - The +5VCC reference is below half its nominal value (no ratiometric correction)
+//      CAN_STATUS_SYNC      - Sample ticks are synchronised (sync master, or a slave within SYNC_LOCK_LIMIT)
+//      CAN_STATUS_CAPTURE   - A burst capture is armed or recording
+#define CAN_STATUS_DROPPED      0x01
+#define CAN_STATUS_VCC_FAULT    0x02
+#define CAN_STATUS_SYNC         0x04
+#define CAN_STATUS_CAPTURE      0x08
+
+// Report modes (g_Config.CanReportMode)
+//      CAN_REPORT_PERIODIC - Every new decimated value is sent
+//      CAN_REPORT_CHANGE   - Report by exception: a message is only sent when one of its channels moved beyond its deadband,
+//                            no more often than ReportMinInterval, at least every ReportMaxInterval, plus a heartbeat.
+//      CAN_REPORT_POLL     - On demand: a message is only sent when it is requested, plus a heartbeat.
+// In every mode a message is also sent on request: a remote (RTR) frame with the message's 11 bit ID (CanMessages[].ID, 
+// also in CAN_ID_J1939 mode), or CAN_COMMAND_POLL.  The request is answered at the next Timer1 tick with the newest 
+// decimated values, so within 1ms of its receipt plus the time to win the bus (see g_CANPollLatencyMax).
+#define CAN_REPORT_PERIODIC     0
+#define CAN_REPORT_CHANGE       1
+#define CAN_REPORT_POLL         2
+
+// Timestamp modes (g_Config.CanTimestampMode)
+//      CAN_TIMESTAMP_NONE  - The data packets are sent on their own
+//      CAN_TIMESTAMP_FRAME - Each set of data packets is followed by a timestamp frame on CanTimestamp_ID
+#define CAN_TIMESTAMP_NONE      0
+#define CAN_TIMESTAMP_FRAME     1
+
+// Transmit queue classes, highest priority first.  Each has a ring of ECAN_TX_QUEUE_LENGTH frames, a transmit buffer 
+// priority and a policy for when the ring is full:
+//      ECAN_TX_CLASS_DATA    - Data packets and timestamp frames, priority 3, drop the oldest (a newer sample set supersedes it)
+//      ECAN_TX_CLASS_STATUS  - Startup frame and heartbeats, priority 2, drop the newest
+//      ECAN_TX_CLASS_STATS   - Statistics frames, priority 1, drop the oldest
+//      ECAN_TX_CLASS_CAPTURE - Capture drain, priority 0 (only fills idle bus time), drop the newest so the caller retries
+// Frames are built in place with ECANTransmitReserve() / ECANTransmitCommit().  Senders that keep their frame and try again
+// on a later tick (the capture drain, BAM, ISO-TP, the J1939 address claim) reserve with ECANTransmitTryReserve(), so a full
+// queue counts as busy (g_ECANTransmitBusy) rather than dropped.
+#define ECAN_TX_CLASS_DATA      0
+#define ECAN_TX_CLASS_STATUS    1
+#define ECAN_TX_CLASS_STATS     2
+#define ECAN_TX_CLASS_CAPTURE   3
+#define ECAN_TX_CLASSES         4
+#define ECAN_TX_QUEUE_LENGTH    8
+#define ECAN_TX_DROP_OLDEST     0
+#define ECAN_TX_DROP_NEWEST     1
+
+typedef struct {
+    unsigned int Frames[ECAN_TX_QUEUE_LENGTH][7];   // Words 0-6 of each frame, as in the DMA buffer
+    unsigned int Head;                              // Oldest frame
+    unsigned int Count;
+} st_ECANTxQueue;
+
+// Sources of the data bytes of a CAN message (g_Config.CanMessages[n].Data[byte], see CompileCANMessages()).  Channel
+// values are in the message's CAN_FORMAT_xxx.  The numbering is the original Message_DATA types, so 0x03 is unused.
+#define CAN_DATA_ZERO           0x00
+#define CAN_DATA_CH0_LSB        0x01
+#define CAN_DATA_CH0_MSB        0x02
+#define CAN_DATA_CH1_LSB        0x04
+#define CAN_DATA_CH1_MSB        0x05
+#define CAN_DATA_CH2_LSB        0x06
+#define CAN_DATA_CH2_MSB        0x07
+#define CAN_DATA_CH3_LSB        0x08
+#define CAN_DATA_CH3_MSB        0x09
+#define CAN_DATA_CH4_LSB        0x0a
+#define CAN_DATA_CH4_MSB        0x0b
+#define CAN_DATA_CH5_LSB        0x0c
+#define CAN_DATA_CH5_MSB        0x0d
+#define CAN_DATA_CH6_LSB        0x0e
+#define CAN_DATA_CH6_MSB        0x0f
+#define CAN_DATA_CH7_LSB        0x10
+#define CAN_DATA_CH7_MSB        0x11
+#define CAN_DATA_VCC_LSB        0x12    // +5VCC reference, filtered raw ADC counts (g_ADCVCCFiltered)
+#define CAN_DATA_VCC_MSB        0x13
+#define CAN_DATA_SEQUENCE_LSB   0x14
+#define CAN_DATA_SEQUENCE_MSB   0x15
+#define CAN_DATA_STATUS         0x16    // Status nibble (CAN_STATUS_xxx) in the low 4 bits, the high 4 bits are 0
+
+// CAN ID modes (g_Config.CanIDMode)
+//      CAN_ID_STANDARD - 11 bit IDs from the configuration (CanMessages[].ID, CanStats_ID, ...)
+//      CAN_ID_J1939    - 29 bit J1939 IDs: priority J1939Priority, PGN J1939PGN + J1939_PGN_xxx, and the source address the
+//                        node claimed at startup (J1939 address claim instead of the startup frame).  Nothing else is sent
+//                        until the address is claimed.  Capture dumps go out with the BAM transport protocol.  The SYNC 
+//                        frame, commands and their replies stay on their 11 bit IDs.
+#define CAN_ID_STANDARD         0
+#define CAN_ID_J1939            1
+
+// CAN_ID_J1939 PGNs, as offsets from g_Config.J1939PGN.  The default base is Proprietary B (PDU2, 0xFF00), for a PDU1 base
+// the low byte of the PGN is the destination address.  The frames are laid out as the 11 bit ones.
+//      J1939_PGN_DATA      - CAN message n on J1939_PGN_DATA + n
+//      J1939_PGN_TIMESTAMP - Timestamp frames
+//      J1939_PGN_HEARTBEAT - Heartbeats
+//      J1939_PGN_CAPTURE   - Capture dump: the header frame, then the samples in BAM messages of at most 
+//                            J1939_CAPTURE_SAMPLES, each bytes 0&1 index of the first sample, then the samples (LSB first)
+//      J1939_PGN_STATS     - Stats frame of channel n on J1939_PGN_STATS + n
+#define J1939_PGN_DATA          0
+#define J1939_PGN_TIMESTAMP     3
+#define J1939_PGN_HEARTBEAT     4
+#define J1939_PGN_CAPTURE       5
+#define J1939_PGN_STATS         6
+#define J1939_CAPTURE_SAMPLES   891
+
+// J1939 network management and transport protocol (SAE J1939-81 / J1939-21)
+#define J1939_PGN_REQUEST       0xEA00
+#define J1939_PGN_ADDRESS_CLAIM 0xEE00
+#define J1939_PGN_TP_CM         0xEC00
+#define J1939_PGN_TP_DT         0xEB00
+#define J1939_GLOBAL_ADDRESS    0xFF
+#define J1939_NULL_ADDRESS      0xFE
+#define J1939_ADDRESS_FIRST     128             // Self-configurable address range tried when the preferred one is lost
+#define J1939_ADDRESS_LAST      247
+#define J1939_CLAIM_TIME        250             // ms after a claim before other frames may be sent
+#define J1939_TP_BAM            32              // TP.CM control byte
+#define J1939_BAM_INTERVAL      50              // ms between BAM data packets (50-200 allowed)
+#define J1939_BAM_MAX           1785            // 255 packets of 7 bytes
+#define J1939_TP_PRIORITY       7
+
+// NAME fields of this node (identity number is the serial number, arbitrary address capable).  The manufacturer code has to
+// be the SAE assigned one for a production network.
+#define J1939_NAME_MANUFACTURER 0x7FF
+#define J1939_NAME_FUNCTION     0xFF
+#define J1939_NAME_INDUSTRY     0
+
+// Address claim states (see J1939Tick())
+//      J1939_STATE_OFF          - CAN_ID_STANDARD mode
+//      J1939_STATE_CLAIMING     - Claim sent, waiting J1939_CLAIM_TIME for a contender
+//      J1939_STATE_CLAIMED      - The address is ours, the node is sending
+//      J1939_STATE_CANNOT_CLAIM - Lost every address, the node is silent except to answer requests for its address
+#define J1939_STATE_OFF         0
+#define J1939_STATE_CLAIMING    1
+#define J1939_STATE_CLAIMED     2
+#define J1939_STATE_CANNOT_CLAIM 3
+
+// A BAM (broadcast) transport protocol message in progress (see J1939BAMStart()): the PGN it carries, its length, packets, 
+// the next packet to send (0 = the TP.CM announcement), ms to wait before it, and the routine that returns each byte.
+typedef struct {
+    unsigned long PGN;
+    unsigned int Length;
+    unsigned int Packets;
+    unsigned int Next;
+    unsigned int Wait;
+    uint8_t (*Byte)(unsigned int offset);
+} st_J1939Transport;
+
+// ISO 15765-2 (ISO-TP) transport for requests and responses longer than a frame, with normal fixed addressing: a tester 
+// sends to this node on 29 bit ID 0x18DA<node><tester> and gets the response on 0x18DA<tester><node>, any tester address.
+// The node address is the claimed J1939 address, or in CAN_ID_STANDARD mode the low 7 bits of CanCommand_ID (so it follows
+// the serial number as the commands do).  Frames are padded to 8 bytes with ISOTP_PADDING.  A request's first frame is 
+// answered with flow control ISOTP_BLOCK_SIZE / ISOTP_STMIN.  The response is paced by the tester's flow control (STmin in 
+// whole ms, under 1ms counts as 1ms, and at most ISOTP_FRAMES_PER_TICK frames a tick when it is 0) and queued in the capture
+// class, the lowest transmit priority, so a bulk transfer only uses the bus time the data stream leaves.  A missing flow
+// control or consecutive frame aborts the transfer after ISOTP_TIMEOUT.  One request is served at a time.
+// Services, request byte 0.  The response is the service | ISOTP_RESPONSE, or ISOTP_NEGATIVE, the service and a 
+// CAN_RESULT_xxx:
+//      ISOTP_SERVICE_READ_CONFIG   - Response: the st_CAL image (g_Config)
+//      ISOTP_SERVICE_WRITE_CONFIG  - Request: a whole st_CAL image with this firmware's version byte, copied into g_Config.
+//                                    As CAN_COMMAND_SET_CONFIG, only the message maps and report settings apply at once,
+//                                    and the image has to keep the current CanIDMode, CanSync_ID and CanCommand_ID.
+//      ISOTP_SERVICE_READ_CAPTURE  - Response: the 8 bytes of the capture header frame then every sample (LSB first), of a
+//                                    completed capture with ADC_CAPTURE_DRAIN_ISOTP.  The capture is released after.
+#define ISOTP_PGN                   0xDA00
+#define ISOTP_PRIORITY              6
+#define ISOTP_PCI_SINGLE            0x00
+#define ISOTP_PCI_FIRST             0x10
+#define ISOTP_PCI_CONSECUTIVE       0x20
+#define ISOTP_PCI_FLOW              0x30
+#define ISOTP_FC_CTS                0
+#define ISOTP_FC_WAIT               1
+#define ISOTP_FC_OVERFLOW           2
+#define ISOTP_MAX_LENGTH            4095
+#define ISOTP_RX_BUFFER_LENGTH      256         // Requests, at least a st_CAL image and its service byte
+#define ISOTP_BLOCK_SIZE            8
+#define ISOTP_STMIN                 0
+#define ISOTP_FRAMES_PER_TICK       4
+#define ISOTP_TIMEOUT               1000        // ms
+#define ISOTP_PADDING               0xCC
+#define ISOTP_RESPONSE              0x40
+#define ISOTP_NEGATIVE              0x7F
+#define ISOTP_SERVICE_READ_CONFIG   0x01
+#define ISOTP_SERVICE_WRITE_CONFIG  0x02
+#define ISOTP_SERVICE_READ_CAPTURE  0x03
+
+// ISO-TP transmit states (st_IsoTpTransmit.State)
+//      ISOTP_TX_IDLE     - Nothing to send
+//      ISOTP_TX_START    - The single or first frame is waiting for room in the queue
+//      ISOTP_TX_FLOW     - Waiting for the tester's flow control
+//      ISOTP_TX_SENDING  - Sending consecutive frames
+#define ISOTP_TX_IDLE               0
+#define ISOTP_TX_START              1
+#define ISOTP_TX_FLOW               2
+#define ISOTP_TX_SENDING            3
+
+// An ISO-TP response in progress (see IsoTpTick()): its state, length, bytes sent, next sequence number, consecutive frames
+// left before the next flow control (0 = no limit), ms between them and until the next, ms left for a flow control, the 
+// tester, and the routine that returns each byte.
+typedef struct {
+    unsigned int State;
+    unsigned int Length;
+    unsigned int Offset;
+    unsigned int Sequence;
+    unsigned int BlockLeft;
+    unsigned int STmin;
+    unsigned int Wait;
+    unsigned int Timeout;
+    uint8_t Target;
+    uint8_t (*Byte)(unsigned int offset);
+} st_IsoTpTransmit;
+
+// Bit timing limits of the ECAN module (see ECANBitTiming()).  A bit rate is accepted within ECAN_BITRATE_TOLERANCE of 
+// FCAN clocks per bit.  Some solutions, FCAN 40MHz:
+//      1000000 bit/s 70%  - BRP 0, 20 TQ: PropSeg 5, Phase1 8, Phase2 6, SJW 4 (70.0%)
+//      1000000 bit/s 80%  - BRP 0, 20 TQ: PropSeg 7, Phase1 8, Phase2 4, SJW 4 (80.0%)
+//       800000 bit/s 75%  - BRP 0, 25 TQ: PropSeg 8, Phase1 8, Phase2 8, SJW 4 (68.0%, the most Phase1 allows)
+//       500000 bit/s 87%  - BRP 1, 20 TQ: PropSeg 8, Phase1 8, Phase2 3, SJW 3 (85.0%)
+//       250000 bit/s 87%  - BRP 4, 16 TQ: PropSeg 5, Phase1 8, Phase2 2, SJW 2 (87.5%)
+//       125000 bit/s 87%  - BRP 9, 16 TQ: PropSeg 5, Phase1 8, Phase2 2, SJW 2 (87.5%)
+//        33333 bit/s 75%  - BRP 29, 20 TQ: PropSeg 6, Phase1 8, Phase2 5, SJW 4 (75.0%, 0.001% fast)
+// Below ~12.5Kbit/s even 25 TQ of the largest prescaler is too short, and no timing is found.
+#define ECAN_TQ_MIN             8
+#define ECAN_TQ_MAX             25
+#define ECAN_BRP_MAX            63
+#define ECAN_SEGMENT_MAX        8
+#define ECAN_PHASE2_MIN         2
+#define ECAN_SJW_MAX            4
+#define ECAN_BITRATE_TOLERANCE  (FCAN / 1000)
+
+// Remote commands, received on CanCommand_ID (filter 1) and carried out by ProcessECANCommands():
+//      Byte 0 command, byte 1 count / channels, bytes 2&3 offset / argument (LSB first), bytes 4-7 data
+// Each is answered on CanCommand_ID + CAN_COMMAND_REPLY_OFFSET with byte 0 command | 0x80, byte 1 result (CAN_RESULT_xxx),
+// bytes 2&3 echoed and bytes 4-7 data.
+//      CAN_COMMAND_GET_CONFIG  - Read 'count' (1-4) bytes of g_Config from byte offset 'offset', returned in bytes 4-7
+//      CAN_COMMAND_SET_CONFIG  - Write 'count' (1-4) bytes 4-7 into g_Config at 'offset' (not the version byte).  The CAN
+//                                message maps and report settings apply at once, the rest after SAVE_CONFIG and a reboot.
+//                                CanIDMode, CanSync_ID and CanCommand_ID, which set up the receive filters, cannot be
+//                                changed this way (CAN_RESULT_BAD_ARGUMENT).
+//      CAN_COMMAND_SAVE_CONFIG - Write g_Config to the EEPROM
+//      CAN_COMMAND_CAPTURE     - Trigger a burst capture now (an idle one is first armed from the configuration).  Fails
+//                                (CAN_RESULT_FAILED) while a capture is already triggered or waiting to be drained.
+//      CAN_COMMAND_SET_RATE    - Set the output rate of the channels in byte 1 (bit per channel) to ADC_RATE_xxx in byte 2
+//      CAN_COMMAND_REBOOT      - Restart the board, bytes 2&3 must be its serial number (CanStartup_SerialNumber)
+//      CAN_COMMAND_SET_BITRATE - Solve the bit timing for the bit rate in bytes 4-7 (bits/s) sampled at byte 1 (%), and put
+//                                both in g_Config.  Replies with BRP, PropSeg, Phase1 and Phase2 in bytes 4-7 and SJW in
+//                                byte 2.  Takes effect after CAN_COMMAND_SAVE_CONFIG and a reboot, so set every node first.
+//      CAN_COMMAND_POLL        - Send the messages in byte 1 (bit per message) at the next tick.  Answered by the messages 
+//                                themselves rather than a reply, and straight from the ECAN interrupt (see CANPollRequest()).
+#define CAN_COMMAND_GET_CONFIG  0x01
+#define CAN_COMMAND_SET_CONFIG  0x02
+#define CAN_COMMAND_SAVE_CONFIG 0x03
+#define CAN_COMMAND_CAPTURE     0x04
+#define CAN_COMMAND_SET_RATE    0x05
+#define CAN_COMMAND_REBOOT      0x06
+#define CAN_COMMAND_POLL        0x07
+#define CAN_COMMAND_SET_BITRATE 0x08
+#define CAN_RESULT_OK           0x00
+#define CAN_RESULT_UNKNOWN      0x01
+#define CAN_RESULT_BAD_ARGUMENT 0x02
+#define CAN_RESULT_FAILED       0x03
+#define CAN_COMMAND_REPLY_OFFSET    0x80
+#define ECAN_COMMAND_QUEUE_LENGTH   4
+
+// A CAN message compiled from its map: the routine that builds it, frame words 0 and 1, the length, the EID bits of word 2,
+// the channels it carries (bit per channel), their values (for the report by exception deadbands) and where each data byte comes from, or for 
+// CAN_FORMAT_PACKED12 each sample and the shift that brings it to 12 bits.
+typedef struct st_CANMessageProgram {
+    void (*Build)(const struct st_CANMessageProgram* program, unsigned int* frame);
+    unsigned int SID;
+    unsigned int EID;
+    unsigned int DLC;
+    unsigned int EIDLow;
+    unsigned int Channels;
+    const unsigned int* Values;
+    const uint8_t* Source[8];
+    const unsigned int* Sample[5];
+    unsigned int Shift[5];
+} st_CANMessageProgram;
+
+void CompileCANMessages();
+void BuildCANMessage(unsigned int message, unsigned int* frame);
+void TransmitUpdatedCANPackets(unsigned int channels);
 void ConfigureECAN1();
-bool TransmitECANFrame(unsigned int (*packet)[]);
+unsigned int* ECANTransmitReserve(unsigned int txclass);
+unsigned int* ECANTransmitTryReserve(unsigned int txclass);
+void ECANTransmitCommit(unsigned int txclass);
+void ECANTransmitRefill();
+void ECANTransmitAbort();
+extern unsigned long g_ECANFrameTime[ECAN1_MSG_BUF_LENGTH];
 void TransmitECANStartupFrame();
+void TransmitADCCaptureFrame();
+void TransmitCANHeartbeat();
+void TransmitCANTimestampFrame();
+void TransmitADCStatsFrame();
+void UpdateCANBusLoad();
+void ProcessECANCommands();
+bool ECANBitTiming(unsigned long bitrate, unsigned int samplepoint, st_CANBitTiming* timing);
+bool ECANBitTimingValid(const st_CANBitTiming* timing, unsigned long bitrate);
+extern unsigned int g_ECANCommandsLost;
+void J1939Tick();
+bool J1939BAMStart(unsigned long pgn, unsigned int length, uint8_t (*byte)(unsigned int offset));
+extern volatile unsigned int g_J1939State;
+void IsoTpTick();
+extern unsigned int g_IsoTpRequests;
+extern unsigned int g_IsoTpResponses;
+extern unsigned int g_IsoTpAborted;
+extern uint8_t g_J1939Address;
+extern unsigned int g_CANPollAnswered;
+extern unsigned int g_CANPollLatencyLast;
+extern unsigned int g_CANPollLatencyMax;
+void TransmitSyncFrame(unsigned int sequence, unsigned int phase);
+void ReceiveECANFrames(unsigned int phase);
+extern volatile bool g_ECANSyncQueued;
 
 #ifdef	__cplusplus
 }
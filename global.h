@@ -28,25 +28,28 @@ extern "C" {
 
 #define FP 40000000      // 40MHz FOSC/2
 #define FCAN    40000000   // FOSC/2 - 40MHz OSC Input, no PLL
-#define CAN_BITRATE  1000000
-#define CAN_NTQ 20
-#define CAN_BRP_VAL ((FCAN/ (2*CAN_NTQ*CAN_BITRATE))-1)
+#define CAN_BITRATE  1000000       // Default CAN bit rate (g_Config.CanBitrate, timing solved by ECANBitTiming())
 #define CAN_SID_1 0x400             // default SID for First ADC Packet
 #define CAN_SID_2 0x401             // default SID for Second ADC Packet
+#define ADC_AVERAGE_MAX_WINDOW 32   // Longest moving average window (samples) supported by g_ADCValuesBuffer
    
-    extern const unsigned int g_ADCBufferSize;
+    extern unsigned int g_ADCAverageWindow;
+    extern unsigned int g_ADCAverageDecimation;
+    extern unsigned long g_ADCAverageSum[];
     extern unsigned int g_CANSequenceNumber;
     extern unsigned int g_TimerSeconds;
     extern unsigned int g_TimerMS;
     extern unsigned int g_TimerMSTotal;
+    extern volatile unsigned long g_TimebaseSecondsUs;
+    extern unsigned long g_ADCTimestamp;
     extern unsigned int g_ADCValues[];
-    extern unsigned int g_ADCValuesBuffer[8][10];
+    extern unsigned int g_ADCMillivolts[];
+    extern int g_ADCEngineering[];
+    extern unsigned int g_ADCValuesBuffer[ADC_AVERAGE_MAX_WINDOW+1][8];
     extern unsigned int g_ADCValuesBufferIndex;
     extern unsigned int g_ADC5VReferenceRaw;
     extern unsigned int g_TimerSeconds;
     extern unsigned int g_TimerMS;
-    extern unsigned int g_CANPacket1[];
-    extern unsigned int g_CANPacket2[];
     extern unsigned int g_ADCCaptureTime;
     extern unsigned int g_ADCCaptures;
     extern unsigned int g_InterruptTime;
@@ -60,11 +63,24 @@ extern "C" {
     extern unsigned int g_ECANIVRIF;
     extern unsigned int g_ECANInterrupts;
     extern unsigned int g_ECANTransmitTimout;
+    extern unsigned int g_ECANTransmitBusy;
     extern unsigned int g_TimerInterruptOverrun;
     extern unsigned int g_DMAInterrupts;
     extern unsigned int g_UARTReceiveErrors;           
     extern unsigned int g_UARTReceiveOverflowErrors;   
     extern unsigned int g_EnableADCCapture; 
+    extern unsigned int g_ADCAcquisitionMode;
+    extern volatile unsigned int g_ADCScanBlocks;
+    extern volatile unsigned int g_ADCScanBlockReady;
+    extern unsigned int g_ADCScanMissedBlocks;
+    extern unsigned int g_ADCFilterMode;
+    extern unsigned int g_ADCUpdatedChannels;
+    extern unsigned int g_CANFramesPerSecond;
+    extern unsigned int g_CANBusLoad;
+    extern unsigned int g_CANPacketsSuppressed;
+    extern unsigned int g_ADCSampleTime[];
+    extern unsigned int g_ADCVCCFiltered;
+    extern unsigned int g_ADCRatiometricGain;
 
 
 
@@ -160,6 +160,7 @@
 #include "global.h"
 #include "adc.h"
 #include "ecan.h"
+#include "timer1.h"
 
 unsigned int l_TimerInterruptCount = 0;
 /*
@@ -176,8 +177,17 @@ void __attribute__((interrupt, no_auto_psv)) _T1Interrupt(void)
     unsigned int stoptime;
 
     // Interrupt Counter increments from 0-9.  This is used to select what functions get invoked in a particular interrupt.
-    // ADC data collection occurs every cycle (1000hz), but data transmission over CAN only happens every 10th cycle (100hz)
+    // ADC data collection occurs every cycle (1000hz).  Data transmission over CAN happens whenever the decimation filters
+    // produce new values (100hz by default, per channel rates in ADC_FILTER_CIC mode).
     l_TimerInterruptCount = (l_TimerInterruptCount + 1 ) % 10;
+
+    // Multi-node sync: send the SYNC frame (master) or set this period's length (slave).
+    SyncTick();
+
+    // J1939 address claim and transport protocol (nothing in CAN_ID_STANDARD mode).
+    J1939Tick();
+    // ISO-TP requests and responses.
+    IsoTpTick();
             
     // Update System Timestamp Variables used for diagnostics, plus with will flash the LED every second.
     g_TimerMS += 1;
@@ -186,6 +196,7 @@ void __attribute__((interrupt, no_auto_psv)) _T1Interrupt(void)
         g_TimerMS = 0;
         g_TimerSeconds++;
         PORTAbits.RA3 = !PORTAbits.RA3;
+        UpdateCANBusLoad();
     }
     
     if (g_EnableADCCapture != 0)
@@ -193,11 +204,21 @@ void __attribute__((interrupt, no_auto_psv)) _T1Interrupt(void)
         // Collect the most current ADC Samples every timer1 cycle (1000hz)
         CollectAllADCSamples();
 
-        // If we are on the 10th interrupt cycle (so 100hz), lets build the CAN packets and transmit them.
-        if (l_TimerInterruptCount == 0)
+        // If any of the channels has a new decimated value, publish a consistent copy for the console before the values
+        // change again.
+        if (g_ADCUpdatedChannels != 0)
         {
-            BuildCANPackets();
-            TransmitCANPackets();
+            PublishADCSnapshot();
+        }
+        // The CAN packets that carry new values are built and sent.  This runs every tick, since in report by exception mode
+        // the refresh intervals and heartbeat need the time to pass even when nothing is new.
+        TransmitUpdatedCANPackets(g_ADCUpdatedChannels);
+        g_ADCUpdatedChannels = 0;
+
+        // A completed burst capture is drained one frame per tick, only when the regular packets have left the buffers.
+        if ((g_ADCCapture.State == ADC_CAPTURE_COMPLETE) && (g_ADCCapture.Drain == ADC_CAPTURE_DRAIN_CAN))
+        {
+            TransmitADCCaptureFrame();
         }
     
     }
@@ -225,6 +246,10 @@ void __attribute__((interrupt, no_auto_psv)) _T1Interrupt(void)
 */
 void __attribute__((interrupt, no_auto_psv))_C1Interrupt(void)
 {
+    // The Timer1 phase of the frame that just completed, for the sync (see SyncReceived()).  Read first so it has the same 
+    // latency on every node.
+    unsigned int phase = TMR1;
+
     // First thing to do is clear the interrupt flag.
     IFS2bits.C1IF = 0;
 
@@ -233,6 +258,19 @@ void __attribute__((interrupt, no_auto_psv))_C1Interrupt(void)
     {
         C1INTFbits.TBIF = 0;
         g_ECANTransmitCompleted++;
+        if (g_ECANSyncQueued && (C1TR67CONbits.TXREQ7 == 0))
+        {
+            g_ECANSyncQueued = false;
+            SyncTransmitted(phase);
+        }
+        // Buffers have been freed, so move more queued frames in.
+        ECANTransmitRefill();
+    }
+    // Received frames are in the FIFO.
+    if (C1INTFbits.RBIF)
+    {
+        C1INTFbits.RBIF = 0;
+        ReceiveECANFrames(phase);
     }
     // Multiple flags can be present, so we need to check all of them.   We now check to see if the error flag has been set.
     if (C1INTFbits.ERRIF)
@@ -270,16 +308,35 @@ void __attribute__((interrupt, no_auto_psv))_C1Interrupt(void)
         //  The CAN controller will continue to try to retransmit the same packet again and again.   Since we will be creating a continous 
         //  stream of packets, we will just cancel packets with transmisssion failures and let new packets be created by the default 
         //  process.   This prevents us flooding the CAN bus with a continous transmission if there is some problem.
-        //  For simplicity, lets just clear both of the 2 message slots.
+        //  The frames still in the transmit queue go out with the next refill.
 
-        C1TR01CONbits.TXREQ0 = 0;
-        C1TR01CONbits.TXREQ1 = 0;
+        ECANTransmitAbort();
     }
     // Diagnostic counter
     g_ECANInterrupts++;
 
 }
 
+/*
+*   _T3Interrupt(void) - Interrupt handler for Timer 3.  Only enabled for the one ADC scan slot that ADCScanTimerShift() 
+*                        lengthened or shortened, and restores the normal period at its end.
+*/
+void __attribute__((interrupt, no_auto_psv))_T3Interrupt(void)
+{
+    IFS0bits.T3IF = 0;
+    ADCScanTimerRestore();
+}
+
+/*
+*   _T5Interrupt(void) - Interrupt handler for Timer 5.  Timer4/5 is the 32 bit microsecond timebase (see SetupTimebase() in 
+*                        timer1.c), and this interrupt occurs once a second when it rolls over.
+*/
+void __attribute__((interrupt, no_auto_psv))_T5Interrupt(void)
+{
+    IFS1bits.T5IF = 0;
+    g_TimebaseSecondsUs += 1000000UL;
+}
+
 /*
 *   _DMA0Interrupt(void) - Interrupt handler for DMA Channel 0.   This interrupt occurs at the completion of a DMA transfer as specifed in
 *                           DMA configuarion ( the count of size ).   We don't need this interrupt in production, but for developement we
@@ -294,7 +351,16 @@ void __attribute__((interrupt, no_auto_psv))_DMA0Interrupt(void)
 
 }
 
-
-
-
-
+/*
+*   _DMA1Interrupt(void) - Interrupt handler for DMA Channel 1.   DMA1 moves ADC scan results into the adc1ScanBufA/B ping-pong 
+*                           buffers (ADC_MODE_DMA_SCAN), and this interrupt occurs each time one of those blocks is full.  The DMA
+*                           has already switched to the other buffer, so the one not selected by PPST1 is the completed block.
+*/
+void __attribute__((interrupt, no_auto_psv))_DMA1Interrupt(void)
+{
+    // Clear the DMA1 Interrupt Flag
+    IFS0bits.DMA1IF = 0;
+    // PPST1 = 1 means DMA1STB is now selected, so buffer A (0) just completed.
+    g_ADCScanBlockReady = (DMACS1bits.PPST1 == 1) ? 0 : 1;
+    g_ADCScanBlocks++;
+}
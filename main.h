@@ -43,6 +43,7 @@
 void Console();
 void UpdateDiagnosticADCVariables();
 void DisplayStatus();
+void DisplayADCCapture();
 
 
 #ifdef	__cplusplus
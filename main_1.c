@@ -25,19 +25,22 @@
 /******************************************************************************/
 
 // START - Global Data
-//      Global Constants
-const unsigned int g_ADCBufferSize = 10;
 //      Global Data Storage
-unsigned int g_ADCValuesBuffer[8][10];           // Buffer used for storing the last 10 samples for each channel.  Used for decimation.
-unsigned int g_ADCValuesBufferIndex=0;           // Index into the above buffer. Points to location next sample should go.
+unsigned int g_ADCValuesBuffer[ADC_AVERAGE_MAX_WINDOW+1][8]; // Ring of the last samples, one row of 8 channels per capture.  Used for decimation.
+unsigned int g_ADCValuesBufferIndex=0;           // Index into the above buffer. Points to the row the next sample set should go in.
+unsigned int g_ADCAverageWindow = 10;            // Moving average window length in samples (see SetADCAverage())
+unsigned int g_ADCAverageDecimation = 10;        // A moving average is output every this many samples (10 = 100hz)
+unsigned long g_ADCAverageSum[8];                // Running sum of the samples in the moving average window, per channel
 unsigned int g_ADCValues[8] = {0,0,0,0,0,0,0,0}; // The post decimation ADC Values. These are the values to be sent over CAN (after conversion)
+unsigned int g_ADCMillivolts[8] = {0,0,0,0,0,0,0,0}; // g_ADCValues converted with the integer calibration in g_Config (see ADCCalibrate())
+int g_ADCEngineering[8] = {0,0,0,0,0,0,0,0};        // g_ADCMillivolts through each channel's linearization table (see ADCLinearize())
 unsigned int g_ADC5VReferenceRaw;                // The last 5V VCC measurement divided by 3. 
 unsigned int g_TimerSeconds = 0;                 // Current system timer (seconds)
 unsigned int g_TimerMS = 0;                      // Current system timer ms
 unsigned int g_TimerMSTotal = 0;
+volatile unsigned long g_TimebaseSecondsUs = 0;   // Whole seconds of the microsecond timebase, in us (see ReadTimebase())
+unsigned long g_ADCTimestamp = 0;                // Timebase (us) of the hold instant of channel 0 in the newest sample set
 unsigned int g_CANSequenceNumber = 0;
-uint16_t g_CANPacket1[8];                        // Buffer for final CAN message 1
-uint16_t g_CANPacket2[8];                        // Buffer for final CAN message 2
 
 //      Global Diagnostic Storage
 double ADCVoltage[8]={0,0,0,0,0,0,0};           // ADC values converted to voltage display. 
@@ -45,11 +48,14 @@ double ADCVoltageMin[8]={0,0,0,0,0,0,0};        // ADC minimum values (in voltag
 double ADCVoltageMax[8]={0,0,0,0,0,0,0};        // ADC maximum values (in voltage).  Cleared every 1000 displays.
 double ADCVoltageAvgSum[8]={0,0,0,0,0,0,0};     // ADC 'sum for average' values (in voltage).  Cleared every 1000 displays.
 unsigned int ADCVoltageAvgCount=0;              // Count of number of 'sums' in above 'sum for average' variable.  Rolls to 0 at 1000.
+unsigned long ConsoleClearTime=0;               // Timebase (us) of the last console clear screen
+st_ADCSnapshot ConsoleSnapshot;                 // Consistent copy of the ADC values and CAN counters used by the console (see ReadADCSnapshot())
 unsigned int g_ADCCaptureTime = 0;              // Max Number of timer1 (1.6us) ticks from start of timer1 interrupt to ADCs complete.
 unsigned int g_ADCCaptures=0;                   // Number of ADC captures completed (8 per sample interval)
 unsigned int g_InterruptTime=0;                 // Max Number of timer1 (1.6us) ticks from start of timer1 interrupt to timer1 int complete.
 unsigned int g_ECANTransmitTried = 0;           // Number of ECAN frames built for transmission and sent to CAN controller.
-unsigned int g_ECANTransmitTimout = 0;          // Number of timeouts waiting for transmission buffer to become available (should be 0)
+unsigned int g_ECANTransmitTimout = 0;          // Number of frames dropped because their transmit queue was full (should be 0)
+unsigned int g_ECANTransmitBusy = 0;            // Number of frames held back by a full transmit queue and retried later (bulk transfers)
 unsigned int g_ECANTransmitCompleted = 0;       // Number of completed CAN transmissions (from the CAN TX interrupt)
 unsigned int g_ECANError = 0;                   // Number of ECAN1 errors (from CAN Error Interrupt)
 unsigned int g_ECANTXBO = 0;                    // Number of ECAN1 'Transmitter Bus is Off State' errors (from CAN Error Interrupt)
@@ -64,12 +70,22 @@ unsigned int g_UARTReceiveErrors = 0;           // Number of UART1 receive error
 unsigned int g_UARTReceiveOverflowErrors = 0;   // Number of UART1 receive overflow errors
 
 unsigned int g_EnableADCCapture = 0;            // A flag used in the timer interrupt to enable ADC capture and processing.
+unsigned int g_ADCAcquisitionMode = ADC_MODE_DMA_SCAN;  // ADC_MODE_DMA_SCAN, or ADC_MODE_POLLED for the original busy-wait capture.
+volatile unsigned int g_ADCScanBlocks = 0;      // Number of ADC scan blocks completed by DMA1 (from the DMA1 interrupt)
+volatile unsigned int g_ADCScanBlockReady = 0;  // Which ping-pong half (0=A, 1=B) holds the last completed scan block
+unsigned int g_ADCScanMissedBlocks = 0;         // Number of Timer1 ticks that found no new scan block (should be 0)
+unsigned int g_ADCFilterMode = ADC_FILTER_CIC;  // ADC_FILTER_CIC (CIC + compensation, per channel rate), ADC_FILTER_FIR or ADC_FILTER_BOXCAR
+unsigned int g_ADCSampleTime[9];                // TMR1 count (1.6us) at the hold instant of each channel's last sample (entry 8 = +5VCC)
+unsigned int g_ADCVCCFiltered = 0;              // Low pass filtered +5VCC reference (raw ADC counts of 1/3 VCC)
+unsigned int g_ADCRatiometricGain = ADC_RATIOMETRIC_UNITY; // Q1.15 supply correction applied to the ratiometric channels
+unsigned int g_ADCUpdatedChannels = 0;          // Bit per channel, set when g_ADCValues[channel] gets a new value and cleared once sent over CAN
+unsigned int g_CANFramesPerSecond = 0;          // Frames this node sent over the last second (see UpdateCANBusLoad())
+unsigned int g_CANBusLoad = 0;                  // Bus load from this node's frames over the last second, in 0.1% units
+unsigned int g_CANPacketsSuppressed = 0;        // Packets with new values not sent because nothing moved beyond its deadband
 
 
 
-//      Global Calibration Data - These should be stored in the global config.
-const double caloffset[8]={5.0,5.0,5.0,5.0,5.0,5.0,5.0,5.0};
-const double calslope[8]={819.83,820.47,819.19,819.40,818.34,819.18,818.76,820.04};
+//      Global Configuration Data (including the per channel calibration used by ADCCalibrate())
 st_CAL g_Config;
 
 // END - Global Data
@@ -92,8 +108,14 @@ void StartupConfigurationPhase1()
     InitApp();
     // Once the pins are configured, we can set up the peripherals, starting with the serial port output.
     SetupUART1();
-    // Next up configure the analog to digital converter peripheral.
+    // Start the microsecond timebase, everything after this can be timestamped.
+    SetupTimebase();
+    // Next up configure the analog to digital converter peripheral (and its Timer3 trigger when scanning).
     SetupADC();
+    if (g_ADCAcquisitionMode == ADC_MODE_DMA_SCAN)
+    {
+        SetupADCScanTimer();
+    }
     // We still need to configure the timer and CAN device, but that will be done in phase 2.
 }
 
@@ -103,7 +125,11 @@ void StartupConfigurationPhase1()
  */
 void StartupConfigurationPhase2()
 {
-    // First lets configure the ECAN module.
+    // Load the decimation filters.  The per channel output rates come from the config, so this has to follow ConfigurationSystemInit()
+    SetupADCFilters();
+    // Arm the burst capture if one is configured (also from the config).
+    SetupADCCapture();
+    // Then lets configure the ECAN module.
     ConfigureECAN1();
     // Setup Timer1.  This function will both configure, and start timer 1.  Once timer1 starts, data collection and 
     // CAN transmission will happen
@@ -128,8 +154,8 @@ int16_t main(void)
     StartupConfigurationPhase2();
     
     // At this point, the system in functioning but ADC conversion and CAN output is not started.   
-    // We will output a startup frame over CAN to announce our presence.   In the future we should add autoconfiguration (detect
-    // other devices with identical configs and negotiate who is using what CAN IDs.
+    // We will output a startup frame over CAN to announce our presence.   In CAN_ID_J1939 mode this starts the J1939 address
+    // claim instead, which negotiates the node's source address with the other devices.
 
     TransmitECANStartupFrame();
     
@@ -163,8 +189,17 @@ void Console()
     // of the CAN IDs, formats, and calbrations.
     while(1)
     {
+        // Take one consistent copy of everything the ISR updates, so every line of the display is from the same cycle.
+        ReadADCSnapshot(&ConsoleSnapshot);
         UpdateDiagnosticADCVariables();
         DisplayStatus();
+        // A completed capture set to drain over the UART is printed here, outside the interrupt.
+        if ((g_ADCCapture.State == ADC_CAPTURE_COMPLETE) && (g_ADCCapture.Drain == ADC_CAPTURE_DRAIN_UART))
+        {
+            DisplayADCCapture();
+        }
+        // Commands received over CAN.
+        ProcessECANCommands();
         DelaymS(100);
         
     }
@@ -183,20 +218,8 @@ void UpdateDiagnosticADCVariables()
 
     for (i=0;i<=7;i++)
     {
-        unsigned int CalibratedValue;
-        //ADCVoltage[i]=((double)g_ADCValues[i]-caloffset[i])/calslope[i];
-        if (g_ADCValues[i]<=caloffset[i])
-        {
-            CalibratedValue=0;
-        }
-        else
-        {
-            CalibratedValue = g_ADCValues[i]-caloffset[i];
-        }
-        
-       
-        ADCVoltage[i]=(double)(CalibratedValue/calslope[i])+.01;
-        //ADCVoltage[i]=(double)(g_ADCValues[i]);
+        // The calibration is done in the interrupt (integer millivolts), so only the display conversion to volts is left here.
+        ADCVoltage[i]=ConsoleSnapshot.ADCMillivolts[i]/1000.0;
         
         // If ADCVoltageAvgCount is 0, this is the first time this routine has been called, or we are resetting  We will initialize all of the
         // diagnostic variables, set the count to one, and record the first value for the average sum array.
@@ -231,44 +254,44 @@ void DisplayStatus()
 
     // Every 1 min, we send a clear screen command, to help in debugging
     
-    if (g_TimerSeconds >60 )
+    if ((ReadTimebase() - ConsoleClearTime) > 60000000UL)
     {
-        g_TimerSeconds = 0;
+        ConsoleClearTime = ReadTimebase();
         sprintf(line,"%c[2J %c[H",27,27);
         syslog(line);
     }
 
-    double ADC5VReferenceV = ((g_ADC5VReferenceRaw*2.49)/4096.0)*3.0;
+    double ADC5VReferenceV = ((ConsoleSnapshot.ADC5VReferenceRaw*2.49)/4096.0)*3.0;
 
     sprintf(line,"%c[HADC-CAN Status\r\n",27);
     syslog(line);
     sprintf(line,"------------------------------------------\r\n" );
     syslog(line);
-    sprintf(line,"Timer:%u.%u %u\r\n",g_TimerSeconds,g_TimerMS,ADCVoltageAvgCount);
+    sprintf(line,"Timer:%u.%u %u  Sample Time: %010lu us\r\n",ConsoleSnapshot.TimerSeconds,ConsoleSnapshot.TimerMS,ADCVoltageAvgCount,ConsoleSnapshot.Timestamp);
     syslog(line);
     sprintf(line,"ADC Values          MAX     MIN     AVG\t\t\tCAN Status\r\n");
     syslog(line);
-    sprintf(line,"ADC0: %04u %+4.3fV %+4.3fV %+4.3fV %+4.3fV\t\tCAN TX: %05u\r\n",g_ADCValues[0],ADCVoltage[0],ADCVoltageMax[0],ADCVoltageMin[0],ADCVoltageAvgSum[0]/(double)ADCVoltageAvgCount,g_ECANTransmitCompleted);
+    sprintf(line,"ADC0: %04u %+4.3fV %+4.3fV %+4.3fV %+4.3fV\t\tCAN TX: %05u\r\n",ConsoleSnapshot.ADCValues[0],ADCVoltage[0],ADCVoltageMax[0],ADCVoltageMin[0],ADCVoltageAvgSum[0]/(double)ADCVoltageAvgCount,ConsoleSnapshot.ECANTransmitCompleted);
     syslog(line);
-    sprintf(line,"ADC1: %04u %+4.3fV %+4.3fV %+4.3fV %+4.3fV\t\tCAN TX Tried: %05u\r\n",g_ADCValues[1],ADCVoltage[1],ADCVoltageMax[1],ADCVoltageMin[1],ADCVoltageAvgSum[1]/(double)ADCVoltageAvgCount,g_ECANTransmitTried);
+    sprintf(line,"ADC1: %04u %+4.3fV %+4.3fV %+4.3fV %+4.3fV\t\tCAN TX Tried: %05u\r\n",ConsoleSnapshot.ADCValues[1],ADCVoltage[1],ADCVoltageMax[1],ADCVoltageMin[1],ADCVoltageAvgSum[1]/(double)ADCVoltageAvgCount,ConsoleSnapshot.ECANTransmitTried);
     syslog(line);
-    sprintf(line,"ADC2: %04u %+4.3fV %+4.3fV %+4.3fV %+4.3fV\t\tCAN TX Error BO: %05u\r\n",g_ADCValues[2],ADCVoltage[2],ADCVoltageMax[2],ADCVoltageMin[2],ADCVoltageAvgSum[2]/(double)ADCVoltageAvgCount,g_ECANTXBO);
+    sprintf(line,"ADC2: %04u %+4.3fV %+4.3fV %+4.3fV %+4.3fV\t\tCAN TX Error BO: %05u\r\n",ConsoleSnapshot.ADCValues[2],ADCVoltage[2],ADCVoltageMax[2],ADCVoltageMin[2],ADCVoltageAvgSum[2]/(double)ADCVoltageAvgCount,ConsoleSnapshot.ECANTXBO);
     syslog(line);
-    sprintf(line,"ADC3: %04u %+4.3fV %+4.3fV %+4.3fV %+4.3fV\t\tCAN TX Error BP: %05u\r\n",g_ADCValues[3],ADCVoltage[3],ADCVoltageMax[3],ADCVoltageMin[3],ADCVoltageAvgSum[3]/(double)ADCVoltageAvgCount,g_ECANTXBP);
+    sprintf(line,"ADC3: %04u %+4.3fV %+4.3fV %+4.3fV %+4.3fV\t\tCAN TX Error BP: %05u\r\n",ConsoleSnapshot.ADCValues[3],ADCVoltage[3],ADCVoltageMax[3],ADCVoltageMin[3],ADCVoltageAvgSum[3]/(double)ADCVoltageAvgCount,ConsoleSnapshot.ECANTXBP);
     syslog(line);
-    sprintf(line,"ADC4: %04u %+4.3fV %+4.3fV %+4.3fV %+4.3fV\t\tCAN TX Error WARN: %05u\r\n",g_ADCValues[4],ADCVoltage[4],ADCVoltageMax[4],ADCVoltageMin[4],ADCVoltageAvgSum[4]/(double)ADCVoltageAvgCount,g_ECANTXWAR);
+    sprintf(line,"ADC4: %04u %+4.3fV %+4.3fV %+4.3fV %+4.3fV\t\tCAN TX Error WARN: %05u\r\n",ConsoleSnapshot.ADCValues[4],ADCVoltage[4],ADCVoltageMax[4],ADCVoltageMin[4],ADCVoltageAvgSum[4]/(double)ADCVoltageAvgCount,ConsoleSnapshot.ECANTXWAR);
     syslog(line);
-    sprintf(line,"ADC5: %04u %+4.3fV %+4.3fV %+4.3fV %+4.3fV\t\tCAN TX Error IVRIF: %05u\r\n",g_ADCValues[5],ADCVoltage[5],ADCVoltageMax[5],ADCVoltageMin[5],ADCVoltageAvgSum[5]/(double)ADCVoltageAvgCount,g_ECANIVRIF);
+    sprintf(line,"ADC5: %04u %+4.3fV %+4.3fV %+4.3fV %+4.3fV\t\tCAN TX Error IVRIF: %05u\r\n",ConsoleSnapshot.ADCValues[5],ADCVoltage[5],ADCVoltageMax[5],ADCVoltageMin[5],ADCVoltageAvgSum[5]/(double)ADCVoltageAvgCount,ConsoleSnapshot.ECANIVRIF);
     syslog(line);
-    sprintf(line,"ADC6: %04u %+4.3fV %+4.3fV %+4.3fV %+4.3fV\t\tCAN TX Interrupts: %05u\r\n",g_ADCValues[6],ADCVoltage[6],ADCVoltageMax[6],ADCVoltageMin[6],ADCVoltageAvgSum[6]/(double)ADCVoltageAvgCount,g_ECANInterrupts);
+    sprintf(line,"ADC6: %04u %+4.3fV %+4.3fV %+4.3fV %+4.3fV\t\tCAN TX Interrupts: %05u\r\n",ConsoleSnapshot.ADCValues[6],ADCVoltage[6],ADCVoltageMax[6],ADCVoltageMin[6],ADCVoltageAvgSum[6]/(double)ADCVoltageAvgCount,ConsoleSnapshot.ECANInterrupts);
     syslog(line);
-    sprintf(line,"ADC7: %04u %+4.3fV %+4.3fV %+4.3fV %+4.3fV\t\tADC Interrupts: %05u\r\n",g_ADCValues[7],ADCVoltage[7],ADCVoltageMax[7],ADCVoltageMin[7],ADCVoltageAvgSum[7]/(double)ADCVoltageAvgCount,g_ADCCaptures);
+    sprintf(line,"ADC7: %04u %+4.3fV %+4.3fV %+4.3fV %+4.3fV\t\tADC Interrupts: %05u\r\n",ConsoleSnapshot.ADCValues[7],ADCVoltage[7],ADCVoltageMax[7],ADCVoltageMin[7],ADCVoltageAvgSum[7]/(double)ADCVoltageAvgCount,ConsoleSnapshot.ADCCaptures);
     syslog(line);
-    sprintf(line,"VCC5: %04u %+4.3fV\t\t\tCAN TX Timeouts: %05u\r\n",g_ADC5VReferenceRaw,ADC5VReferenceV,g_ECANTransmitTimout);
+    sprintf(line,"VCC5: %04u %+4.3fV\t\t\tCAN TX Dropped: %05u Busy: %05u \r\n",ConsoleSnapshot.ADC5VReferenceRaw,ADC5VReferenceV,ConsoleSnapshot.ECANTransmitTimout,ConsoleSnapshot.ECANTransmitBusy);
     syslog(line);
     sprintf(line,"%c[1m\r\n\r\nSystem Boots: %03u \r\n",27,g_Config.BootCount);
     syslog(line);
-    sprintf(line,"CAN ID1:%04x \t\t CAN ID2:%04x \r\n",g_Config.CanMessage1_ID, g_Config.CanMessage2_ID);
+    sprintf(line,"CAN ID1:%04x \t\t CAN ID2:%04x \t\t CAN ID3:%04x \r\n",g_Config.CanMessages[0].ID, g_Config.CanMessages[1].ID, g_Config.CanMessages[2].ID);
     syslog(line);
     sprintf(line,"ADC Capture Time: %05u TMR1 cycles (1.6us each) \r\n",g_ADCCaptureTime);
     syslog(line);
@@ -278,10 +301,61 @@ void DisplayStatus()
     syslog(line);
     sprintf(line,"DMA Interrupts: %05u\r\n",g_DMAInterrupts);
     syslog(line);    
-    sprintf(line,"CAN ERRIF Interrupts: %05u\r\n",g_ECANError);
+    sprintf(line,"ADC Mode: %s  Filter: %s  Scan Blocks: %05u  Missed: %05u\r\n",(g_ADCAcquisitionMode == ADC_MODE_DMA_SCAN) ? "DMA Scan" : (g_ADCAcquisitionMode == ADC_MODE_SIMULTANEOUS) ? "Sim/Seq " : "Polled  ",(g_ADCFilterMode == ADC_FILTER_CIC) ? "CIC   " : (g_ADCFilterMode == ADC_FILTER_FIR) ? "FIR   " : "Boxcar",g_ADCScanBlocks,g_ADCScanMissedBlocks);
+    syslog(line);    
+    sprintf(line,"CAN ERRIF Interrupts: %05u\r\n",ConsoleSnapshot.ECANError);
+    syslog(line);    
+    sprintf(line,"VCC Filtered: %04u  Ratiometric Gain: %1.4f  Channels: %02x\r\n",g_ADCVCCFiltered,g_ADCRatiometricGain/32768.0,g_Config.RatiometricChannels);
+    syslog(line);    
+    sprintf(line,"P-P:  %04u %04u %04u %04u %04u %04u %04u %04u\r\n",ConsoleSnapshot.ADCStats[0].Max-ConsoleSnapshot.ADCStats[0].Min,ConsoleSnapshot.ADCStats[1].Max-ConsoleSnapshot.ADCStats[1].Min,ConsoleSnapshot.ADCStats[2].Max-ConsoleSnapshot.ADCStats[2].Min,ConsoleSnapshot.ADCStats[3].Max-ConsoleSnapshot.ADCStats[3].Min,ConsoleSnapshot.ADCStats[4].Max-ConsoleSnapshot.ADCStats[4].Min,ConsoleSnapshot.ADCStats[5].Max-ConsoleSnapshot.ADCStats[5].Min,ConsoleSnapshot.ADCStats[6].Max-ConsoleSnapshot.ADCStats[6].Min,ConsoleSnapshot.ADCStats[7].Max-ConsoleSnapshot.ADCStats[7].Min);
+    syslog(line);    
+    sprintf(line,"RMS:  %04u %04u %04u %04u %04u %04u %04u %04u\r\n",ADCStatsRMS(&ConsoleSnapshot.ADCStats[0]),ADCStatsRMS(&ConsoleSnapshot.ADCStats[1]),ADCStatsRMS(&ConsoleSnapshot.ADCStats[2]),ADCStatsRMS(&ConsoleSnapshot.ADCStats[3]),ADCStatsRMS(&ConsoleSnapshot.ADCStats[4]),ADCStatsRMS(&ConsoleSnapshot.ADCStats[5]),ADCStatsRMS(&ConsoleSnapshot.ADCStats[6]),ADCStatsRMS(&ConsoleSnapshot.ADCStats[7]));
+    syslog(line);    
+    sprintf(line,"Spikes: %05u %05u %05u %05u %05u %05u %05u %05u  Prefilter: %02x\r\n",g_ADCPrefilterOutliers[0],g_ADCPrefilterOutliers[1],g_ADCPrefilterOutliers[2],g_ADCPrefilterOutliers[3],g_ADCPrefilterOutliers[4],g_ADCPrefilterOutliers[5],g_ADCPrefilterOutliers[6],g_ADCPrefilterOutliers[7],g_Config.PrefilterChannels);
+    syslog(line);    
+    sprintf(line,"CAN Report: %s  Frames/s: %04u  Load: %3u.%u%%  Suppressed: %05u\r\n",(g_Config.CanReportMode == CAN_REPORT_CHANGE) ? "Change  " : (g_Config.CanReportMode == CAN_REPORT_POLL) ? "Poll    " : "Periodic",g_CANFramesPerSecond,g_CANBusLoad/10,g_CANBusLoad%10,g_CANPacketsSuppressed);
+    syslog(line);    
+    sprintf(line,"CAN Polls: %05u  Latency: %05uus  Max: %05uus\r\n",g_CANPollAnswered,g_CANPollLatencyLast,g_CANPollLatencyMax);
+    syslog(line);    
+    sprintf(line,"CAN Bit Rate: %07lu  BRP: %02u  TQ: %u+%u+%u+%u  SJW: %u\r\n",g_Config.CanBitrate,g_Config.CanTiming.BRP,1,g_Config.CanTiming.PropSeg,g_Config.CanTiming.Phase1,g_Config.CanTiming.Phase2,g_Config.CanTiming.SJW);
+    syslog(line);    
+    sprintf(line,"Capture: %s  Completed: %05u\r\n",(g_ADCCapture.State == ADC_CAPTURE_ARMED) ? "Armed    " : (g_ADCCapture.State == ADC_CAPTURE_TRIGGERED) ? "Triggered" : (g_ADCCapture.State == ADC_CAPTURE_COMPLETE) ? "Draining " : "Idle     ",g_ADCCapture.Completed);
+    syslog(line);    
+    sprintf(line,"J1939: %s  Address: 0x%02x\r\n",(g_J1939State == J1939_STATE_CLAIMED) ? "Claimed     " : (g_J1939State == J1939_STATE_CLAIMING) ? "Claiming    " : (g_J1939State == J1939_STATE_CANNOT_CLAIM) ? "Cannot Claim" : "Off         ",g_J1939Address);
+    syslog(line);    
+    sprintf(line,"ISO-TP: Requests: %05u  Responses: %05u  Aborted: %05u\r\n",g_IsoTpRequests,g_IsoTpResponses,g_IsoTpAborted);
+    syslog(line);    
+    sprintf(line,"Sync: %s  Frames: %05u  Error: %+04d  Trim: %+1.4f\r\n",(g_Config.SyncMode == SYNC_MASTER) ? "Master" : (g_Config.SyncMode == SYNC_SLAVE) ? "Slave " : "Off   ",g_SyncFrames,g_SyncError,g_SyncTrim/65536.0);
     syslog(line);    
     sprintf(line,"%c[m%c[H",27,27);
     syslog(line);
       
     
 }
+
+/*
+ *      DisplayADCCapture() - Print a completed burst capture (ADC_CAPTURE_DRAIN_UART) below the status screen, one row per scan
+ *                            (100us apart) with the row number relative to the trigger, then release it so it can re-arm.
+ */
+void DisplayADCCapture()
+{
+    char line[100];
+    unsigned int row, column, index = 0;
+    int length;
+
+    sprintf(line,"\r\nCapture %u: Channels %02x  Trigger ch%u at %lu us  Rows %u (%u before)\r\n",g_ADCCapture.Completed,
+            g_ADCCapture.Channels,g_ADCCapture.TriggerChannel,g_ADCCapture.TriggerTime,g_ADCCapture.Rows,
+            g_ADCCapture.PreTriggerRows);
+    syslog(line);
+    for (row=0; row<g_ADCCapture.Rows; row++)
+    {
+        length = sprintf(line,"%+05d",(int)row - (int)g_ADCCapture.PreTriggerRows);
+        for (column=0; column<g_ADCCapture.ChannelCount; column++)
+        {
+            length += sprintf(&line[length]," %04u",ADCCaptureSample(index++));
+        }
+        sprintf(&line[length],"\r\n");
+        syslog(line);
+    }
+    ADCCaptureRelease();
+}
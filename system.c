@@ -154,6 +154,14 @@ void DelayuS(unsigned int d)
     }
 }
 
+/*
+*   SystemReset(void) - Restart the board with the RESET instruction, as a power up would (the configuration is read again).
+*/
+void SystemReset(void)
+{
+    asm volatile ("reset");
+}
+
 void syslog(char* logstring)
 {
     TransmitStringUART1(logstring);
@@ -20,4 +20,5 @@ void ConfigureOscillator(void); /* Handles clock switching/osc initialization */
 void InitApp(void);
 void DelaymS(unsigned int d);
 void DelayuS(unsigned int d);
+void SystemReset(void);
 void syslog(char* logstring);
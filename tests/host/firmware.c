@@ -0,0 +1,75 @@
+/* 
+ * File:   firmware.c
+ *
+ * What the host tests need from the rest of the firmware (main_1.c, EEPROM.c, system.c): the globals adc.c, ecan.c and
+ * timer1.c share, and do-nothing versions of the routines that only make sense on the board.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "global.h"
+#include "adc.h"
+#include "ecan.h"
+#include "timer1.h"
+#include "EEPROM.h"
+#include "system.h"
+
+st_CAL g_Config;
+
+unsigned int g_ADC5VReferenceRaw;
+unsigned int g_ADCAcquisitionMode = ADC_MODE_DMA_SCAN;
+unsigned int g_ADCAverageDecimation = 10;
+unsigned long g_ADCAverageSum[8];
+unsigned int g_ADCAverageWindow = 10;
+unsigned int g_ADCCaptureTime = 0;
+unsigned int g_ADCCaptures = 0;
+int g_ADCEngineering[8];
+unsigned int g_ADCFilterMode = ADC_FILTER_CIC;
+unsigned int g_ADCMillivolts[8];
+unsigned int g_ADCRatiometricGain = ADC_RATIOMETRIC_UNITY;
+unsigned int g_ADCSampleTime[9];
+volatile unsigned int g_ADCScanBlockReady = 0;
+volatile unsigned int g_ADCScanBlocks = 0;
+unsigned int g_ADCScanMissedBlocks = 0;
+unsigned long g_ADCTimestamp = 0;
+unsigned int g_ADCUpdatedChannels = 0;
+unsigned int g_ADCVCCFiltered = 0;
+unsigned int g_ADCValues[8];
+unsigned int g_ADCValuesBuffer[ADC_AVERAGE_MAX_WINDOW+1][8];
+unsigned int g_ADCValuesBufferIndex = 0;
+
+unsigned int g_CANBusLoad = 0;
+unsigned int g_CANFramesPerSecond = 0;
+unsigned int g_CANPacketsSuppressed = 0;
+unsigned int g_CANSequenceNumber = 0;
+unsigned int g_ECANError = 0;
+unsigned int g_ECANIVRIF = 0;
+unsigned int g_ECANInterrupts = 0;
+unsigned int g_ECANTXBO = 0;
+unsigned int g_ECANTXBP = 0;
+unsigned int g_ECANTXWAR = 0;
+unsigned int g_ECANTransmitBusy = 0;
+unsigned int g_ECANTransmitCompleted = 0;
+unsigned int g_ECANTransmitTimout = 0;
+unsigned int g_ECANTransmitTried = 0;
+
+volatile unsigned long g_TimebaseSecondsUs = 0;
+unsigned int g_TimerMS = 0;
+unsigned int g_TimerSeconds = 0;
+
+bool WriteConfig(st_CAL *Cal)
+{
+    return true;
+}
+
+void DelaymS(unsigned int d)
+{
+}
+
+void DelayuS(unsigned int d)
+{
+}
+
+void SystemReset(void)
+{
+}
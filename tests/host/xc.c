@@ -0,0 +1,94 @@
+/* 
+ * File:   xc.c
+ *
+ * The SFRs of the host stand-in device header (xc.h).
+ */
+
+#include <xc.h>
+
+volatile unsigned int C1TRCON[4];
+volatile unsigned int AD1CSSL;
+volatile unsigned int AD1PCFGL;
+volatile unsigned int ADC1BUF0;
+volatile unsigned int ADC1BUF1;
+volatile unsigned int ADC1BUF2;
+volatile unsigned int ADC1BUF3;
+volatile unsigned int C1RXD;
+volatile unsigned int C1TXD;
+volatile unsigned int C1RXF5EID;
+volatile unsigned int C1RXF6EID;
+volatile unsigned int C1RXF7EID;
+volatile unsigned int C1RXM1EID;
+volatile unsigned int C1RXFUL1;
+volatile unsigned int C1RXFUL2;
+volatile unsigned int C1RXOVF1;
+volatile unsigned int C1RXOVF2;
+volatile unsigned int DMA0CON;
+volatile unsigned int DMA0CNT;
+volatile unsigned int DMA0PAD;
+volatile unsigned int DMA0REQ;
+volatile unsigned int DMA0STA;
+volatile unsigned int DMA1CON;
+volatile unsigned int DMA1CNT;
+volatile unsigned int DMA1PAD;
+volatile unsigned int DMA1REQ;
+volatile unsigned int DMA1STA;
+volatile unsigned int DMA1STB;
+volatile unsigned int DMA2CON;
+volatile unsigned int DMA2CNT;
+volatile unsigned int DMA2PAD;
+volatile unsigned int DMA2REQ;
+volatile unsigned int DMA2STA;
+volatile unsigned int DMACS0;
+volatile unsigned int PR1;
+volatile unsigned int PR3;
+volatile unsigned int PR4;
+volatile unsigned int PR5;
+volatile unsigned int TMR1;
+volatile unsigned int TMR3;
+volatile unsigned int TMR4;
+volatile unsigned int TMR5;
+volatile unsigned int TMR5HLD;
+volatile AD1CHS0BITS AD1CHS0bits;
+volatile AD1CHS123BITS AD1CHS123bits;
+volatile AD1CON1BITS AD1CON1bits;
+volatile AD1CON2BITS AD1CON2bits;
+volatile AD1CON3BITS AD1CON3bits;
+volatile C1BUFPNT1BITS C1BUFPNT1bits;
+volatile C1BUFPNT2BITS C1BUFPNT2bits;
+volatile C1CFG1BITS C1CFG1bits;
+volatile C1CFG2BITS C1CFG2bits;
+volatile C1CTRL1BITS C1CTRL1bits;
+volatile C1FCTRLBITS C1FCTRLbits;
+volatile C1FEN1BITS C1FEN1bits;
+volatile C1FIFOBITS C1FIFObits;
+volatile C1FMSKSEL1BITS C1FMSKSEL1bits;
+volatile C1INTEBITS C1INTEbits;
+volatile C1RXF0SIDBITS C1RXF0SIDbits;
+volatile C1RXF1SIDBITS C1RXF1SIDbits;
+volatile C1RXF2SIDBITS C1RXF2SIDbits;
+volatile C1RXF3SIDBITS C1RXF3SIDbits;
+volatile C1RXF4SIDBITS C1RXF4SIDbits;
+volatile C1RXF5SIDBITS C1RXF5SIDbits;
+volatile C1RXF6SIDBITS C1RXF6SIDbits;
+volatile C1RXF7SIDBITS C1RXF7SIDbits;
+volatile C1RXM0SIDBITS C1RXM0SIDbits;
+volatile C1RXM1SIDBITS C1RXM1SIDbits;
+volatile C1TR67CONBITS C1TR67CONbits;
+volatile CORCONBITS CORCONbits;
+volatile DMA0CONBITS DMA0CONbits;
+volatile DMA1CONBITS DMA1CONbits;
+volatile DMA2CONBITS DMA2CONbits;
+volatile IEC0BITS IEC0bits;
+volatile IEC1BITS IEC1bits;
+volatile IEC2BITS IEC2bits;
+volatile IFS0BITS IFS0bits;
+volatile IFS1BITS IFS1bits;
+volatile IPC0BITS IPC0bits;
+volatile IPC2BITS IPC2bits;
+volatile IPC3BITS IPC3bits;
+volatile IPC7BITS IPC7bits;
+volatile T1CONBITS T1CONbits;
+volatile T3CONBITS T3CONbits;
+volatile T4CONBITS T4CONbits;
+volatile T5CONBITS T5CONbits;
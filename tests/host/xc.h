@@ -0,0 +1,157 @@
+/* 
+ * File:   xc.h
+ *
+ * Host stand-in for the XC16 device header (dsPIC33FJ128GP802), so adc.c, ecan.c and timer1.c build with gcc for the
+ * tests in this directory.  Every SFR the firmware uses is a plain variable (see xc.c) and every bit structure has just the
+ * fields it uses, each a whole unsigned int.  Nothing happens when one is written: the tests set them and read them back.
+ * Note that int is 32 bits on the host, so the tests only cover code that doesn't rely on the 16 bit int of the dsPIC.
+ */
+
+#ifndef XC_H
+#define	XC_H
+
+#include <stdint.h>
+
+#define Nop()
+#define ClrWdt()
+
+#define __builtin_disi(cycles)
+#define __builtin_dmaoffset(p)      ((unsigned int)(uintptr_t)(p))
+#define __builtin_divud(n, d)       ((unsigned int)((unsigned long)(n) / (unsigned int)(d)))
+#define __builtin_muluu(a, b)       ((unsigned long)(unsigned int)(a) * (unsigned int)(b))
+
+// C1TR01CON..C1TR67CON are consecutive registers on the device (ecan.c indexes their bytes), so they share an array here.
+extern volatile unsigned int C1TRCON[4];
+#define C1TR01CON                   C1TRCON[0]
+
+extern volatile unsigned int AD1CSSL;
+extern volatile unsigned int AD1PCFGL;
+extern volatile unsigned int ADC1BUF0;
+extern volatile unsigned int ADC1BUF1;
+extern volatile unsigned int ADC1BUF2;
+extern volatile unsigned int ADC1BUF3;
+extern volatile unsigned int C1RXD;
+extern volatile unsigned int C1TXD;
+extern volatile unsigned int C1RXF5EID;
+extern volatile unsigned int C1RXF6EID;
+extern volatile unsigned int C1RXF7EID;
+extern volatile unsigned int C1RXM1EID;
+extern volatile unsigned int C1RXFUL1;
+extern volatile unsigned int C1RXFUL2;
+extern volatile unsigned int C1RXOVF1;
+extern volatile unsigned int C1RXOVF2;
+extern volatile unsigned int DMA0CON;
+extern volatile unsigned int DMA0CNT;
+extern volatile unsigned int DMA0PAD;
+extern volatile unsigned int DMA0REQ;
+extern volatile unsigned int DMA0STA;
+extern volatile unsigned int DMA1CON;
+extern volatile unsigned int DMA1CNT;
+extern volatile unsigned int DMA1PAD;
+extern volatile unsigned int DMA1REQ;
+extern volatile unsigned int DMA1STA;
+extern volatile unsigned int DMA1STB;
+extern volatile unsigned int DMA2CON;
+extern volatile unsigned int DMA2CNT;
+extern volatile unsigned int DMA2PAD;
+extern volatile unsigned int DMA2REQ;
+extern volatile unsigned int DMA2STA;
+extern volatile unsigned int DMACS0;
+extern volatile unsigned int PR1;
+extern volatile unsigned int PR3;
+extern volatile unsigned int PR4;
+extern volatile unsigned int PR5;
+extern volatile unsigned int TMR1;
+extern volatile unsigned int TMR3;
+extern volatile unsigned int TMR4;
+extern volatile unsigned int TMR5;
+extern volatile unsigned int TMR5HLD;
+
+typedef struct { unsigned CH0NA; unsigned CH0SA; } AD1CHS0BITS;
+extern volatile AD1CHS0BITS AD1CHS0bits;
+typedef struct { unsigned CH123NA; unsigned CH123SA; } AD1CHS123BITS;
+extern volatile AD1CHS123BITS AD1CHS123bits;
+typedef struct { unsigned AD12B; unsigned ADDMABM; unsigned ADON; unsigned ASAM; unsigned DONE; unsigned FORM; unsigned SAMP; unsigned SIMSAM; unsigned SSRC; } AD1CON1BITS;
+extern volatile AD1CON1BITS AD1CON1bits;
+typedef struct { unsigned CHPS; unsigned CSCNA; unsigned SMPI; unsigned VCFG; } AD1CON2BITS;
+extern volatile AD1CON2BITS AD1CON2bits;
+typedef struct { unsigned ADRC; unsigned SAMC; } AD1CON3BITS;
+extern volatile AD1CON3BITS AD1CON3bits;
+typedef struct { unsigned F0BP; unsigned F1BP; unsigned F2BP; unsigned F3BP; } C1BUFPNT1BITS;
+extern volatile C1BUFPNT1BITS C1BUFPNT1bits;
+typedef struct { unsigned F4BP; unsigned F5BP; unsigned F6BP; unsigned F7BP; } C1BUFPNT2BITS;
+extern volatile C1BUFPNT2BITS C1BUFPNT2bits;
+typedef struct { unsigned BRP; unsigned SJW; } C1CFG1BITS;
+extern volatile C1CFG1BITS C1CFG1bits;
+typedef struct { unsigned PRSEG; unsigned SAM; unsigned SEG1PH; unsigned SEG2PH; unsigned SEG2PHTS; } C1CFG2BITS;
+extern volatile C1CFG2BITS C1CFG2bits;
+typedef struct { unsigned OPMODE; unsigned REQOP; unsigned WIN; } C1CTRL1BITS;
+extern volatile C1CTRL1BITS C1CTRL1bits;
+typedef struct { unsigned DMABS; unsigned FSA; } C1FCTRLBITS;
+extern volatile C1FCTRLBITS C1FCTRLbits;
+typedef struct { unsigned FLTEN0; unsigned FLTEN1; unsigned FLTEN2; unsigned FLTEN3; unsigned FLTEN4; unsigned FLTEN5; unsigned FLTEN6; unsigned FLTEN7; } C1FEN1BITS;
+extern volatile C1FEN1BITS C1FEN1bits;
+typedef struct { unsigned FNRB; } C1FIFOBITS;
+extern volatile C1FIFOBITS C1FIFObits;
+typedef struct { unsigned F0MSK; unsigned F1MSK; unsigned F2MSK; unsigned F3MSK; unsigned F4MSK; unsigned F5MSK; unsigned F6MSK; unsigned F7MSK; } C1FMSKSEL1BITS;
+extern volatile C1FMSKSEL1BITS C1FMSKSEL1bits;
+typedef struct { unsigned ERRIE; unsigned RBIE; unsigned TBIE; } C1INTEBITS;
+extern volatile C1INTEBITS C1INTEbits;
+typedef struct { unsigned EXIDE; unsigned SID; } C1RXF0SIDBITS;
+extern volatile C1RXF0SIDBITS C1RXF0SIDbits;
+typedef struct { unsigned EXIDE; unsigned SID; } C1RXF1SIDBITS;
+extern volatile C1RXF1SIDBITS C1RXF1SIDbits;
+typedef struct { unsigned EXIDE; unsigned SID; } C1RXF2SIDBITS;
+extern volatile C1RXF2SIDBITS C1RXF2SIDbits;
+typedef struct { unsigned EXIDE; unsigned SID; } C1RXF3SIDBITS;
+extern volatile C1RXF3SIDBITS C1RXF3SIDbits;
+typedef struct { unsigned EXIDE; unsigned SID; } C1RXF4SIDBITS;
+extern volatile C1RXF4SIDBITS C1RXF4SIDbits;
+typedef struct { unsigned EID; unsigned EXIDE; unsigned SID; } C1RXF5SIDBITS;
+extern volatile C1RXF5SIDBITS C1RXF5SIDbits;
+typedef struct { unsigned EID; unsigned EXIDE; unsigned SID; } C1RXF6SIDBITS;
+extern volatile C1RXF6SIDBITS C1RXF6SIDbits;
+typedef struct { unsigned EID; unsigned EXIDE; unsigned SID; } C1RXF7SIDBITS;
+extern volatile C1RXF7SIDBITS C1RXF7SIDbits;
+typedef struct { unsigned MIDE; unsigned SID; } C1RXM0SIDBITS;
+extern volatile C1RXM0SIDBITS C1RXM0SIDbits;
+typedef struct { unsigned EID; unsigned MIDE; unsigned SID; } C1RXM1SIDBITS;
+extern volatile C1RXM1SIDBITS C1RXM1SIDbits;
+typedef struct { unsigned TX7PRI; unsigned TXEN7; unsigned TXREQ7; } C1TR67CONBITS;
+extern volatile C1TR67CONBITS C1TR67CONbits;
+typedef struct { unsigned ACCSAT; unsigned IF; unsigned RND; unsigned SATA; unsigned US; } CORCONBITS;
+extern volatile CORCONBITS CORCONbits;
+typedef struct { unsigned CHEN; } DMA0CONBITS;
+extern volatile DMA0CONBITS DMA0CONbits;
+typedef struct { unsigned CHEN; } DMA1CONBITS;
+extern volatile DMA1CONBITS DMA1CONbits;
+typedef struct { unsigned CHEN; } DMA2CONBITS;
+extern volatile DMA2CONBITS DMA2CONbits;
+typedef struct { unsigned DMA0IE; unsigned DMA1IE; unsigned T1IE; unsigned T3IE; } IEC0BITS;
+extern volatile IEC0BITS IEC0bits;
+typedef struct { unsigned T5IE; } IEC1BITS;
+extern volatile IEC1BITS IEC1bits;
+typedef struct { unsigned C1IE; } IEC2BITS;
+extern volatile IEC2BITS IEC2bits;
+typedef struct { unsigned AD1IF; unsigned DMA1IF; unsigned T1IF; unsigned T3IF; } IFS0BITS;
+extern volatile IFS0BITS IFS0bits;
+typedef struct { unsigned T5IF; } IFS1BITS;
+extern volatile IFS1BITS IFS1bits;
+typedef struct { unsigned T1IP; } IPC0BITS;
+extern volatile IPC0BITS IPC0bits;
+typedef struct { unsigned T3IP; } IPC2BITS;
+extern volatile IPC2BITS IPC2bits;
+typedef struct { unsigned DMA1IP; } IPC3BITS;
+extern volatile IPC3BITS IPC3bits;
+typedef struct { unsigned T5IP; } IPC7BITS;
+extern volatile IPC7BITS IPC7bits;
+typedef struct { unsigned TCKPS; unsigned TCS; unsigned TGATE; unsigned TON; } T1CONBITS;
+extern volatile T1CONBITS T1CONbits;
+typedef struct { unsigned TCKPS; unsigned TCS; unsigned TGATE; unsigned TON; } T3CONBITS;
+extern volatile T3CONBITS T3CONbits;
+typedef struct { unsigned T32; unsigned TCKPS; unsigned TCS; unsigned TGATE; unsigned TON; } T4CONBITS;
+extern volatile T4CONBITS T4CONbits;
+typedef struct { unsigned TON; } T5CONBITS;
+extern volatile T5CONBITS T5CONbits;
+
+#endif	/* XC_H */
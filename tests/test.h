@@ -0,0 +1,28 @@
+/* 
+ * File:   test.h
+ *
+ * Checks for the host tests.  A failed CHECK() prints where it was and the test carries on; TestResult() reports the total
+ * and gives main()'s return value.
+ */
+
+#ifndef TEST_H
+#define	TEST_H
+
+#include <stdio.h>
+
+static unsigned int l_TestChecks = 0;
+static unsigned int l_TestFailures = 0;
+
+#define CHECK(condition) \
+    do { l_TestChecks++; if (!(condition)) { l_TestFailures++; printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); } } while (0)
+#define CHECK_EQUAL(expected, actual) \
+    do { long e_ = (long)(expected), a_ = (long)(actual); l_TestChecks++; \
+         if (e_ != a_) { l_TestFailures++; printf("%s:%d: %s is %ld, expected %ld\n", __FILE__, __LINE__, #actual, a_, e_); } } while (0)
+
+static int TestResult(const char* name)
+{
+    printf("%s: %u checks, %u failed\n", name, l_TestChecks, l_TestFailures);
+    return (l_TestFailures == 0) ? 0 : 1;
+}
+
+#endif	/* TEST_H */
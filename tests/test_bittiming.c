@@ -0,0 +1,117 @@
+/* 
+ * File:   test_bittiming.c
+ *
+ * ECANBitTiming() against the table of solutions in ecan.h, and the limits ECANBitTimingValid() holds every timing to.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include "test.h"
+#include "global.h"
+#include "ecan.h"
+
+typedef struct {
+    unsigned long Bitrate;
+    unsigned int SamplePoint;
+    st_CANBitTiming Timing;     // BRP, PropSeg, Phase1, Phase2, SJW
+} st_BitTimingCase;
+
+// The table in ecan.h, row for row.
+static const st_BitTimingCase l_Table[] = {
+    {1000000, 70, {0, 5, 8, 6, 4}},
+    {1000000, 80, {0, 7, 8, 4, 4}},
+    { 800000, 75, {0, 8, 8, 8, 4}},
+    { 500000, 87, {1, 8, 8, 3, 3}},
+    { 250000, 87, {4, 5, 8, 2, 2}},
+    { 125000, 87, {9, 5, 8, 2, 2}},
+    {  33333, 75, {29, 6, 8, 5, 4}},
+};
+
+static void TestTable()
+{
+    st_CANBitTiming timing;
+    const st_BitTimingCase* row;
+    unsigned int n;
+
+    for (n=0; n<sizeof(l_Table)/sizeof(l_Table[0]); n++)
+    {
+        row = &l_Table[n];
+        printf("  %7lu bit/s %u%%\n", row->Bitrate, row->SamplePoint);
+        CHECK(ECANBitTiming(row->Bitrate, row->SamplePoint, &timing));
+        CHECK_EQUAL(row->Timing.BRP, timing.BRP);
+        CHECK_EQUAL(row->Timing.PropSeg, timing.PropSeg);
+        CHECK_EQUAL(row->Timing.Phase1, timing.Phase1);
+        CHECK_EQUAL(row->Timing.Phase2, timing.Phase2);
+        CHECK_EQUAL(row->Timing.SJW, timing.SJW);
+        CHECK(ECANBitTimingValid(&timing, row->Bitrate));
+    }
+}
+
+static void TestNoSolution()
+{
+    st_CANBitTiming timing = {1, 2, 3, 4, 1};
+
+    CHECK(!ECANBitTiming(0, 75, &timing));
+    CHECK(!ECANBitTiming(500000, 101, &timing));
+    // Too slow for 25 TQ of the largest prescaler, and too fast for 8 TQ of the smallest.
+    CHECK(!ECANBitTiming(10000, 75, &timing));
+    CHECK(!ECANBitTiming(3000000, 75, &timing));
+    // Left alone.
+    CHECK_EQUAL(1, timing.BRP);
+    CHECK_EQUAL(2, timing.PropSeg);
+    CHECK_EQUAL(3, timing.Phase1);
+    CHECK_EQUAL(4, timing.Phase2);
+    CHECK_EQUAL(1, timing.SJW);
+}
+
+static void TestValid()
+{
+    st_CANBitTiming timing = {1, 8, 8, 3, 3};     // 500000 bit/s 85%
+
+    CHECK(ECANBitTimingValid(&timing, 500000));
+    CHECK(!ECANBitTimingValid(&timing, 250000));
+    timing.SJW = 4;                                // More than Phase2
+    CHECK(!ECANBitTimingValid(&timing, 500000));
+    timing.SJW = 3;
+    timing.PropSeg = 0;
+    CHECK(!ECANBitTimingValid(&timing, 500000));
+    timing.PropSeg = 8;
+    timing.Phase2 = 1;
+    CHECK(!ECANBitTimingValid(&timing, 500000));
+    timing = (st_CANBitTiming){4, 5, 8, 2, 2};     // 250000 bit/s
+    timing.BRP = ECAN_BRP_MAX + 1;
+    CHECK(!ECANBitTimingValid(&timing, 250000));
+}
+
+// Every solution for the usual rates across the sample points is a valid timing within the tolerance.
+static void TestSweep()
+{
+    const unsigned long bitrates[] = {1000000, 800000, 500000, 250000, 125000, 100000, 83333, 50000, 33333, 20000};
+    st_CANBitTiming timing;
+    unsigned int b, point;
+    unsigned int ntq;
+
+    for (b=0; b<sizeof(bitrates)/sizeof(bitrates[0]); b++)
+    {
+        for (point=50; point<=90; point++)
+        {
+            CHECK(ECANBitTiming(bitrates[b], point, &timing));
+            CHECK(ECANBitTimingValid(&timing, bitrates[b]));
+            // Within one TQ of the requested point unless the segment limits are in the way.
+            ntq = 1 + timing.PropSeg + timing.Phase1 + timing.Phase2;
+            if ((timing.Phase1 < ECAN_SEGMENT_MAX) && (timing.Phase2 > ECAN_PHASE2_MIN) && (timing.Phase2 < ECAN_SEGMENT_MAX))
+            {
+                CHECK(abs((int)((ntq - timing.Phase2) * 100) - (int)(point * ntq)) <= 100);
+            }
+        }
+    }
+}
+
+int main()
+{
+    TestTable();
+    TestNoSolution();
+    TestValid();
+    TestSweep();
+    return TestResult("test_bittiming");
+}
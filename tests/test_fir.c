@@ -0,0 +1,165 @@
+/* 
+ * File:   test_fir.c
+ *
+ * ADCFIRDotProduct() (the C reference of the DSP MAC version) and the FIR decimator around it (ADCFIRPut()), against 
+ * hand worked Q15 results and known waveforms through the default taps.
+ */
+
+#include <math.h>
+#include "test.h"
+#include "adc.h"
+
+// SAC.R of a dot product worked out independently: 2 * sum(x * h) rounded at bit 15 and returned from bit 16.
+static long ExpectedDotProduct(const int* x, const int* h, unsigned int n)
+{
+    long long acc = 0;
+    unsigned int i;
+
+    for (i=0; i<n; i++)
+    {
+        acc += 2LL * x[i] * h[i];
+    }
+    return (long)floor((acc + 32768.0) / 65536.0);
+}
+
+static void TestDotProduct()
+{
+    int half[2] = {16384, 16384};
+    int one[1] = {1};
+    int minusone[1] = {-1};
+    int quarter[1] = {8192};
+    int full[16];
+    int fullx[16];
+    int mixedx[4] = {1000, -2000, 3000, -4000};
+    int mixedh[4] = {-32768, 16384, 8192, -1};
+    unsigned int i;
+
+    // 0.5 * 0.5 + 0.5 * 0.5 = 0.5
+    CHECK_EQUAL(16384, ADCFIRDotProduct(half, half, 2));
+    // Half an LSB rounds up (conventional rounding), so 1 * 0.5 gives 1 and -1 * 0.5 gives 0.
+    CHECK_EQUAL(1, ADCFIRDotProduct(one, &half[0], 1));
+    CHECK_EQUAL(0, ADCFIRDotProduct(minusone, &half[0], 1));
+    // Below half an LSB rounds down: 1 * 0.25 gives 0.
+    CHECK_EQUAL(0, ADCFIRDotProduct(one, quarter, 1));
+    // A 12 bit sample through a unity tap keeps its value.
+    full[0] = 32767;
+    fullx[0] = 4095;
+    CHECK_EQUAL(4095, ADCFIRDotProduct(fullx, full, 1));
+    // Out of range taps saturate the result at 16 bits.
+    for (i=0; i<16; i++)
+    {
+        full[i] = 32767;
+        fullx[i] = 32767;
+    }
+    CHECK_EQUAL(32767, ADCFIRDotProduct(fullx, full, 16));
+    for (i=0; i<16; i++)
+    {
+        fullx[i] = -32768;
+    }
+    CHECK_EQUAL(-32768, ADCFIRDotProduct(fullx, full, 16));
+    // Signed samples and taps: -1000 - 1000 + 750 + 0.12 = -1249.88, rounded to -1250.
+    CHECK_EQUAL(-1250, ADCFIRDotProduct(mixedx, mixedh, 4));
+    CHECK_EQUAL(ExpectedDotProduct(mixedx, mixedh, 4), ADCFIRDotProduct(mixedx, mixedh, 4));
+}
+
+static void TestDefaultTaps()
+{
+    unsigned int output;
+    unsigned int outputs;
+    unsigned int n;
+    long sum = 0;
+    double history[16] = {0};
+    double expected;
+    double x;
+    unsigned int i;
+
+    for (i=0; i<16; i++)
+    {
+        sum += g_ADCFIRDefaultTaps[i];
+    }
+    CHECK_EQUAL(32766, sum);
+
+    // DC: once the history is full every output is the input.
+    CHECK(ADCFIRInit(0, g_ADCFIRDefaultTaps, 16, 10));
+    outputs = 0;
+    for (n=0; n<200; n++)
+    {
+        if (ADCFIRPut(0, 1000, &output))
+        {
+            outputs++;
+            if (n >= 16)
+            {
+                CHECK_EQUAL(1000, output);
+            }
+        }
+    }
+    CHECK_EQUAL(20, outputs);
+
+    // A tone at half the sample rate on top of 2048: the taps are symmetric with an even count, so it cancels exactly.
+    CHECK(ADCFIRInit(1, g_ADCFIRDefaultTaps, 16, 10));
+    for (n=0; n<200; n++)
+    {
+        if (ADCFIRPut(1, (n & 1) ? 1048 : 3048, &output) && (n >= 16))
+        {
+            CHECK_EQUAL(2048, output);
+        }
+    }
+
+    // A 10hz sine (inside the 40hz pass band) against the same filter in double precision, within the rounding of the 
+    // samples and of the result.
+    CHECK(ADCFIRInit(2, g_ADCFIRDefaultTaps, 16, 10));
+    for (n=0; n<1000; n++)
+    {
+        x = floor(2048.0 + 1500.0 * sin(2.0 * M_PI * 10.0 * n / 1000.0) + 0.5);
+        for (i=15; i>0; i--)
+        {
+            history[i] = history[i-1];
+        }
+        history[0] = x;
+        if (ADCFIRPut(2, (unsigned int)x, &output) && (n >= 16))
+        {
+            expected = 0;
+            for (i=0; i<16; i++)
+            {
+                expected += history[i] * g_ADCFIRDefaultTaps[i] / 32768.0;
+            }
+            CHECK(fabs(expected - output) <= 1.0);
+        }
+    }
+}
+
+static void TestTapOrder()
+{
+    // The taps run from the oldest sample to the newest, so the last entry weights the newest sample.
+    int newest[4] = {0, 0, 0, 32767};
+    int oldest[4] = {32767, 0, 0, 0};
+    unsigned int output;
+    unsigned int n;
+
+    CHECK(ADCFIRInit(3, newest, 4, 1));
+    CHECK(ADCFIRInit(4, oldest, 4, 1));
+    for (n=0; n<20; n++)
+    {
+        CHECK(ADCFIRPut(3, 100 + (n * 10), &output));
+        CHECK_EQUAL(100 + (n * 10), output);
+        CHECK(ADCFIRPut(4, 100 + (n * 10), &output));
+        if (n >= 3)
+        {
+            CHECK_EQUAL(100 + ((n - 3) * 10), output);
+        }
+    }
+
+    // Out of range settings leave the channel alone.
+    CHECK(!ADCFIRInit(8, newest, 4, 1));
+    CHECK(!ADCFIRInit(0, newest, 0, 1));
+    CHECK(!ADCFIRInit(0, newest, ADC_FIR_MAX_TAPS + 1, 1));
+    CHECK(!ADCFIRInit(0, newest, 4, 0));
+}
+
+int main()
+{
+    TestDotProduct();
+    TestDefaultTaps();
+    TestTapOrder();
+    return TestResult("test_fir");
+}
@@ -0,0 +1,599 @@
+/*
+ * File:   test_isotp.c
+ *
+ * The ISO-TP server (IsoTpTick() and the ECAN interrupt's receive side) against a reference tester on a loopback bus.
+ * The tester's frames go in through ReceiveECANFrames() as the receive FIFO would deliver them, and each tick the bus
+ * sends what the transmit buffers hold, highest priority first, then refills them as the ECAN interrupt does.  Covers
+ * segmentation both ways, the tester's flow control (block size, STmin, WAIT, overflow) and the IsoTpTick() timeouts.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "test.h"
+#include "global.h"
+#include "adc.h"
+#include "ecan.h"
+#include "EEPROM.h"
+
+#define TESTER              0xF1
+#define NODE_COMMAND_ID     0x140       // CanCommand_ID, so the node's ISO-TP address is 0x40
+#define NODE                (NODE_COMMAND_ID & 0x7F)
+#define BUS_FRAMES_PER_TICK 8           // About what 500Kbit/s carries of 29 bit frames in 1ms
+#define NO_FLOW             0xFF        // st_Tester.FlowStatus: never answer a first frame
+
+typedef struct {
+    // How the tester answers the node's first frame and blocks: ISOTP_FC_xxx (or NO_FLOW) with BlockSize and STmin, after
+    // FlowDelay ticks, and first Waits times ISOTP_FC_WAIT.
+    unsigned int FlowStatus;
+    unsigned int BlockSize;
+    unsigned int STmin;
+    unsigned int FlowDelay;
+    unsigned int Waits;
+    bool FlowPending;
+    unsigned int FlowCountdown;
+    unsigned int FlowControls;
+
+    // The response being received.
+    uint8_t Response[ISOTP_MAX_LENGTH];
+    unsigned int Length;
+    unsigned int Offset;
+    unsigned int Sequence;
+    unsigned int BlockLeft;
+    bool Done;
+    long FirstFrameTick;
+    long LastConsecutiveTick;
+    unsigned int MinGap;
+    unsigned int MaxPerTick;
+    unsigned int ThisTick;
+    unsigned int Errors;
+
+    // The request being sent: stall it after the first frame, or skip a sequence number.
+    const uint8_t* Request;
+    unsigned int RequestLength;
+    unsigned int RequestOffset;
+    unsigned int RequestSequence;
+    bool Stall;
+    bool BadSequence;
+    unsigned int NodeFlows;
+    uint8_t NodeFlow[3];
+} st_Tester;
+
+static st_Tester l_Tester;
+static long l_Tick = 0;
+
+/*
+ *      TesterSendTo() - A frame from the tester to ISO-TP address 'target', delivered through the receive FIFO.
+ */
+static void TesterSendTo(unsigned int target, const uint8_t* bytes, unsigned int length)
+{
+    unsigned int* frame = (unsigned int*)ecan1msgBuf[ECAN1_RX_FIFO_START];
+    unsigned long id = ((unsigned long)ISOTP_PRIORITY << 26) | ((unsigned long)(ISOTP_PGN | target) << 8) | TESTER;
+    uint8_t* data = (uint8_t*)&frame[3];
+    unsigned int i;
+
+    frame[0] = (((id >> 18) & 0x07FF) << 2) | 0x0003;
+    frame[1] = (id >> 6) & 0x0FFF;
+    frame[2] = ((id & 0x003F) << 10) | 8;
+    for (i=0; i<8; i++)
+    {
+        data[i] = (i < length) ? bytes[i] : ISOTP_PADDING;
+    }
+    C1FIFObits.FNRB = ECAN1_RX_FIFO_START;
+    C1RXFUL1 |= 1 << ECAN1_RX_FIFO_START;
+    ReceiveECANFrames(0);
+}
+
+static void TesterSend(const uint8_t* bytes, unsigned int length)
+{
+    TesterSendTo(NODE, bytes, length);
+}
+
+static void TesterSendFlow(unsigned int status)
+{
+    uint8_t flow[3] = {ISOTP_PCI_FLOW | status, l_Tester.BlockSize, l_Tester.STmin};
+
+    TesterSend(flow, 3);
+    l_Tester.FlowControls++;
+    l_Tester.BlockLeft = l_Tester.BlockSize;
+    l_Tester.LastConsecutiveTick = -1;
+}
+
+/*
+ *      TesterSendConsecutive() - The request's consecutive frames: 'count' of them, or the rest when 0.
+ */
+static void TesterSendConsecutive(unsigned int count)
+{
+    uint8_t data[8];
+    unsigned int i;
+    unsigned int sent = 0;
+
+    while ((l_Tester.RequestOffset < l_Tester.RequestLength) && ((count == 0) || (sent < count)))
+    {
+        if (l_Tester.BadSequence && (sent == 2))
+        {
+            l_Tester.RequestSequence = (l_Tester.RequestSequence + 1) & 0x0F;
+        }
+        data[0] = ISOTP_PCI_CONSECUTIVE | l_Tester.RequestSequence;
+        for (i=1; (i<8) && (l_Tester.RequestOffset < l_Tester.RequestLength); i++)
+        {
+            data[i] = l_Tester.Request[l_Tester.RequestOffset++];
+        }
+        TesterSend(data, i);
+        l_Tester.RequestSequence = (l_Tester.RequestSequence + 1) & 0x0F;
+        sent++;
+    }
+}
+
+/*
+ *      TesterRequest() - Start sending a request: a single frame, or the first frame with the rest following the node's flow
+ *                        control.
+ */
+static void TesterRequest(const uint8_t* request, unsigned int length)
+{
+    uint8_t data[8];
+    unsigned int i;
+
+    l_Tester.Request = request;
+    l_Tester.RequestLength = length;
+    if (length <= 7)
+    {
+        data[0] = ISOTP_PCI_SINGLE | length;
+        memcpy(&data[1], request, length);
+        TesterSend(data, 1 + length);
+        l_Tester.RequestOffset = length;
+        return;
+    }
+    data[0] = ISOTP_PCI_FIRST | (length >> 8);
+    data[1] = length & 0xFF;
+    for (i=0; i<6; i++)
+    {
+        data[2+i] = request[i];
+    }
+    TesterSend(data, 8);
+    l_Tester.RequestOffset = 6;
+    l_Tester.RequestSequence = 1;
+}
+
+/*
+ *      TesterReceive() - A frame the node sent.  Everything on this bus is ISO-TP from the node to the tester.
+ */
+static void TesterReceive(const unsigned int* frame)
+{
+    const uint8_t* data = (const uint8_t*)&frame[3];
+    unsigned long id = ((unsigned long)((frame[0] & 0xFFFF) >> 2) << 18) | ((unsigned long)(frame[1] & 0x0FFF) << 6) |
+                       ((frame[2] & 0xFFFF) >> 10);
+    unsigned int i;
+
+    if (((frame[0] & 0x0001) == 0) || ((id >> 26) != ISOTP_PRIORITY) || (((id >> 8) & 0xFFFF) != (ISOTP_PGN | TESTER)) ||
+        ((id & 0xFF) != NODE) || ((frame[2] & 0x000F) != 8))
+    {
+        l_Tester.Errors++;
+        return;
+    }
+    switch (data[0] & 0xF0)
+    {
+        case ISOTP_PCI_SINGLE:
+            l_Tester.Length = data[0] & 0x0F;
+            memcpy(l_Tester.Response, &data[1], l_Tester.Length);
+            l_Tester.Done = true;
+            break;
+
+        case ISOTP_PCI_FIRST:
+            l_Tester.Length = ((data[0] & 0x0F) << 8) | data[1];
+            memcpy(l_Tester.Response, &data[2], 6);
+            l_Tester.Offset = 6;
+            l_Tester.Sequence = 1;
+            l_Tester.FirstFrameTick = l_Tick;
+            l_Tester.FlowPending = (l_Tester.FlowStatus != NO_FLOW);
+            l_Tester.FlowCountdown = l_Tester.FlowDelay;
+            break;
+
+        case ISOTP_PCI_CONSECUTIVE:
+            // Nothing may come while the tester owes a flow control, and only in sequence.
+            if (l_Tester.FlowPending || ((data[0] & 0x0F) != l_Tester.Sequence) || (l_Tester.Offset >= l_Tester.Length))
+            {
+                l_Tester.Errors++;
+            }
+            if (l_Tester.LastConsecutiveTick >= 0)
+            {
+                if ((unsigned int)(l_Tick - l_Tester.LastConsecutiveTick) < l_Tester.MinGap)
+                {
+                    l_Tester.MinGap = l_Tick - l_Tester.LastConsecutiveTick;
+                }
+            }
+            if (l_Tick != l_Tester.LastConsecutiveTick)
+            {
+                l_Tester.ThisTick = 0;
+            }
+            if (++l_Tester.ThisTick > l_Tester.MaxPerTick)
+            {
+                l_Tester.MaxPerTick = l_Tester.ThisTick;
+            }
+            l_Tester.LastConsecutiveTick = l_Tick;
+            for (i=1; (i<8) && (l_Tester.Offset<l_Tester.Length); i++)
+            {
+                l_Tester.Response[l_Tester.Offset++] = data[i];
+            }
+            l_Tester.Sequence = (l_Tester.Sequence + 1) & 0x0F;
+            if (l_Tester.Offset >= l_Tester.Length)
+            {
+                l_Tester.Done = true;
+            }
+            else if ((l_Tester.BlockSize != 0) && (--l_Tester.BlockLeft == 0))
+            {
+                l_Tester.FlowPending = true;
+                l_Tester.FlowCountdown = l_Tester.FlowDelay;
+            }
+            break;
+
+        case ISOTP_PCI_FLOW:
+            l_Tester.NodeFlows++;
+            l_Tester.NodeFlow[0] = data[0] & 0x0F;
+            l_Tester.NodeFlow[1] = data[1];
+            l_Tester.NodeFlow[2] = data[2];
+            if ((l_Tester.NodeFlow[0] == ISOTP_FC_CTS) && !l_Tester.Stall)
+            {
+                TesterSendConsecutive(l_Tester.NodeFlow[1]);
+            }
+            break;
+    }
+}
+
+/*
+ *      TesterTick() - The tester's flow control, once its delay is up.
+ */
+static void TesterTick()
+{
+    if (!l_Tester.FlowPending)
+    {
+        return;
+    }
+    if (l_Tester.FlowCountdown != 0)
+    {
+        l_Tester.FlowCountdown--;
+        return;
+    }
+    if (l_Tester.Waits != 0)
+    {
+        l_Tester.Waits--;
+        l_Tester.FlowCountdown = l_Tester.FlowDelay;
+        TesterSendFlow(ISOTP_FC_WAIT);
+        return;
+    }
+    l_Tester.FlowPending = false;
+    TesterSendFlow(l_Tester.FlowStatus);
+}
+
+/*
+ *      BusRun() - Send up to BUS_FRAMES_PER_TICK frames from the transmit buffers, the highest priority first and within a
+ *                 priority the highest buffer, as the ECAN module does.
+ */
+static void BusRun()
+{
+    volatile unsigned char* control = (volatile unsigned char*)&C1TR01CON;
+    unsigned int frame[8];
+    unsigned int frames;
+    int best;
+    int buffernumber;
+
+    for (frames=0; frames<BUS_FRAMES_PER_TICK; frames++)
+    {
+        best = -1;
+        for (buffernumber=0; buffernumber<ECAN1_TX_BUFFERS; buffernumber++)
+        {
+            if ((control[buffernumber] & 0x08) &&
+                ((best < 0) || ((control[buffernumber] & 0x03) >= (control[best] & 0x03))))
+            {
+                best = buffernumber;
+            }
+        }
+        if (best < 0)
+        {
+            break;
+        }
+        memcpy(frame, (const void*)ecan1msgBuf[best], sizeof(frame));
+        control[best] &= ~0x08;
+        g_ECANTransmitCompleted++;
+        ECANTransmitRefill();
+        TesterReceive(frame);
+    }
+}
+
+static void Tick()
+{
+    IsoTpTick();
+    BusRun();
+    TesterTick();
+    l_Tick++;
+}
+
+static void TesterReset(unsigned int flowstatus, unsigned int blocksize, unsigned int stmin)
+{
+    memset(&l_Tester, 0, sizeof(l_Tester));
+    l_Tester.FlowStatus = flowstatus;
+    l_Tester.BlockSize = blocksize;
+    l_Tester.STmin = stmin;
+    l_Tester.FirstFrameTick = -1;
+    l_Tester.LastConsecutiveTick = -1;
+    l_Tester.MinGap = 0xFFFF;
+}
+
+/*
+ *      RunUntilDone() - Ticks until the tester has the whole response, at most 'limit'.  Returns the ticks run.
+ */
+static unsigned int RunUntilDone(unsigned int limit)
+{
+    unsigned int ticks = 0;
+
+    while (!l_Tester.Done && (ticks < limit))
+    {
+        Tick();
+        ticks++;
+    }
+    return ticks;
+}
+
+static void TestSingleFrame()
+{
+    const uint8_t capture[] = {ISOTP_SERVICE_READ_CAPTURE};
+    const uint8_t unknown[] = {0x09, 1, 2, 3};
+    unsigned int requests = g_IsoTpRequests;
+    unsigned int responses = g_IsoTpResponses;
+
+    // No capture waiting: a negative response in a single frame.
+    TesterReset(ISOTP_FC_CTS, 0, 0);
+    TesterRequest(capture, sizeof(capture));
+    CHECK(RunUntilDone(10) <= 2);
+    CHECK_EQUAL(3, l_Tester.Length);
+    CHECK_EQUAL(ISOTP_NEGATIVE, l_Tester.Response[0]);
+    CHECK_EQUAL(ISOTP_SERVICE_READ_CAPTURE, l_Tester.Response[1]);
+    CHECK_EQUAL(CAN_RESULT_FAILED, l_Tester.Response[2]);
+
+    TesterReset(ISOTP_FC_CTS, 0, 0);
+    TesterRequest(unknown, sizeof(unknown));
+    RunUntilDone(10);
+    CHECK(l_Tester.Done);
+    CHECK_EQUAL(ISOTP_NEGATIVE, l_Tester.Response[0]);
+    CHECK_EQUAL(0x09, l_Tester.Response[1]);
+    CHECK_EQUAL(CAN_RESULT_UNKNOWN, l_Tester.Response[2]);
+    CHECK_EQUAL(0, l_Tester.Errors);
+    CHECK_EQUAL(requests + 2, g_IsoTpRequests);
+    CHECK_EQUAL(responses + 2, g_IsoTpResponses);
+
+    // Not to this node: nothing.
+    TesterReset(ISOTP_FC_CTS, 0, 0);
+    TesterSendTo(NODE + 1, (const uint8_t[]){ISOTP_PCI_SINGLE | 1, ISOTP_SERVICE_READ_CONFIG}, 2);
+    RunUntilDone(10);
+    CHECK(!l_Tester.Done);
+    CHECK_EQUAL(requests + 2, g_IsoTpRequests);
+}
+
+/*
+ *      ReadConfigPaced() - Read g_Config with the tester's flow control 'blocksize' / 'stmin', and check the segmentation and
+ *                     pacing of the response.
+ */
+static void ReadConfigPaced(unsigned int blocksize, unsigned int stmin, unsigned int delay)
+{
+    const uint8_t request[] = {ISOTP_SERVICE_READ_CONFIG};
+    unsigned int length = 1 + sizeof(st_CAL);
+    unsigned int consecutive = ((length - 6) + 6) / 7;
+    unsigned int responses = g_IsoTpResponses;
+    unsigned int gap;
+
+    printf("  READ_CONFIG, %u bytes: BS %u, STmin 0x%02X, flow control after %u ticks\n", length, blocksize, stmin, delay);
+    TesterReset(ISOTP_FC_CTS, blocksize, stmin);
+    l_Tester.FlowDelay = delay;
+    TesterRequest(request, sizeof(request));
+    RunUntilDone(30000);
+    CHECK(l_Tester.Done);
+    CHECK_EQUAL(0, l_Tester.Errors);
+    CHECK_EQUAL(length, l_Tester.Length);
+    CHECK_EQUAL(ISOTP_SERVICE_READ_CONFIG | ISOTP_RESPONSE, l_Tester.Response[0]);
+    CHECK(memcmp(&l_Tester.Response[1], &g_Config, sizeof(st_CAL)) == 0);
+    CHECK_EQUAL(responses + 1, g_IsoTpResponses);
+
+    // One flow control for the first frame and one after each whole block but the last.
+    CHECK_EQUAL((blocksize == 0) ? 1 : 1 + ((consecutive - 1) / blocksize), l_Tester.FlowControls);
+
+    // STmin 0 is up to ISOTP_FRAMES_PER_TICK frames a tick, 0xF1-0xF9 (100-900us) and 1-0x7F ms a frame every STmin ms
+    // or more.
+    gap = (stmin <= 0x7F) ? stmin : ((stmin >= 0xF1) && (stmin <= 0xF9)) ? 1 : 0x7F;
+    if (gap == 0)
+    {
+        CHECK(l_Tester.MaxPerTick <= ISOTP_FRAMES_PER_TICK);
+        CHECK((blocksize == 1) || (l_Tester.MaxPerTick > 1));
+    }
+    else
+    {
+        CHECK_EQUAL(1, l_Tester.MaxPerTick);
+        CHECK(l_Tester.MinGap >= gap);
+        CHECK(l_Tester.MinGap <= gap + 1);
+    }
+}
+
+static void TestResponseSegmentation()
+{
+    uint8_t* config = (uint8_t*)&g_Config;
+    unsigned int i;
+
+    // A recognisable image, keeping the node's address.
+    for (i=1; i<sizeof(st_CAL); i++)
+    {
+        config[i] = (uint8_t)(i * 37 + 11);
+    }
+    g_Config.CanIDMode = CAN_ID_STANDARD;
+    g_Config.CanCommand_ID = NODE_COMMAND_ID;
+
+    ReadConfigPaced(0, 0, 0);
+    ReadConfigPaced(8, 0, 0);
+    ReadConfigPaced(1, 0, 0);
+    ReadConfigPaced(4, 10, 0);
+    ReadConfigPaced(0, 0xF5, 0);
+    ReadConfigPaced(2, 3, 20);
+    ReadConfigPaced(3, 0xFA, 0);
+}
+
+static void TestFlowWait()
+{
+    const uint8_t request[] = {ISOTP_SERVICE_READ_CONFIG};
+    unsigned int aborted = g_IsoTpAborted;
+
+    // Each WAIT restarts the node's ISOTP_TIMEOUT, so three of them a little over half of it apart are fine.
+    TesterReset(ISOTP_FC_CTS, 0, 0);
+    l_Tester.Waits = 3;
+    l_Tester.FlowDelay = (ISOTP_TIMEOUT / 2) + 100;
+    TesterRequest(request, sizeof(request));
+    CHECK(RunUntilDone(10000) > ISOTP_TIMEOUT);
+    CHECK(l_Tester.Done);
+    CHECK_EQUAL(4, l_Tester.FlowControls);
+    CHECK_EQUAL(0, l_Tester.Errors);
+    CHECK_EQUAL(aborted, g_IsoTpAborted);
+}
+
+static void TestResponseTimeout()
+{
+    const uint8_t request[] = {ISOTP_SERVICE_READ_CONFIG};
+    const uint8_t unknown[] = {0x09};
+    unsigned int aborted = g_IsoTpAborted;
+    unsigned int ticks;
+
+    // No flow control: the response is given up ISOTP_TIMEOUT after the first frame.
+    TesterReset(NO_FLOW, 0, 0);
+    TesterRequest(request, sizeof(request));
+    for (ticks=0; (ticks<2*ISOTP_TIMEOUT) && (g_IsoTpAborted == aborted); ticks++)
+    {
+        Tick();
+    }
+    CHECK_EQUAL(aborted + 1, g_IsoTpAborted);
+    CHECK(abs((int)(l_Tick - l_Tester.FirstFrameTick) - ISOTP_TIMEOUT) <= 1);
+    CHECK(!l_Tester.Done);
+
+    // Overflow from the tester ends it at once.
+    TesterReset(ISOTP_FC_OVERFLOW, 0, 0);
+    TesterRequest(request, sizeof(request));
+    for (ticks=0; ticks<5; ticks++)
+    {
+        Tick();
+    }
+    CHECK_EQUAL(aborted + 2, g_IsoTpAborted);
+    CHECK_EQUAL(0, l_Tester.Errors);
+
+    // The next request is served.
+    TesterReset(ISOTP_FC_CTS, 0, 0);
+    TesterRequest(unknown, sizeof(unknown));
+    RunUntilDone(10);
+    CHECK(l_Tester.Done);
+    CHECK_EQUAL(ISOTP_NEGATIVE, l_Tester.Response[0]);
+}
+
+static void TestRequestSegmentation()
+{
+    uint8_t request[ISOTP_RX_BUFFER_LENGTH + 1];
+    unsigned int consecutive;
+    unsigned int i;
+
+    for (i=0; i<sizeof(request); i++)
+    {
+        request[i] = (uint8_t)(i + 1);
+    }
+
+    // 100 bytes: the first frame and 14 consecutive frames, in blocks of ISOTP_BLOCK_SIZE, each flow control from the node.
+    request[0] = 0x09;
+    consecutive = ((100 - 6) + 6) / 7;
+    TesterReset(ISOTP_FC_CTS, 0, 0);
+    TesterRequest(request, 100);
+    RunUntilDone(100);
+    CHECK(l_Tester.Done);
+    CHECK_EQUAL(100, l_Tester.RequestOffset);
+    CHECK_EQUAL((ISOTP_BLOCK_SIZE == 0) ? 1 : 1 + ((consecutive - 1) / ISOTP_BLOCK_SIZE), l_Tester.NodeFlows);
+    CHECK_EQUAL(ISOTP_FC_CTS, l_Tester.NodeFlow[0]);
+    CHECK_EQUAL(ISOTP_BLOCK_SIZE, l_Tester.NodeFlow[1]);
+    CHECK_EQUAL(ISOTP_STMIN, l_Tester.NodeFlow[2]);
+    CHECK_EQUAL(3, l_Tester.Length);
+    CHECK_EQUAL(ISOTP_NEGATIVE, l_Tester.Response[0]);
+    CHECK_EQUAL(0x09, l_Tester.Response[1]);
+    CHECK_EQUAL(CAN_RESULT_UNKNOWN, l_Tester.Response[2]);
+    CHECK_EQUAL(0, l_Tester.Errors);
+
+    // A WRITE_CONFIG that isn't a whole image is refused once it is all in.
+    request[0] = ISOTP_SERVICE_WRITE_CONFIG;
+    TesterReset(ISOTP_FC_CTS, 0, 0);
+    TesterRequest(request, 20);
+    RunUntilDone(100);
+    CHECK(l_Tester.Done);
+    CHECK_EQUAL(ISOTP_NEGATIVE, l_Tester.Response[0]);
+    CHECK_EQUAL(ISOTP_SERVICE_WRITE_CONFIG, l_Tester.Response[1]);
+    CHECK_EQUAL(CAN_RESULT_BAD_ARGUMENT, l_Tester.Response[2]);
+
+    // Longer than the receive buffer: overflow, and nothing more.
+    request[0] = 0x09;
+    TesterReset(ISOTP_FC_CTS, 0, 0);
+    TesterRequest(request, ISOTP_RX_BUFFER_LENGTH + 1);
+    RunUntilDone(100);
+    CHECK(!l_Tester.Done);
+    CHECK_EQUAL(1, l_Tester.NodeFlows);
+    CHECK_EQUAL(ISOTP_FC_OVERFLOW, l_Tester.NodeFlow[0]);
+}
+
+static void TestRequestTimeout()
+{
+    uint8_t request[40];
+    const uint8_t late[8] = {ISOTP_PCI_CONSECUTIVE | 1, 1, 2, 3, 4, 5, 6, 7};
+    unsigned int aborted = g_IsoTpAborted;
+    unsigned int requests;
+    unsigned int ticks;
+
+    memset(request, 0x55, sizeof(request));
+    request[0] = 0x09;
+
+    // The tester stops after the first frame: the node gives up ISOTP_TIMEOUT later, and a late frame is ignored.
+    TesterReset(ISOTP_FC_CTS, 0, 0);
+    l_Tester.Stall = true;
+    TesterRequest(request, sizeof(request));
+    for (ticks=0; ticks<ISOTP_TIMEOUT-1; ticks++)
+    {
+        Tick();
+    }
+    CHECK_EQUAL(aborted, g_IsoTpAborted);
+    Tick();
+    Tick();
+    CHECK_EQUAL(aborted + 1, g_IsoTpAborted);
+    requests = g_IsoTpRequests;
+    TesterSend(late, 8);
+    RunUntilDone(20);
+    CHECK(!l_Tester.Done);
+    CHECK_EQUAL(requests, g_IsoTpRequests);
+
+    // A consecutive frame out of sequence ends the request.
+    TesterReset(ISOTP_FC_CTS, 0, 0);
+    l_Tester.BadSequence = true;
+    TesterRequest(request, sizeof(request));
+    RunUntilDone(20);
+    CHECK(!l_Tester.Done);
+    CHECK_EQUAL(aborted + 2, g_IsoTpAborted);
+    CHECK_EQUAL(requests, g_IsoTpRequests);
+
+    // And then a request goes through.
+    TesterReset(ISOTP_FC_CTS, 0, 0);
+    TesterRequest(request, sizeof(request));
+    RunUntilDone(20);
+    CHECK(l_Tester.Done);
+    CHECK_EQUAL(requests + 1, g_IsoTpRequests);
+    CHECK_EQUAL(0, l_Tester.Errors);
+}
+
+int main()
+{
+    g_Config.CanIDMode = CAN_ID_STANDARD;
+    g_Config.CanCommand_ID = NODE_COMMAND_ID;
+
+    TestSingleFrame();
+    TestResponseSegmentation();
+    TestFlowWait();
+    TestResponseTimeout();
+    TestRequestSegmentation();
+    TestRequestTimeout();
+    return TestResult("test_isotp");
+}
@@ -0,0 +1,301 @@
+/* 
+ * File:   test_sync.c
+ *
+ * The SYNC frame control law of SyncTick() / SyncReceived() in a drift simulation: an ideal master and a slave whose 
+ * crystal is off by -100..+100ppm, starting up to 300 TMR1 counts out of phase.  The slave's Timer1 period each tick is
+ * whatever PR1 SyncTick() leaves, and the SYNC frames end at a fixed point in the master's tick.  Also the non-blocking 
+ * Timer3 shift that follows the adjustments in ADC_MODE_DMA_SCAN.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "test.h"
+#include "global.h"
+#include "adc.h"
+#include "timer1.h"
+
+// The slave's sync state in timer1.c, cleared between runs.
+extern long l_SyncTrimAccumulator;
+extern int l_SyncPhaseRemaining;
+extern int l_SyncApplied;
+extern int l_SyncLastError;
+extern int l_SyncLastApplied;
+extern bool l_SyncHaveError;
+extern bool l_SyncHaveRx;
+extern volatile bool l_SyncPending;
+extern unsigned int l_SyncCountdown;
+// Timer3 shift not yet applied, in adc.c.
+extern int l_ADCScanShiftPending;
+
+#define PERIOD          (TIMER1_PR1 + 1)    // TMR1 counts per 1ms tick
+#define FRAME_END       120.4               // Where in the master's tick each SYNC frame finishes (master counts)
+#define US_PER_COUNT    1.6
+
+typedef struct {
+    double MaxErrorUs;          // Largest tick error (us) over the second half of the run
+    long Trim;                  // g_SyncTrim at the end
+    long FirstTrim;             // g_SyncTrim after the first drift measurement
+    int LastError;              // g_SyncError at the end
+    bool SlewLimited;           // Every PR1 within SYNC_MAX_SLEW of TIMER1_PR1
+} st_SyncRun;
+
+static void SyncReset()
+{
+    l_SyncTrimAccumulator = 0;
+    l_SyncPhaseRemaining = 0;
+    l_SyncApplied = 0;
+    l_SyncLastError = 0;
+    l_SyncLastApplied = 0;
+    l_SyncHaveError = false;
+    l_SyncHaveRx = false;
+    l_SyncPending = false;
+    g_SyncTrim = 0;
+    g_SyncError = 0;
+}
+
+/*
+ *      SyncRun() - 'ticks' slave ticks.  Time is in master TMR1 counts; a slave count lasts 1/(1 + ppm/1e6) of one, so a 
+ *                  positive ppm is a fast slave crystal.  The slave's first tick starts 'offset' counts after the master's.
+ */
+static st_SyncRun SyncRun(double ppm, double offset, unsigned int ticks)
+{
+    st_SyncRun run = {0, 0, 0, 0, true};
+    double scale = 1.0 / (1.0 + (ppm * 1e-6));
+    double slave = offset;
+    double end, sync, phase;
+    unsigned int interval = ((g_Config.SyncInterval == 0) ? 1 : g_Config.SyncInterval) * 10;   // As SyncIntervalTicks()
+    unsigned int masterphase = SYNC_PHASE_INVALID;
+    unsigned int sequence = 0;
+    unsigned int measurements = 0;
+    unsigned int frames = g_SyncFrames;
+    unsigned int n;
+
+    SyncReset();
+    sync = (interval * PERIOD) + FRAME_END;
+    for (n=0; n<ticks; n++)
+    {
+        SyncTick();
+        if ((PR1 < TIMER1_PR1 - SYNC_MAX_SLEW) || (PR1 > TIMER1_PR1 + SYNC_MAX_SLEW))
+        {
+            run.SlewLimited = false;
+        }
+        if (g_SyncFrames != frames)
+        {
+            frames = g_SyncFrames;
+            if (++measurements == 2)
+            {
+                run.FirstTrim = g_SyncTrim;
+            }
+        }
+        end = slave + ((PR1 + 1) * scale);
+
+        // The SYNC frames that finish during this slave period, with the master's phase of the one before.
+        while (sync < end)
+        {
+            sequence = (sequence + 1) & 0xFF;
+            SyncReceived(sequence, masterphase, (unsigned int)((sync - slave) / scale));
+            masterphase = (unsigned int)fmod(sync, PERIOD);
+            sync += interval * PERIOD;
+        }
+
+        if (n >= ticks / 2)
+        {
+            phase = fmod(slave, PERIOD);
+            if (phase > PERIOD / 2)
+            {
+                phase -= PERIOD;
+            }
+            if (fabs(phase) * US_PER_COUNT > run.MaxErrorUs)
+            {
+                run.MaxErrorUs = fabs(phase) * US_PER_COUNT;
+            }
+        }
+        slave = end;
+    }
+    run.Trim = g_SyncTrim;
+    run.LastError = g_SyncError;
+    return run;
+}
+
+static void TestConvergence()
+{
+    const double ppms[] = {-100, -30, 0, 30, 100};
+    const double offsets[] = {0, 100, -100, 300, -300};
+    st_SyncRun run;
+    double trim;
+    unsigned int p, o;
+
+    g_Config.SyncMode = SYNC_SLAVE;
+    g_Config.SyncInterval = 10;     // 100ms
+    for (p=0; p<sizeof(ppms)/sizeof(ppms[0]); p++)
+    {
+        // The trim that cancels the crystal error, Q16 counts per tick.
+        trim = PERIOD * ppms[p] * 1e-6 * 65536.0;
+        for (o=0; o<sizeof(offsets)/sizeof(offsets[0]); o++)
+        {
+            run = SyncRun(ppms[p], offsets[o], 60000);
+            printf("  %+4.0fppm %+4.0f counts: steady state error %5.2fus, trim %+6ld (ideal %+6.0f), first trim %+6ld\n", 
+                   ppms[p], offsets[o], run.MaxErrorUs, run.Trim, trim, run.FirstTrim);
+            CHECK(run.SlewLimited);
+            // Locked, with the tick error held to a few counts.
+            CHECK(abs(run.LastError) <= SYNC_LOCK_LIMIT);
+            CHECK(run.MaxErrorUs <= ((fabs(ppms[p]) > 50) ? 14.0 : 8.0));
+            // The trim settles on the crystal error, within the 1 count resolution of a measurement over an interval.
+            CHECK(fabs(run.Trim - trim) <= 65536.0 / (g_Config.SyncInterval * 10));
+            // Loop gain: the first drift measurement moves the trim 1/SYNC_TRIM_GAIN of the way.
+            CHECK(fabs(run.FirstTrim - (trim / SYNC_TRIM_GAIN)) <= (65536.0 / (g_Config.SyncInterval * 10)) / SYNC_TRIM_GAIN + 1);
+        }
+    }
+    g_Config.SyncMode = SYNC_OFF;
+}
+
+static void TestZeroInterval()
+{
+    unsigned int frames = g_SyncFrames;
+    unsigned int n;
+
+    // A master with SyncInterval 0 sends every 10ms, as for 1, instead of wrapping its countdown.
+    g_Config.SyncMode = SYNC_MASTER;
+    g_Config.SyncInterval = 0;
+    l_SyncCountdown = 0;
+    for (n=0; n<25; n++)
+    {
+        SyncTick();
+        CHECK(l_SyncCountdown < 10);
+    }
+    CHECK_EQUAL(frames + 3, g_SyncFrames);
+
+    // A slave still locks.
+    g_Config.SyncMode = SYNC_SLAVE;
+    g_Config.SyncInterval = 0;
+    CHECK(abs(SyncRun(30, 100, 30000).LastError) <= SYNC_LOCK_LIMIT);
+    g_Config.SyncMode = SYNC_OFF;
+    g_Config.SyncInterval = 10;
+}
+
+static void TestScanTimerShift()
+{
+    g_ADCAcquisitionMode = ADC_MODE_DMA_SCAN;
+    SetupADCScanTimer();
+
+    // Later: this slot is lengthened, and TMR3 is left running.
+    TMR3 = 250;
+    ADCScanTimerShift(128);
+    CHECK_EQUAL(250, TMR3);
+    CHECK_EQUAL(ADC_SCAN_PR3 + 128, PR3);
+    CHECK_EQUAL(1, IEC0bits.T3IE);
+
+    // One slot at a time: the next shift is held until the Timer3 interrupt puts the period back.
+    ADCScanTimerShift(-64);
+    CHECK_EQUAL(ADC_SCAN_PR3 + 128, PR3);
+    ADCScanTimerRestore();
+    CHECK_EQUAL(ADC_SCAN_PR3, PR3);
+    CHECK_EQUAL(0, IEC0bits.T3IE);
+
+    // Earlier, with the -64 held above: only as far as the margin ahead of TMR3, the rest is carried.
+    TMR3 = 300;
+    ADCScanTimerShift(-128);
+    CHECK_EQUAL(300, TMR3);
+    CHECK_EQUAL(ADC_SCAN_PR3 - (ADC_SCAN_PR3 - 16 - 300), PR3);
+    ADCScanTimerRestore();
+    TMR3 = 200;
+    ADCScanTimerShift(0);
+    CHECK_EQUAL(ADC_SCAN_PR3 - (192 - (ADC_SCAN_PR3 - 16 - 300)), PR3);
+    ADCScanTimerRestore();
+    TMR3 = 200;
+    ADCScanTimerShift(0);
+    CHECK_EQUAL(ADC_SCAN_PR3, PR3);
+    CHECK_EQUAL(0, IEC0bits.T3IE);
+
+    // Too close to the end of the slot to change it either way.
+    TMR3 = ADC_SCAN_PR3 - 10;
+    ADCScanTimerShift(64);
+    CHECK_EQUAL(ADC_SCAN_PR3, PR3);
+    CHECK_EQUAL(0, IEC0bits.T3IE);
+    TMR3 = 100;
+    ADCScanTimerShift(0);
+    CHECK_EQUAL(ADC_SCAN_PR3 + 64, PR3);
+    ADCScanTimerRestore();
+}
+
+/*
+ *      TestScanTimerAlignment() - Timer1 and Timer3 on one time line (instruction cycles), with the Timer1 periods SyncTick()
+ *                                 would set and the Timer1 interrupt entered a varying number of cycles late.  Each tick 
+ *                                 must hold exactly one scan block, and once the adjustments net to zero the two timers must
+ *                                 be where they started relative to each other.
+ */
+static void TestScanTimerAlignment()
+{
+    const int adjusts[] = {1, 0, 2, -1, -2, 0, 2, 2, -2, -2, 1, -1, 0, 2, -2, -1, 1};
+    long tick = 0;                  // Start of the current Timer1 period
+    long slot = -((ADC_SCAN_PR3 + 1) / 2);  // Start of the current Timer3 slot, as SetupTimer1() starts them
+    long interrupt;
+    long slots;
+    long net = 0;
+    unsigned int latency;
+    unsigned int n;
+    unsigned int pass;
+    bool aligned = true;
+    bool untouched = true;
+
+    g_ADCAcquisitionMode = ADC_MODE_DMA_SCAN;
+    SetupADCScanTimer();
+    for (pass=0; pass<200; pass++)
+    {
+        for (n=0; n<sizeof(adjusts)/sizeof(adjusts[0]); n++)
+        {
+            // Up to ~4us late, sometimes late enough that a shorter slot has to wait for the next tick.
+            latency = (pass * 37 + n * 11) % 160;
+            interrupt = tick + latency;
+            slots = 0;
+            while (slot + PR3 + 1 <= interrupt)
+            {
+                slot += PR3 + 1;
+                slots++;
+                if (IEC0bits.T3IE)
+                {
+                    ADCScanTimerRestore();
+                }
+            }
+            TMR3 = interrupt - slot;
+            ADCScanTimerShift(adjusts[n] * 64);
+            untouched = untouched && (TMR3 == (unsigned int)(interrupt - slot));
+            if ((pass != 0) || (n != 0))
+            {
+                aligned = aligned && (slots == ADC_SCAN_BLOCK_LENGTH);
+            }
+            net += adjusts[n];
+            tick += (TIMER1_PR1 + 1 + adjusts[n]) * 64L;
+        }
+    }
+    CHECK_EQUAL(0, net);
+    CHECK(untouched);
+    CHECK(aligned);
+    // Let the last carried shift finish, then the slots start where they did relative to the tick.
+    for (n=0; n<3; n++)
+    {
+        while (slot + PR3 + 1 <= tick + 20)
+        {
+            slot += PR3 + 1;
+            if (IEC0bits.T3IE)
+            {
+                ADCScanTimerRestore();
+            }
+        }
+        TMR3 = tick + 20 - slot;
+        ADCScanTimerShift(0);
+        tick += (TIMER1_PR1 + 1) * 64L;
+    }
+    CHECK_EQUAL(0, l_ADCScanShiftPending);
+    CHECK_EQUAL(0, (tick - slot) % (ADC_SCAN_PR3 + 1) - (ADC_SCAN_PR3 + 1) / 2);
+}
+
+int main()
+{
+    TestConvergence();
+    TestZeroInterval();
+    TestScanTimerShift();
+    TestScanTimerAlignment();
+    return TestResult("test_sync");
+}
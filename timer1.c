@@ -8,6 +8,36 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "global.h"
+#include "adc.h"
+#include "timer1.h"
+#include "ecan.h"
+#include "EEPROM.h"
+
+// Sync state.  g_SyncError is the last measured phase error (TMR1 counts, + = this node's tick is late), g_SyncTrim the 
+// frequency trim added to every period (TMR1 counts, Q16), and g_SyncFrames the SYNC frames sent or used.
+int g_SyncError = 0;
+long g_SyncTrim = 0;
+unsigned int g_SyncFrames = 0;
+
+unsigned int l_SyncCountdown = 0;       // Master: ticks until the next SYNC frame
+unsigned int l_SyncSequence = 0;        // Master: sequence number of the last SYNC frame
+unsigned int l_SyncTxPhase = SYNC_PHASE_INVALID; // Master: TMR1 when the last SYNC frame finished transmitting
+long l_SyncTrimAccumulator = 0;         // Slave: fraction of a count of trim carried to the next period (Q16)
+int l_SyncPhaseRemaining = 0;           // Slave: phase error still to be slewed out (TMR1 counts)
+int l_SyncApplied = 0;                  // Slave: running sum of every period adjustment, to relate measurements in time
+int l_SyncLastError = 0;                // Slave: previous measured phase error and the adjustments made up to it, for the
+int l_SyncLastApplied = 0;              //        drift estimate
+bool l_SyncHaveError = false;
+
+// Slave: the last SYNC frame received (kept until the next one brings the master's phase for it), and a measurement handed
+// from the ECAN interrupt to SyncTick().
+bool l_SyncHaveRx = false;
+unsigned int l_SyncRxSequence;
+unsigned int l_SyncRxPhase;
+int l_SyncRxApplied;
+volatile bool l_SyncPending = false;
+int l_SyncPendingError;
+int l_SyncPendingApplied;
 
 /*
  *      SetupTimer1() - Configure Timer1 to fire an interrupt at a fixed interval (1000hz)
@@ -16,7 +46,7 @@ void SetupTimer1()
 {
     // Setup Timer1 to fire every 1ms (for 1000hz sample and CAN output)
     // Timer1 (TMR1) increments every 40MHZ(Instruction Clock) / 64, or 625000Hz
-    // To interrupt every 1ms, the timer resets when it reaches 625000 * .0010 seconds = 625
+    // To interrupt every 1ms, the period (PR1+1) is 625000 * .0010 seconds = 625 counts
 
     T1CONbits.TON = 0; // Disable Timer
     T1CONbits.TCS = 0; // Select internal instruction cycle clock
@@ -24,13 +54,212 @@ void SetupTimer1()
     T1CONbits.TCKPS = 0b10; // Select 64:1 Prescaler
     TMR1 = 0x00; // Clear timer register
     //PR1 = 6250; // Load the period value so the interrupt occurs every 10ms.
-    PR1 = 625 ; // Load the period value so the interrupt occurs every 1ms.
+    PR1 = TIMER1_PR1 ; // Load the period value so the interrupt occurs every 1ms (PR1+1 counts).
     
     IPC0bits.T1IP = 0x01; // Set Timer1 Interrupt Priority Level
     IFS0bits.T1IF = 0; // Clear Timer1 Interrupt Flag
     IEC0bits.T1IE = 1; // Enable Timer1 interrupt
     T1CONbits.TON = 1; // Start Timer
+    // In the DMA scan mode Timer3 triggers the ADC conversions.  Start it right behind Timer1 so each 10 conversion scan block
+    // lines up with one Timer1 period.  (Timer3 was configured by SetupADCScanTimer())
+    if (g_ADCAcquisitionMode == ADC_MODE_DMA_SCAN)
+    {
+        T3CONbits.TON = 1;
+    }
+}
+
+/*
+ *      SetupTimebase() - Configure Timer4/5 as one 32 bit timer for the free running microsecond timebase (ReadTimebase()).
+ *                        Timer2/3 is the usual 32 bit pair, but Timer3 is the ADC scan trigger.  The pair counts at 5MHz (1:8)
+ *                        and rolls over every second, and the Timer5 interrupt adds that second to g_TimebaseSecondsUs.  
+ *                        The Timer5 interrupt runs at priority 6, above everything that reads the timebase.
+ */
+void SetupTimebase()
+{
+    T4CONbits.TON = 0;          // Disable Timer
+    T5CONbits.TON = 0;
+    T4CONbits.T32 = 1;          // Timer4 and Timer5 form one 32 bit timer, controlled from T4CON, interrupting on Timer5
+    T4CONbits.TCS = 0;          // Select internal instruction cycle clock
+    T4CONbits.TGATE = 0;        // Disable Gated Timer mode
+    T4CONbits.TCKPS = 0b01;     // 1:8 Prescaler, 5MHz
+    TMR5 = 0;                   // Most significant word first
+    TMR4 = 0;
+    PR5 = (TIMEBASE_TICKS_PER_SECOND - 1) >> 16;
+    PR4 = (TIMEBASE_TICKS_PER_SECOND - 1) & 0xFFFF;
+    g_TimebaseSecondsUs = 0;
+    IPC7bits.T5IP = 6;
+    IFS1bits.T5IF = 0;
+    IEC1bits.T5IE = 1;
+    T4CONbits.TON = 1;
+}
+
+/*
+ *      ReadTimebase() - Microseconds since SetupTimebase(), 32 bits.  It wraps after ~71 minutes, so compare times by unsigned
+ *                       subtraction.  Safe to call from the main loop and from any interrupt below priority 6.
+ */
+unsigned long ReadTimebase()
+{
+    unsigned long seconds;
+    unsigned long ticks;
+    unsigned int low, high, quotient, remainder;
+
+    do
+    {
+        seconds = g_TimebaseSecondsUs;
+        low = TMR4;                 // Reading TMR4 latches TMR5 into TMR5HLD
+        high = TMR5HLD;
+        ticks = ((unsigned long)high << 16) | low;
+        // The timer can roll over a few cycles before its interrupt runs.  A pending Timer5 flag with a small count means
+        // this second has not been added yet.
+        if (IFS1bits.T5IF && (ticks < (TIMEBASE_TICKS_PER_SECOND / 2)))
+        {
+            seconds += 1000000UL;
+        }
+    } while ((seconds != g_TimebaseSecondsUs) && (seconds != (g_TimebaseSecondsUs + 1000000UL)));
+
+    // ticks / 5 as two 32/16 hardware divides, with the 16 bit remainder of the high word carried into the low one.
+    quotient = high / TIMEBASE_TICKS_PER_US;
+    remainder = high - (quotient * TIMEBASE_TICKS_PER_US);
+    return seconds + ((unsigned long)quotient << 16) + 
+           __builtin_divud(((unsigned long)remainder << 16) | low, TIMEBASE_TICKS_PER_US);
 }
 
+/*
+ *      SyncIntervalTicks() - Timer1 ticks between SYNC frames.  SyncInterval can be set to anything by CAN_COMMAND_SET_CONFIG,
+ *                            and 0 counts as 1 (10ms) rather than stopping the master's countdown or the slave's drift
+ *                            measurement.
+ */
+static unsigned int SyncIntervalTicks()
+{
+    return ((g_Config.SyncInterval == 0) ? 1 : g_Config.SyncInterval) * 10;
+}
 
+/*
+ *      SyncTick() - Called at the start of every Timer1 interrupt.  
+ *                   The master counts down to the next SYNC frame and sends it.  
+ *                   A slave sets the length of this period: the fractional frequency trim (g_SyncTrim, dithered a count at a
+ *                   time) plus up to SYNC_MAX_SLEW counts of the outstanding phase error.  In ADC_MODE_DMA_SCAN Timer3 is 
+ *                   shifted by the same number of cycles, so the sampling instants move with the tick.
+ */
+void SyncTick()
+{
+    int adjust;
+    long whole;
+    long drift;
+    int interval;
+    int corrected;
+    int change;
+
+    if (g_Config.SyncMode == SYNC_MASTER)
+    {
+        if (l_SyncCountdown == 0)
+        {
+            l_SyncCountdown = SyncIntervalTicks();
+            l_SyncSequence = (l_SyncSequence + 1) & 0xFF;
+            TransmitSyncFrame(l_SyncSequence, l_SyncTxPhase);
+            l_SyncTxPhase = SYNC_PHASE_INVALID;
+            g_SyncFrames++;
+        }
+        l_SyncCountdown--;
+        return;
+    }
+    if (g_Config.SyncMode != SYNC_SLAVE)
+    {
+        return;
+    }
+
+    // A new measurement replaces whatever phase error was left.  It was taken at the previous SYNC frame, so the adjustments
+    // made since then are added in.  The change from the last measurement that the adjustments don't explain is the drift 
+    // over one interval, which gives the trim that would cancel it, and g_SyncTrim moves 1/SYNC_TRIM_GAIN of the way there.
+    if (l_SyncPending)
+    {
+        interval = SyncIntervalTicks();
+        corrected = l_SyncPendingError + (l_SyncApplied - l_SyncPendingApplied);
+        g_SyncError = l_SyncPendingError;
+        if (l_SyncHaveError)
+        {
+            // The errors are each wrapped to +-half a period, so the change is too; one that crossed the wrap between
+            // frames is a drift of a few counts, not a whole period.
+            change = l_SyncPendingError - l_SyncLastError - (l_SyncPendingApplied - l_SyncLastApplied);
+            while (change >= ((TIMER1_PR1 + 1) / 2)) change -= TIMER1_PR1 + 1;
+            while (change < -((TIMER1_PR1 + 1) / 2)) change += TIMER1_PR1 + 1;
+            drift = -((long)change << 16) / interval;
+            g_SyncTrim += (drift - g_SyncTrim) / SYNC_TRIM_GAIN;
+        }
+        l_SyncLastError = l_SyncPendingError;
+        l_SyncLastApplied = l_SyncPendingApplied;
+        l_SyncHaveError = true;
+        l_SyncPhaseRemaining = corrected;
+        l_SyncPending = false;
+        g_SyncFrames++;
+    }
+
+    l_SyncTrimAccumulator += g_SyncTrim;
+    whole = l_SyncTrimAccumulator >> 16;
+    l_SyncTrimAccumulator -= whole << 16;
+    adjust = (int)whole;
+
+    // A late tick (positive error) needs shorter periods.
+    if (l_SyncPhaseRemaining > 0)
+    {
+        corrected = (l_SyncPhaseRemaining > SYNC_MAX_SLEW) ? SYNC_MAX_SLEW : l_SyncPhaseRemaining;
+        l_SyncPhaseRemaining -= corrected;
+        adjust -= corrected;
+    }
+    else if (l_SyncPhaseRemaining < 0)
+    {
+        corrected = (l_SyncPhaseRemaining < -SYNC_MAX_SLEW) ? SYNC_MAX_SLEW : -l_SyncPhaseRemaining;
+        l_SyncPhaseRemaining += corrected;
+        adjust += corrected;
+    }
+    if (adjust > SYNC_MAX_SLEW) adjust = SYNC_MAX_SLEW;
+    if (adjust < -SYNC_MAX_SLEW) adjust = -SYNC_MAX_SLEW;
+
+    PR1 = TIMER1_PR1 + adjust;
+    l_SyncApplied += adjust;
+    if (g_ADCAcquisitionMode == ADC_MODE_DMA_SCAN)
+    {
+        // Also with no adjustment, to finish a shift that didn't fit in the last tick's scan slot.
+        ADCScanTimerShift(adjust * 64);
+    }
+}
+
+/*
+ *      SyncTransmitted() - Master: the SYNC frame finished transmitting at TMR1 = 'phase' (from the ECAN interrupt).  The
+ *                          next SYNC frame carries it.
+ */
+void SyncTransmitted(unsigned int phase)
+{
+    l_SyncTxPhase = phase;
+}
+
+/*
+ *      SyncReceived() - Slave: a SYNC frame was received at TMR1 = 'rxphase' (from the ECAN interrupt).  It carries the 
+ *                       master's TMR1 at the end of the previous SYNC frame, and the end of a frame is the same instant on
+ *                       every node, so the difference from our own TMR1 when we received that frame is the phase error.  It is
+ *                       wrapped to +-half a period and handed to SyncTick().
+ */
+void SyncReceived(unsigned int sequence, unsigned int masterphase, unsigned int rxphase)
+{
+    int error;
+    int period = TIMER1_PR1 + 1;
+
+    if (g_Config.SyncMode != SYNC_SLAVE)
+    {
+        return;
+    }
+    if (l_SyncHaveRx && (sequence == ((l_SyncRxSequence + 1) & 0xFF)) && (masterphase != SYNC_PHASE_INVALID))
+    {
+        error = (int)masterphase - (int)l_SyncRxPhase;
+        while (error >= (period / 2)) error -= period;
+        while (error < -(period / 2)) error += period;
+        l_SyncPendingError = error;
+        l_SyncPendingApplied = l_SyncRxApplied;
+        l_SyncPending = true;
+    }
+    l_SyncRxSequence = sequence;
+    l_SyncRxPhase = rxphase;
+    l_SyncRxApplied = l_SyncApplied;
+    l_SyncHaveRx = true;
+}
 
@@ -12,7 +12,43 @@
 extern "C" {
 #endif
 
+// TMR1 counts every 64 instruction cycles (1.6us).  The period is PR1+1 counts, so 624 is exactly 1ms (40000 cycles, the
+// same as one ADC scan block).
+#define TIMER1_PR1              624
+#define TIMER1_TICKS_TO_US(t)   ((((unsigned int)(t)) * 8) / 5)
+
+// Multi-node sample time synchronisation (g_Config.SyncMode, see SyncTick())
+//      SYNC_OFF    - Free running Timer1
+//      SYNC_MASTER - Broadcast a SYNC frame on CanSync_ID every SyncInterval * 10ms (0 counts as 1)
+//      SYNC_SLAVE  - Follow the SYNC frames by trimming PR1 (and shifting Timer3 in ADC_MODE_DMA_SCAN)
+#define SYNC_OFF                0
+#define SYNC_MASTER             1
+#define SYNC_SLAVE              2
+
+// Largest change to one Timer1 period, in TMR1 counts.  Timer3 is shifted by the same amount, and a 10us scan slot can only
+// lose 2 counts (3.2us) and still leave the ADC enough sampling time.
+#define SYNC_MAX_SLEW           2
+// Each sync interval the frequency trim moves 1/SYNC_TRIM_GAIN of the way to the trim that cancels the measured drift.
+#define SYNC_TRIM_GAIN          4
+// A slave whose last phase error is within this many TMR1 counts (12.8us) reports itself synchronised (CAN_STATUS_SYNC).
+#define SYNC_LOCK_LIMIT         8
+// Phase a SYNC frame carries when the master has no valid phase for the previous one.
+#define SYNC_PHASE_INVALID      0xFFFF
+
+// The microsecond timebase (Timer4/5 as one 32 bit timer) counts at FCY/8 = 5MHz and rolls over once a second.
+#define TIMEBASE_TICKS_PER_US       5
+#define TIMEBASE_TICKS_PER_SECOND   5000000UL
+
 void SetupTimer1();
+void SetupTimebase();
+unsigned long ReadTimebase();
+void SyncTick();
+void SyncTransmitted(unsigned int phase);
+void SyncReceived(unsigned int sequence, unsigned int masterphase, unsigned int rxphase);
+
+extern int g_SyncError;
+extern long g_SyncTrim;
+extern unsigned int g_SyncFrames;
 
 
 #ifdef	__cplusplus